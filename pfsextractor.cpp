@@ -14,18 +14,46 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 #define  _CRT_SECURE_NO_WARNINGS
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <new>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PFS_HAVE_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #if defined(_WIN32) && !defined(WIN32)
 #define WIN32
 #endif
 
 #ifdef WIN32
+#define PATH_SEPARATORS "\\/"
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 bool isExistOnFs(const char* path) {
@@ -37,12 +65,125 @@ bool makeDirectory(const char* dir) {
     return (_mkdir(dir) == 0);
 }
 
-bool changeDirectory(const char* dir) {
-    return (_chdir(dir) == 0);
+// Remove directory with all files in it, subdirectories are not supported
+bool removeDirectory(const char* dir) {
+    struct _finddata_t data;
+    intptr_t handle = _findfirst((std::string(dir) + "\\*").c_str(), &data);
+    if (handle != -1) {
+        do {
+            if (!(data.attrib & _A_SUBDIR))
+                _unlink((std::string(dir) + "\\" + data.name).c_str());
+        } while (_findnext(handle, &data) == 0);
+        _findclose(handle);
+    }
+    return (_rmdir(dir) == 0);
+}
+
+bool syncFile(FILE* file) {
+    return (fflush(file) == 0 && _commit(_fileno(file)) == 0);
+}
+
+// Flush all files in directory to disk
+bool syncFilesystem(const char* dir) {
+    struct _finddata_t data;
+    bool result = true;
+    intptr_t handle = _findfirst((std::string(dir) + "\\*").c_str(), &data);
+    if (handle != -1) {
+        do {
+            if (data.attrib & _A_SUBDIR)
+                continue;
+            int fd = _open((std::string(dir) + "\\" + data.name).c_str(), _O_WRONLY | _O_BINARY);
+            if (fd < 0 || _commit(fd) != 0)
+                result = false;
+            if (fd >= 0)
+                _close(fd);
+        } while (_findnext(handle, &data) == 0);
+        _findclose(handle);
+    }
+    return result;
+}
+
+// Directory entries are flushed together with file data on Windows
+bool syncDirectoryEntry(const char* path) {
+    return true;
+}
+
+bool truncateFile(const char* path, uint64_t size) {
+    int fd = _open(path, _O_WRONLY | _O_BINARY);
+    if (fd < 0)
+        return false;
+    bool result = (_chsize_s(fd, size) == 0);
+    _close(fd);
+    return result;
+}
+
+int openFileRead(const char* path) {
+    return _open(path, _O_RDONLY | _O_BINARY);
+}
+
+void closeFile(int fd) {
+    _close(fd);
+}
+
+uint64_t getFileSize(int fd) {
+    __int64 size = _filelengthi64(fd);
+    return size < 0 ? 0 : (uint64_t)size;
+}
+
+// Read size bytes at offset, the file position is moved, so a descriptor must not be shared between threads
+bool readFileAt(int fd, void* buffer, size_t size, uint64_t offset) {
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+        return false;
+    return _read(fd, buffer, (unsigned int)size) == (int)size;
+}
+
+// Get size and modification time in nanoseconds of file
+bool getFileInfo(const char* path, uint64_t & size, uint64_t & modified) {
+    struct _stat64 buf;
+    if (_stat64(path, &buf))
+        return false;
+    size = (uint64_t)buf.st_size;
+    modified = (uint64_t)buf.st_mtime * 1000000000ULL;
+    return true;
+}
+
+// List regular files and subdirectories of directory
+bool listDirectory(const char* dir, std::vector<std::string> & files, std::vector<std::string> & directories) {
+    struct _finddata_t data;
+    intptr_t handle = _findfirst((std::string(dir) + "\\*").c_str(), &data);
+    if (handle == -1)
+        return false;
+    do {
+        if (!strcmp(data.name, ".") || !strcmp(data.name, ".."))
+            continue;
+        if (data.attrib & _A_SUBDIR)
+            directories.push_back(std::string(dir) + "\\" + data.name);
+        else
+            files.push_back(std::string(dir) + "\\" + data.name);
+    } while (_findnext(handle, &data) == 0);
+    _findclose(handle);
+    return true;
 }
 #else
+#define PATH_SEPARATORS "/"
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 bool isExistOnFs(const char* path) {
     struct stat buf;
     return (stat(path, &buf) == 0);
@@ -52,12 +193,437 @@ bool makeDirectory(const char* dir) {
     return (mkdir(dir, ACCESSPERMS) == 0);
 }
 
-bool changeDirectory(const char* dir) {
-    return (chdir(dir) == 0);
+// Remove directory with all files in it, subdirectories are not supported
+bool removeDirectory(const char* dir) {
+    DIR* handle = opendir(dir);
+    if (handle) {
+        struct dirent* entry;
+        while ((entry = readdir(handle)) != NULL) {
+            if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+                unlink((std::string(dir) + "/" + entry->d_name).c_str());
+        }
+        closedir(handle);
+    }
+    return (rmdir(dir) == 0);
+}
+
+bool syncFile(FILE* file) {
+    return (fflush(file) == 0 && fsync(fileno(file)) == 0);
+}
+
+bool truncateFile(const char* path, uint64_t size) {
+    return (truncate(path, (off_t)size) == 0);
+}
+
+// Reserve disk blocks for size bytes of file, so writes through a shared mapping can't run out of space
+bool allocateFile(int fd, uint64_t size) {
+#ifdef __APPLE__
+    (void)fd;
+    (void)size;
+    return false;
+#else
+    return (posix_fallocate(fd, 0, (off_t)size) == 0);
+#endif
+}
+
+int openFileRead(const char* path) {
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+void closeFile(int fd) {
+    close(fd);
+}
+
+uint64_t getFileSize(int fd) {
+    struct stat buf;
+    return fstat(fd, &buf) ? 0 : (uint64_t)buf.st_size;
+}
+
+// Read size bytes at offset without moving the file position
+bool readFileAt(int fd, void* buffer, size_t size, uint64_t offset) {
+    while (size) {
+        ssize_t done = pread(fd, buffer, size, (off_t)offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        buffer = (uint8_t*)buffer + done;
+        size -= (size_t)done;
+        offset += (uint64_t)done;
+    }
+    return true;
+}
+
+// Get size and modification time in nanoseconds of file
+bool getFileInfo(const char* path, uint64_t & size, uint64_t & modified) {
+    struct stat buf;
+    if (stat(path, &buf))
+        return false;
+    size = (uint64_t)buf.st_size;
+#ifdef __APPLE__
+    modified = (uint64_t)buf.st_mtimespec.tv_sec * 1000000000ULL + buf.st_mtimespec.tv_nsec;
+#else
+    modified = (uint64_t)buf.st_mtim.tv_sec * 1000000000ULL + buf.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+// Write size bytes at offset without moving the file position
+bool writeFileAt(int fd, const void* buffer, size_t size, uint64_t offset) {
+    while (size) {
+        ssize_t done = pwrite(fd, buffer, size, (off_t)offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        buffer = (const uint8_t*)buffer + done;
+        size -= (size_t)done;
+        offset += (uint64_t)done;
+    }
+    return true;
+}
+
+// Copy size bytes between files inside the kernel, returns number of bytes copied, 0 if not supported
+uint64_t copyFileRange(int in, uint64_t inOffset, int out, uint64_t outOffset, uint64_t size) {
+    uint64_t copied = 0;
+#if defined(__linux__) && defined(__NR_copy_file_range)
+    loff_t from = (loff_t)inOffset;
+    loff_t to = (loff_t)outOffset;
+    while (copied < size) {
+        ssize_t done = syscall(__NR_copy_file_range, in, &from, out, &to, (size_t)std::min(size - copied, (uint64_t)0x40000000), 0);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            break;
+        copied += (uint64_t)done;
+    }
+#endif
+    return copied;
+}
+
+// Copy file sharing its blocks with the original where the filesystem supports reflinks, cloned tells which was done
+bool cloneFile(const char* from, const char* to, bool & cloned) {
+    cloned = false;
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return false;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    bool result = true;
+#ifdef FICLONE
+    cloned = (ioctl(out, FICLONE, in) == 0);
+#endif
+    if (!cloned) {
+        struct stat buf;
+        uint64_t size = fstat(in, &buf) ? 0 : (uint64_t)buf.st_size;
+        uint64_t copied = copyFileRange(in, 0, out, 0, size);
+        std::vector<uint8_t> block(0x100000);
+        while (result && copied < size) {
+            ssize_t done = pread(in, block.data(), (size_t)std::min(size - copied, (uint64_t)block.size()), (off_t)copied);
+            result = (done > 0 && pwrite(out, block.data(), (size_t)done, (off_t)copied) == done);
+            copied += result ? (uint64_t)done : 0;
+        }
+    }
+    close(in);
+    return (close(out) == 0) && result;
+}
+
+// List regular files and subdirectories of directory, symbolic links are not followed
+bool listDirectory(const char* dir, std::vector<std::string> & files, std::vector<std::string> & directories) {
+    DIR* handle = opendir(dir);
+    if (!handle)
+        return false;
+    struct dirent* entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        std::string path = std::string(dir) + "/" + entry->d_name;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat buf;
+            if (lstat(path.c_str(), &buf))
+                continue;
+            type = S_ISDIR(buf.st_mode) ? DT_DIR : (S_ISREG(buf.st_mode) ? DT_REG : DT_UNKNOWN);
+        }
+        if (type == DT_DIR)
+            directories.push_back(path);
+        else if (type == DT_REG)
+            files.push_back(path);
+    }
+    closedir(handle);
+    return true;
+}
+
+// Flush filesystem containing directory to disk, with a single syncfs where available
+bool syncFilesystem(const char* dir) {
+#ifdef __linux__
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool result = (syncfs(fd) == 0);
+    close(fd);
+    return result;
+#else
+    sync();
+    return true;
+#endif
+}
+
+// Flush parent directory of path to disk, making creation or rename of path durable
+bool syncDirectoryEntry(const char* path) {
+    std::string parent = path;
+    size_t separator = parent.find_last_of(PATH_SEPARATORS);
+    parent = (separator == std::string::npos) ? "." : parent.substr(0, separator + 1);
+    int fd = open(parent.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool result = (fsync(fd) == 0);
+    close(fd);
+    return result;
+}
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PFS_HAVE_URING
+#endif
+#endif
+
+#ifdef PFS_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+// Minimal io_uring wrapper, used without liburing through raw system calls
+class PFS_URING {
+public:
+    PFS_URING() : fd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes((struct io_uring_sqe*)MAP_FAILED), sqTailLocal(0), inFlight(0) {}
+
+    ~PFS_URING() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqEntries * sizeof(struct io_uring_sqe));
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Set up rings, returns false if io_uring is not available
+    bool init(uint32_t entries) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0)
+            return false;
+
+        sqEntries = params.sq_entries;
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        cqRing = singleMap ? sqRing : mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+            return false;
+        sqes = (struct io_uring_sqe*)mmap(NULL, sqEntries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+
+        sqTail = (unsigned*)((uint8_t*)sqRing + params.sq_off.tail);
+        sqHead = (unsigned*)((uint8_t*)sqRing + params.sq_off.head);
+        sqMask = *(unsigned*)((uint8_t*)sqRing + params.sq_off.ring_mask);
+        sqArray = (unsigned*)((uint8_t*)sqRing + params.sq_off.array);
+        cqHead = (unsigned*)((uint8_t*)cqRing + params.cq_off.head);
+        cqTail = (unsigned*)((uint8_t*)cqRing + params.cq_off.tail);
+        cqMask = *(unsigned*)((uint8_t*)cqRing + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)((uint8_t*)cqRing + params.cq_off.cqes);
+        sqTailLocal = *sqTail;
+        return true;
+    }
+
+    uint32_t capacity() const { return sqEntries; }
+
+    // Get cleared submission queue entry, returns NULL if submission queue is full
+    struct io_uring_sqe* next() {
+        if (sqTailLocal - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+            return NULL;
+        unsigned index = sqTailLocal & sqMask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        sqTailLocal++;
+        return sqe;
+    }
+
+    // Submit all prepared entries and wait for waitCount completions
+    bool submit(unsigned waitCount) {
+        unsigned count = sqTailLocal - *sqTail;
+        __atomic_store_n(sqTail, sqTailLocal, __ATOMIC_RELEASE);
+        while (count || waitCount) {
+            int result = (int)syscall(__NR_io_uring_enter, fd, count, waitCount, waitCount ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (result < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            count -= std::min(count, (unsigned)result);
+            inFlight += (unsigned)result;
+            if (!count)
+                break;
+        }
+        return true;
+    }
+
+    // Get next completion, returns false if there is none
+    bool complete(struct io_uring_cqe & cqe) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            return false;
+        cqe = cqes[head & cqMask];
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        if (inFlight)
+            inFlight--;
+        return true;
+    }
+
+    // Wait for completions of all entries taken by the kernel and drop entries it has not taken yet,
+    // leaves the ring empty after a failed submit or an abandoned batch
+    void drain() {
+        struct io_uring_cqe cqe;
+        while (inFlight) {
+            if (complete(cqe))
+                continue;
+            if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                break;
+        }
+        while (complete(cqe))
+            ;
+        sqTailLocal = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        __atomic_store_n(sqTail, sqTailLocal, __ATOMIC_RELEASE);
+        inFlight = 0;
+    }
+
+private:
+    int fd;
+    void* sqRing;
+    void* cqRing;
+    struct io_uring_sqe* sqes;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    uint32_t sqEntries;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned sqTailLocal;
+    unsigned inFlight; // Entries taken by the kernel whose completions were not consumed yet
+};
+
+// Flush all files in directory and then the directory itself with batches of io_uring fsync requests
+// Falls back to syncFilesystem if io_uring is not available
+bool syncDirectoryUring(const char* dir) {
+    PFS_URING ring;
+    if (!ring.init(64))
+        return syncFilesystem(dir);
+
+    std::vector<int> fds;
+    DIR* handle = opendir(dir);
+    if (!handle)
+        return false;
+    struct dirent* entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+            int fd = open((std::string(dir) + "/" + entry->d_name).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0)
+                fds.push_back(fd);
+        }
+    }
+    closedir(handle);
+    int dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0)
+        return false;
+    fds.push_back(dirFd);
+
+    // Directory fsync is drained after all file fsyncs of its batch, the first failure stops batching
+    bool result = true;
+    size_t done = 0;
+    while (done < fds.size() && result) {
+        size_t batch = std::min(fds.size() - done, (size_t)ring.capacity());
+        for (size_t i = 0; i < batch && result; i++) {
+            struct io_uring_sqe* sqe = ring.next();
+            if (!sqe) {
+                result = false;
+                break;
+            }
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = fds[done + i];
+            sqe->fsync_flags = (fds[done + i] == dirFd) ? 0 : IORING_FSYNC_DATASYNC;
+            if (fds[done + i] == dirFd)
+                sqe->flags = IOSQE_IO_DRAIN;
+        }
+        if (!result || !ring.submit((unsigned)batch)) {
+            result = false;
+            break;
+        }
+        struct io_uring_cqe cqe;
+        for (size_t i = 0; i < batch && result; ) {
+            if (ring.complete(cqe)) {
+                if (cqe.res < 0)
+                    result = false;
+                i++;
+            }
+            else if (!ring.submit(1)) {
+                result = false;
+            }
+        }
+        done += batch;
+    }
+
+    // Requests still in flight use the files, wait for them before closing
+    ring.drain();
+    for (size_t i = 0; i < fds.size(); i++)
+        close(fds[i]);
+    return result;
+}
+#else
+bool syncDirectoryUring(const char* dir) {
+    return syncFilesystem(dir);
 }
 #endif
 
 
+// USDT static tracepoints for SystemTap, bpftrace and perf, provider name is pfsextractor
+// Every probe is a single nop instruction unless a tracer is attached
+// Probes are compiled out if PFS_USDT is not defined or sys/sdt.h is not available
+#if defined(PFS_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PFS_PROBE1(name, a) DTRACE_PROBE1(pfsextractor, name, a)
+#define PFS_PROBE2(name, a, b) DTRACE_PROBE2(pfsextractor, name, a, b)
+#define PFS_PROBE3(name, a, b, c) DTRACE_PROBE3(pfsextractor, name, a, b, c)
+#define PFS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(pfsextractor, name, a, b, c, d)
+#endif
+#endif
+#ifndef PFS_PROBE1
+#define PFS_PROBE1(name, a) do {} while (0)
+#define PFS_PROBE2(name, a, b) do {} while (0)
+#define PFS_PROBE3(name, a, b, c) do {} while (0)
+#define PFS_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+
 // PFS structure definitions
 #pragma pack(push, 1)
 typedef struct PFS_FILE_HEADER_ {
@@ -95,6 +661,21 @@ typedef struct PFS_SECTION_HEADER_ {
     uint32_t MetadataSignatureSize;
     EFI_GUID Guid2;
 } PFS_SECTION_HEADER;
+
+// Section header version 2 has the same fields as version 1 followed by 0x10 bytes of unknown data
+typedef struct PFS_SECTION_HEADER_V2_ {
+    EFI_GUID Guid1;
+    uint32_t HeaderVersion;
+    uint8_t  VersionType[4];
+    uint16_t Version[4];
+    uint64_t Reserved;
+    uint32_t DataSize;
+    uint32_t DataSignatureSize;
+    uint32_t MetadataSize;
+    uint32_t MetadataSignatureSize;
+    EFI_GUID Guid2;
+    uint8_t  Unknown[0x10];
+} PFS_SECTION_HEADER_V2;
 #pragma pack(pop)
 
 
@@ -104,7 +685,7 @@ const char* guid_to_string(const EFI_GUID* guid)
     if (!guid)
         return "";
 
-    char * str = (char*)malloc(37);
+    char * str = new char[37];
     sprintf(str, "%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
         guid->Data1, guid->Data2, guid->Data3,
         guid->Data4[0], guid->Data4[1], guid->Data4[2], guid->Data4[3],
@@ -113,232 +694,5077 @@ const char* guid_to_string(const EFI_GUID* guid)
 }
 
 
-// Write file function
-uint8_t write_file(const char* filename, uint8_t* buffer, size_t size) 
+// Microseconds since first call
+uint64_t clock_us()
 {
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        printf("write_file: can't create %s\n", filename);
-        return 1;
-    }
-
-    if (fwrite(buffer, 1, size, file) != size)
-    {
-        printf("write_file: can't write to %s\n", filename);
-        fclose(file);
-        return 2;
-    }
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
 
-    fclose(file);
-    return 0;
+// Milliseconds since first call
+uint64_t clock_ms()
+{
+    return clock_us() / 1000;
 }
 
 
-// Used for sorting subsection chunks using std::sort
-typedef struct PFS_CHUNK_ {
-    std::vector<char> data;
-    uint16_t          orderNum;
-    friend bool operator< (const struct PFS_CHUNK_ & lhs, const struct PFS_CHUNK_ & rhs){ return lhs.orderNum < rhs.orderNum; }
-} PFS_CHUNK;
+// Chrome trace-event timeline
+// Every thread records spans into its own ring buffer without locks, buffers are only taken and returned under a lock
+// A buffer returned by a finished thread is reused by the next new thread and continues its timeline track
+// When a ring buffer is full, the oldest spans in it are overwritten
+// Buffers are written out with pfs_trace_write after all traced threads are done
+#define PFS_TRACE_RING_SIZE 0x4000
+#define PFS_TRACE_DETAIL_SIZE 64
 
+typedef struct PFS_TRACE_EVENT_ {
+    const char* name;
+    uint64_t    startUs;
+    uint64_t    durationUs;
+    char        detail[PFS_TRACE_DETAIL_SIZE];
+} PFS_TRACE_EVENT;
 
-// Extract function
-uint8_t pfs_extract(const void* buffer, size_t bufferSize, const char* filename)
+typedef struct PFS_TRACE_RING_ {
+    uint32_t              threadId;
+    bool                  inUse;   // Owned by a running thread
+    std::atomic<uint64_t> written; // Number of events ever written, only the owner thread writes
+    PFS_TRACE_EVENT       events[PFS_TRACE_RING_SIZE];
+} PFS_TRACE_RING;
+
+bool traceEnabled = false;
+std::mutex traceLock;
+std::vector<PFS_TRACE_RING*> traceRings;
+
+// Ring buffer of current thread, returned for reuse when the thread exits
+typedef struct PFS_TRACE_OWNER_ {
+    PFS_TRACE_RING* ring;
+    PFS_TRACE_OWNER_() : ring(NULL) {}
+    ~PFS_TRACE_OWNER_() {
+        if (ring) {
+            std::lock_guard<std::mutex> guard(traceLock);
+            ring->inUse = false;
+        }
+    }
+} PFS_TRACE_OWNER;
+thread_local PFS_TRACE_OWNER traceOwner;
+
+// Record completed span into ring buffer of current thread
+void pfs_trace_record(const char* name, const char* detail, uint64_t startUs, uint64_t endUs)
 {
-    // Check arguments for sanity
-    if (!buffer || bufferSize < sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER)) {
-        printf("pfs_extract: input file too small\n");
-        return 1;
+    PFS_TRACE_RING* traceRing = traceOwner.ring;
+    if (!traceRing) {
+        std::lock_guard<std::mutex> guard(traceLock);
+        for (size_t i = 0; i < traceRings.size() && !traceRing; i++) {
+            if (!traceRings[i]->inUse)
+                traceRing = traceRings[i];
+        }
+        if (!traceRing) {
+            traceRing = new PFS_TRACE_RING;
+            traceRing->written = 0;
+            traceRing->threadId = (uint32_t)traceRings.size() + 1;
+            traceRings.push_back(traceRing);
+        }
+        traceRing->inUse = true;
+        traceOwner.ring = traceRing;
     }
 
-    bool isSubsection = (filename != NULL);
+    uint64_t index = traceRing->written.load(std::memory_order_relaxed);
+    PFS_TRACE_EVENT & event = traceRing->events[index % PFS_TRACE_RING_SIZE];
+    event.name = name;
+    event.startUs = startUs;
+    event.durationUs = endUs - startUs;
+    strncpy(event.detail, detail ? detail : "", PFS_TRACE_DETAIL_SIZE - 1);
+    event.detail[PFS_TRACE_DETAIL_SIZE - 1] = 0;
+    traceRing->written.store(index + 1, std::memory_order_release);
+}
 
-    // Show file header
-    const PFS_FILE_HEADER* fileHeader = (const PFS_FILE_HEADER*)buffer;
-    printf("PFS %s Header:\nSignature: %llX\nVersion:   %X\nDataSize:  %X\n\n",
-        isSubsection ? "Subsection File" : "File",
-        fileHeader->Signature,
-        fileHeader->HeaderVersion,
-        fileHeader->DataSize);
+// Span from construction to destruction, name must be a string literal
+class PFS_TRACE_SPAN {
+public:
+    PFS_TRACE_SPAN(const char* name, const char* detail = NULL) : name(name), detail(detail), startUs(traceEnabled ? clock_us() : 0), ended(false) {}
+    ~PFS_TRACE_SPAN() { end(); }
 
-    // Check file header info
-    if (fileHeader->Signature != PFS_HEADER_SIGNATURE) {
-        printf("pfs_extract: invalid PFS header signature\n");
-        return 1;
+    // End span before destruction
+    void end() {
+        if (traceEnabled && !ended)
+            pfs_trace_record(name, detail, startUs, clock_us());
+        ended = true;
     }
 
-    // Check signature version
-    if (fileHeader->HeaderVersion != 1) {
-        printf("pfs_extract: unknown PFS file header version %X\n", fileHeader->HeaderVersion);
-        return 1;
-    }
+private:
+    const char* name;
+    const char* detail;
+    uint64_t    startUs;
+    bool        ended;
+};
 
-    // Check file size
-    if (bufferSize < sizeof(PFS_FILE_HEADER) + fileHeader->DataSize + sizeof(PFS_FILE_FOOTER)) {
-        printf("pfs_extract: file size too small to fit the whole image\n");
-        return 1;
-    }
 
-    // Show file footer info
-    const PFS_FILE_FOOTER* fileFooter = (const PFS_FILE_FOOTER*)((uint8_t*)buffer + sizeof(PFS_FILE_HEADER) + fileHeader->DataSize);
-    printf("PFS %s Footer:\nSignature: %llX\nChecksum:  %X\nDataSize:  %X\n\n",
-        isSubsection ? "Subsection File" : "File",
-        fileFooter->Signature,
-        fileFooter->Checksum,
-        fileFooter->DataSize);
+// Metrics registry, exported in Prometheus text format
+// Every thread updates its own slab of counters without locks or atomic read-modify-write operations,
+// slabs are summed up only when metrics are read
+// A slab returned by a finished thread is reused by the next new thread, so its values are never lost
+#define PFS_METRIC_IMAGES          0 // Images extracted
+#define PFS_METRIC_IMAGES_FAILED   1 // Images failed to extract
+#define PFS_METRIC_BYTES_IN        2 // Bytes of input files read
+#define PFS_METRIC_BYTES_OUT       3 // Bytes of output files written
+#define PFS_METRIC_SECTIONS        4 // Top-level sections parsed
+#define PFS_METRIC_CHUNKS          5 // Subsection chunks reassembled
+#define PFS_METRIC_JOURNAL_SKIPPED 6 // Inputs skipped because the journal has them completed
+#define PFS_METRIC_COUNT           7
 
-    // Check footer signature
-    if (fileFooter->Signature != PFS_FOOTER_SIGNATURE) {
-        printf("pfs_extract: invalid PFS footer signature\n");
-        // Not a fatal error 
-    }
+// Phases with latency histograms
+#define PFS_PHASE_QUEUE   0 // Waiting for admission by scheduler
+#define PFS_PHASE_LOAD    1 // Reading input file
+#define PFS_PHASE_PLAN    2 // Parsing and building extraction plan
+#define PFS_PHASE_EXECUTE 3 // Writing output files
+#define PFS_PHASE_SYNC    4 // Flushing output to disk
+#define PFS_PHASE_REASSEMBLE 5 // Reassembling subsection payloads
+#define PFS_PHASE_COUNT   6
 
-    if (fileFooter->DataSize != fileHeader->DataSize) {
-        printf("pfs_extract: data size mismatch between PFS header (%X) and PFS footer (%X)\n",
-            fileHeader->DataSize,
-            fileFooter->DataSize);
-        // Not a fatal error
-    }
+// Names of phases, the extra last one stands for code outside of any phase
+const char* pfsPhaseNames[PFS_PHASE_COUNT + 1] = { "queue", "load", "plan", "execute", "sync", "reassemble", "other" };
 
-    const uint8_t* dataEnd = (const uint8_t*)(fileHeader + 1) + fileHeader->DataSize;
-    const PFS_SECTION_HEADER* sectionHeader = (const PFS_SECTION_HEADER*)(fileHeader + 1);
-    uint8_t sectionNum = 0;
-    std::vector<PFS_CHUNK> chunks;
-    while ((uint8_t*)sectionHeader < dataEnd) {
-        // Show section header info
-        const char* guid1 = guid_to_string(&sectionHeader->Guid1);
-        const char* guid2 = guid_to_string(&sectionHeader->Guid2);
-        printf("PFS %s Header #%d:\nGUID_1: %s\nGUID_2: %s\n"
-            "DataSize: %X\nDataSignatureSize: %X\nMetadataSize: %X\nMetadataSignatureSize: %X\n",
-            isSubsection ? "Subsection" : "Section",
-            sectionNum,
-            guid1,
-            guid2,
-            sectionHeader->DataSize,
-            sectionHeader->DataSignatureSize,
-            sectionHeader->MetadataSize,
-            sectionHeader->MetadataSignatureSize
-            );
-        delete(guid1);
-        delete(guid2);
+// Upper bounds of histogram buckets in microseconds, the last bucket is +Inf
+#define PFS_BUCKET_COUNT 14
+const uint64_t pfsBucketBoundsUs[PFS_BUCKET_COUNT - 1] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
 
-        // Show version
-        bool showVersion = false;
-        char version[30] = {0};
-        for (uint8_t i = 0; i < 4; i++) {
-            if (sectionHeader->VersionType[i] == 'A') {
-                char component[6];
-                sprintf(component, "%X.", sectionHeader->Version[i]);
-                strcat(version, component);
-            }
-            else if (sectionHeader->VersionType[i] == 'N') {
-                char component[7];
-                sprintf(component, "%d.", sectionHeader->Version[i]);
-                strcat(version, component);
-            }
-            else if (sectionHeader->VersionType[i] == ' ' || sectionHeader->VersionType[i] == 0) {
-                break;
-            }
-            else {
-                printf("pfs_extract: unknown version type %X, value %X\n", sectionHeader->VersionType[i], sectionHeader->Version[i]);
-            }
-        }
-        if (version[0] != 0) {
-            printf("Version: %s\n", version);
-        }
-        else {
-            version[0] = '.';
-        }
-        printf("\n");
+typedef struct PFS_METRIC_SLAB_ {
+    bool                  inUse;
+    std::atomic<uint64_t> counters[PFS_METRIC_COUNT];
+    std::atomic<uint64_t> buckets[PFS_PHASE_COUNT][PFS_BUCKET_COUNT];
+    std::atomic<uint64_t> sumUs[PFS_PHASE_COUNT];
+} PFS_METRIC_SLAB;
 
-        // Extract section data, dataSignature, pmim and pmimSignature
-        uint8_t* ptr = (uint8_t*)(sectionHeader + 1);
-        
-        char filename[240];
-        if (sectionHeader->DataSize) {
-            if (isSubsection) {
-                // Each subsection has 0x248 bytes of data before the actual payload
-                // Structure and purpose of this data is unknown, and the only thing required from that block
-                // to properly reconstruct full subsection payload is the order number at offset 0x3E
-                PFS_CHUNK chunk;
-                chunk.orderNum = *(uint16_t*)(ptr + 0x3E); // Get chunk order number
-                chunk.data = std::vector<char>(ptr + 0x248, ptr + sectionHeader->DataSize); // Get chunk data, skipping first 0x248 bytes
-                chunks.push_back(chunk);
-            }
-            else {
-                sprintf(filename, "section_%d_%sdata", sectionNum, version);
-                write_file(filename, ptr, sectionHeader->DataSize);
-                if (*(uint64_t*)ptr == PFS_HEADER_SIGNATURE) { // Data is a PFS subsection
-                    sprintf(filename, "section_%d_%spayload", sectionNum, version);
-                    pfs_extract(ptr, sectionHeader->DataSize, filename);
-                }
-            }
-        }
-        ptr += sectionHeader->DataSize;
-        if (sectionHeader->DataSignatureSize) {
-            if (!isSubsection) {
-                sprintf(filename, "section_%d_%ssign", sectionNum, version);
-                write_file(filename, ptr, sectionHeader->DataSignatureSize);
-            }
-        }
-        ptr += sectionHeader->DataSignatureSize;
-        if (sectionHeader->MetadataSize) {
-            if (!isSubsection) {
-                sprintf(filename, "section_%d_%smeta", sectionNum, version);
-                write_file(filename, ptr, sectionHeader->MetadataSize);
-            }
-        }
-        ptr += sectionHeader->MetadataSize;
-        if (sectionHeader->MetadataSignatureSize) {
-            if (!isSubsection) {
-                sprintf(filename, "section_%d_%smtsg", sectionNum, version);
-                write_file(filename, ptr, sectionHeader->MetadataSignatureSize);
-            }
-        }
-        ptr += sectionHeader->MetadataSignatureSize;
+std::mutex metricsLock;
+std::vector<PFS_METRIC_SLAB*> metricSlabs;
 
-        sectionNum++;
-        sectionHeader = (const PFS_SECTION_HEADER*)ptr;
+// Slab of current thread, returned for reuse when the thread exits
+typedef struct PFS_METRIC_OWNER_ {
+    PFS_METRIC_SLAB* slab;
+    PFS_METRIC_OWNER_() : slab(NULL) {}
+    ~PFS_METRIC_OWNER_() {
+        if (slab) {
+            std::lock_guard<std::mutex> guard(metricsLock);
+            slab->inUse = false;
+        }
     }
+} PFS_METRIC_OWNER;
+thread_local PFS_METRIC_OWNER metricOwner;
 
-    if (isSubsection) {
-        // Sort chunks according to order number
-        std::sort(chunks.begin(), chunks.end());
+PFS_METRIC_SLAB* pfs_metric_slab()
+{
+    if (metricOwner.slab)
+        return metricOwner.slab;
 
-        // Append all sorted chunks into file
-        std::vector<char> out;
-        for (size_t i = 0; i < chunks.size(); i++) {
-            out.insert(out.end(), chunks.at(i).data.begin(), chunks.at(i).data.end());
+    std::lock_guard<std::mutex> guard(metricsLock);
+    PFS_METRIC_SLAB* slab = NULL;
+    for (size_t i = 0; i < metricSlabs.size() && !slab; i++) {
+        if (!metricSlabs[i]->inUse)
+            slab = metricSlabs[i];
+    }
+    if (!slab) {
+        slab = new PFS_METRIC_SLAB;
+        for (uint32_t i = 0; i < PFS_METRIC_COUNT; i++)
+            slab->counters[i] = 0;
+        for (uint32_t p = 0; p < PFS_PHASE_COUNT; p++) {
+            for (uint32_t b = 0; b < PFS_BUCKET_COUNT; b++)
+                slab->buckets[p][b] = 0;
+            slab->sumUs[p] = 0;
         }
-
-        // Write resulting file
-        write_file(filename, (uint8_t*)out.data(), out.size());
+        metricSlabs.push_back(slab);
     }
+    slab->inUse = true;
+    metricOwner.slab = slab;
+    return slab;
+}
+
+// Add value to counter, only the owner thread writes its slab
+inline void pfs_metric_add(uint32_t metric, uint64_t value)
+{
+    std::atomic<uint64_t> & counter = pfs_metric_slab()->counters[metric];
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Add phase duration to latency histogram
+void pfs_metric_observe(uint32_t phase, uint64_t durationUs)
+{
+    PFS_METRIC_SLAB* slab = pfs_metric_slab();
+    uint32_t bucket = 0;
+    while (bucket < PFS_BUCKET_COUNT - 1 && durationUs > pfsBucketBoundsUs[bucket])
+        bucket++;
+    slab->buckets[phase][bucket].store(slab->buckets[phase][bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    slab->sumUs[phase].store(slab->sumUs[phase].load(std::memory_order_relaxed) + durationUs, std::memory_order_relaxed);
+}
+
+// Additional gauges appended to metrics text, set by the batch runner
+std::function<std::string()> metricsGauges;
+
+// Get all metrics in Prometheus text exposition format
+std::string pfs_metrics_text()
+{
+    static const char* counterNames[PFS_METRIC_COUNT][2] = {
+        { "pfs_images_total", "Images extracted" },
+        { "pfs_images_failed_total", "Images failed to extract" },
+        { "pfs_input_bytes_total", "Bytes of input files read" },
+        { "pfs_output_bytes_total", "Bytes of output files written" },
+        { "pfs_sections_total", "Top-level sections parsed" },
+        { "pfs_chunks_total", "Subsection chunks reassembled" },
+        { "pfs_journal_skipped_total", "Inputs skipped as completed by a previous run" } };
+
+    uint64_t counters[PFS_METRIC_COUNT] = { 0 };
+    uint64_t buckets[PFS_PHASE_COUNT][PFS_BUCKET_COUNT] = { { 0 } };
+    uint64_t sumUs[PFS_PHASE_COUNT] = { 0 };
+    {
+        std::lock_guard<std::mutex> guard(metricsLock);
+        for (size_t i = 0; i < metricSlabs.size(); i++) {
+            const PFS_METRIC_SLAB* slab = metricSlabs[i];
+            for (uint32_t m = 0; m < PFS_METRIC_COUNT; m++)
+                counters[m] += slab->counters[m].load(std::memory_order_relaxed);
+            for (uint32_t p = 0; p < PFS_PHASE_COUNT; p++) {
+                for (uint32_t b = 0; b < PFS_BUCKET_COUNT; b++)
+                    buckets[p][b] += slab->buckets[p][b].load(std::memory_order_relaxed);
+                sumUs[p] += slab->sumUs[p].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::string text;
+    char line[256];
+    for (uint32_t m = 0; m < PFS_METRIC_COUNT; m++) {
+        sprintf(line, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            counterNames[m][0], counterNames[m][1], counterNames[m][0], counterNames[m][0], (unsigned long long)counters[m]);
+        text += line;
+    }
+
+    text += "# HELP pfs_phase_duration_seconds Duration of extraction phases\n# TYPE pfs_phase_duration_seconds histogram\n";
+    for (uint32_t p = 0; p < PFS_PHASE_COUNT; p++) {
+        uint64_t cumulative = 0;
+        for (uint32_t b = 0; b < PFS_BUCKET_COUNT; b++) {
+            cumulative += buckets[p][b];
+            if (b < PFS_BUCKET_COUNT - 1)
+                sprintf(line, "pfs_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", pfsPhaseNames[p], pfsBucketBoundsUs[b] / 1e6, (unsigned long long)cumulative);
+            else
+                sprintf(line, "pfs_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", pfsPhaseNames[p], (unsigned long long)cumulative);
+            text += line;
+        }
+        sprintf(line, "pfs_phase_duration_seconds_sum{phase=\"%s\"} %.6f\npfs_phase_duration_seconds_count{phase=\"%s\"} %llu\n",
+            pfsPhaseNames[p], sumUs[p] / 1e6, pfsPhaseNames[p], (unsigned long long)cumulative);
+        text += line;
+    }
+
+    if (metricsGauges)
+        text += metricsGauges();
+    return text;
+}
+
+// Interval of periodic metrics file updates in seconds
+#define PFS_METRICS_INTERVAL 5
+
+// Write metrics to node_exporter textfile, replaced atomically with rename
+bool pfs_metrics_write(const char* filename)
+{
+    std::string temporary = std::string(filename) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        return false;
+    std::string text = pfs_metrics_text();
+    bool result = fwrite(text.data(), 1, text.size(), file) == text.size();
+    result = (fclose(file) == 0) && result;
+    return result && rename(temporary.c_str(), filename) == 0;
+}
+
+
+// Allocation profiling, enabled with --profile-alloc
+// Input and reassembly buffers are always counted, all other allocations only in builds with PFS_ALLOC_PROFILING,
+// where replaced operator new and delete keep size and owner profile of every block in a header in front of it
+// Allocations are counted for the phase and image of the allocating thread and released from the same profile
+#define PFS_ALLOC_PHASES (PFS_PHASE_COUNT + 1)
+
+typedef struct PFS_ALLOC_PROFILE_ {
+    std::atomic<uint64_t> count[PFS_ALLOC_PHASES];
+    std::atomic<uint64_t> bytes[PFS_ALLOC_PHASES];
+    std::atomic<uint64_t> peak[PFS_ALLOC_PHASES]; // Peak of live bytes while allocating in phase
+    std::atomic<uint64_t> live;
+    struct PFS_ALLOC_PROFILE_* next;              // Free list link
+} PFS_ALLOC_PROFILE;
+
+std::atomic<bool> allocProfiling(false);
+PFS_ALLOC_PROFILE allocTotal;
+std::mutex allocLock;
+PFS_ALLOC_PROFILE* allocFree = NULL;
+
+// Phase and image profile of current thread
+thread_local uint8_t allocPhase = PFS_PHASE_COUNT;
+thread_local PFS_ALLOC_PROFILE* allocImage = NULL;
+
+void pfs_alloc_profile_add(PFS_ALLOC_PROFILE* profile, uint8_t phase, size_t size)
+{
+    profile->count[phase].fetch_add(1, std::memory_order_relaxed);
+    profile->bytes[phase].fetch_add(size, std::memory_order_relaxed);
+    uint64_t live = profile->live.fetch_add(size, std::memory_order_relaxed) + size;
+    uint64_t peak = profile->peak[phase].load(std::memory_order_relaxed);
+    while (live > peak && !profile->peak[phase].compare_exchange_weak(peak, live, std::memory_order_relaxed))
+        ;
+}
+
+// Count allocation of size bytes, returns profile to release it from later or NULL if profiling is off
+PFS_ALLOC_PROFILE* pfs_alloc_acquire(size_t size)
+{
+    if (!allocProfiling.load(std::memory_order_relaxed))
+        return NULL;
+    pfs_alloc_profile_add(&allocTotal, allocPhase, size);
+    if (!allocImage)
+        return &allocTotal;
+    pfs_alloc_profile_add(allocImage, allocPhase, size);
+    return allocImage;
+}
+
+void pfs_alloc_release(PFS_ALLOC_PROFILE* profile, size_t size)
+{
+    if (!profile)
+        return;
+    allocTotal.live.fetch_sub(size, std::memory_order_relaxed);
+    if (profile != &allocTotal)
+        profile->live.fetch_sub(size, std::memory_order_relaxed);
+}
+
+// Get empty profile for an image, profiles are allocated outside of the hooks and reused
+PFS_ALLOC_PROFILE* pfs_alloc_profile_open()
+{
+    PFS_ALLOC_PROFILE* profile;
+    {
+        std::lock_guard<std::mutex> guard(allocLock);
+        profile = allocFree;
+        if (profile)
+            allocFree = profile->next;
+    }
+    if (!profile) {
+        profile = (PFS_ALLOC_PROFILE*)malloc(sizeof(PFS_ALLOC_PROFILE));
+        if (!profile)
+            return NULL;
+    }
+    for (uint32_t p = 0; p < PFS_ALLOC_PHASES; p++) {
+        profile->count[p] = 0;
+        profile->bytes[p] = 0;
+        profile->peak[p] = 0;
+    }
+    profile->live = 0;
+    profile->next = NULL;
+    return profile;
+}
+
+// Return profile, a profile with blocks still alive is kept forever since their headers point to it
+void pfs_alloc_profile_close(PFS_ALLOC_PROFILE* profile)
+{
+    if (!profile || profile->live.load())
+        return;
+    std::lock_guard<std::mutex> guard(allocLock);
+    profile->next = allocFree;
+    allocFree = profile;
+}
+
+// Set allocation phase of current thread, restores previous phase and image on scope exit
+class PFS_ALLOC_SCOPE {
+public:
+    explicit PFS_ALLOC_SCOPE(uint8_t phase) : savedPhase(allocPhase), savedImage(allocImage) { allocPhase = phase; }
+    PFS_ALLOC_SCOPE(uint8_t phase, PFS_ALLOC_PROFILE* image) : savedPhase(allocPhase), savedImage(allocImage) {
+        allocPhase = phase;
+        allocImage = image;
+    }
+    ~PFS_ALLOC_SCOPE() {
+        allocPhase = savedPhase;
+        allocImage = savedImage;
+    }
+
+private:
+    uint8_t savedPhase;
+    PFS_ALLOC_PROFILE* savedImage;
+
+    PFS_ALLOC_SCOPE(const PFS_ALLOC_SCOPE &);
+    PFS_ALLOC_SCOPE & operator=(const PFS_ALLOC_SCOPE &);
+};
+
+// Profile allocations of one image made by current thread and pool tasks it submits while in scope
+class PFS_ALLOC_IMAGE {
+public:
+    PFS_ALLOC_IMAGE() : profile(allocProfiling ? pfs_alloc_profile_open() : NULL), scope(PFS_PHASE_COUNT, profile) {}
+    ~PFS_ALLOC_IMAGE() { pfs_alloc_profile_close(profile); }
+
+    const PFS_ALLOC_PROFILE* data() const { return profile; }
+
+private:
+    PFS_ALLOC_PROFILE* profile;
+    PFS_ALLOC_SCOPE scope;
+
+    PFS_ALLOC_IMAGE(const PFS_ALLOC_IMAGE &);
+    PFS_ALLOC_IMAGE & operator=(const PFS_ALLOC_IMAGE &);
+};
+
+// Print allocations per phase, phases without allocations are skipped
+void pfs_alloc_print(const char* prefix, const PFS_ALLOC_PROFILE & profile)
+{
+    for (uint32_t p = 0; p < PFS_ALLOC_PHASES; p++) {
+        if (!profile.count[p].load())
+            continue;
+        printf("%s %s: %llu allocations, %llu bytes, peak live %llu bytes\n",
+            prefix,
+            pfsPhaseNames[p],
+            (unsigned long long)profile.count[p].load(),
+            (unsigned long long)profile.bytes[p].load(),
+            (unsigned long long)profile.peak[p].load());
+    }
+}
+
+#ifdef PFS_ALLOC_PROFILING
+// Header in front of every block allocated with operator new, keeps blocks aligned as malloc does
+typedef union PFS_ALLOC_HEADER_ {
+    struct {
+        size_t size;
+        PFS_ALLOC_PROFILE* profile;
+    } block;
+    std::max_align_t align;
+} PFS_ALLOC_HEADER;
+
+void* pfs_alloc_new(size_t size)
+{
+    PFS_ALLOC_HEADER* header = (PFS_ALLOC_HEADER*)malloc(sizeof(PFS_ALLOC_HEADER) + size);
+    if (!header)
+        return NULL;
+    header->block.size = size;
+    header->block.profile = pfs_alloc_acquire(size);
+    return header + 1;
+}
+
+void pfs_alloc_delete(void* ptr)
+{
+    if (!ptr)
+        return;
+    PFS_ALLOC_HEADER* header = (PFS_ALLOC_HEADER*)ptr - 1;
+    pfs_alloc_release(header->block.profile, header->block.size);
+    free(header);
+}
+
+void* operator new(size_t size)
+{
+    void* ptr = pfs_alloc_new(size);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    void* ptr = pfs_alloc_new(size);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t &) noexcept { return pfs_alloc_new(size); }
+void* operator new[](size_t size, const std::nothrow_t &) noexcept { return pfs_alloc_new(size); }
+void operator delete(void* ptr) noexcept { pfs_alloc_delete(ptr); }
+void operator delete[](void* ptr) noexcept { pfs_alloc_delete(ptr); }
+void operator delete(void* ptr, const std::nothrow_t &) noexcept { pfs_alloc_delete(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t &) noexcept { pfs_alloc_delete(ptr); }
+#endif
+
+
+// Durability statistics
+std::atomic<uint64_t> durableSyncs(0); // Number of sync calls
+std::atomic<uint64_t> durableUs(0);    // Time spent in sync calls
+
+// Flush file data to disk and account it in durability statistics
+bool syncFileData(int fd)
+{
+    uint64_t start = clock_us();
+#ifdef WIN32
+    bool result = (_commit(fd) == 0);
+#elif defined(__linux__)
+    bool result = (fdatasync(fd) == 0);
+#else
+    bool result = (fsync(fd) == 0);
+#endif
+    durableSyncs++;
+    durableUs += clock_us() - start;
+    return result;
+}
+
+
+// Output of extraction jobs
+// Every job prints into its own buffer that is written to standard output at once when the job ends,
+// so reports of images extracted at the same time with --jobs don't interleave
+class PFS_JOB_OUTPUT;
+thread_local PFS_JOB_OUTPUT* jobOutput = NULL;
+std::mutex jobOutputLock;
+
+class PFS_JOB_OUTPUT {
+public:
+    // Output of a job nested in another one on the same thread is printed when the nested job ends
+    PFS_JOB_OUTPUT() : saved(jobOutput) { jobOutput = this; }
+
+    ~PFS_JOB_OUTPUT() {
+        jobOutput = saved;
+        std::lock_guard<std::mutex> guard(jobOutputLock);
+        fwrite(text.data(), 1, text.size(), stdout);
+        fflush(stdout);
+    }
+
+    void append(const char* format, va_list args) {
+        char line[512];
+        va_list copy;
+        va_copy(copy, args);
+        int length = vsnprintf(line, sizeof(line), format, copy);
+        va_end(copy);
+        if (length <= 0)
+            return;
+        std::lock_guard<std::mutex> guard(lock);
+        if (length < (int)sizeof(line)) {
+            text.append(line, length);
+            return;
+        }
+        size_t start = text.size();
+        text.resize(start + length + 1);
+        vsnprintf(&text[start], length + 1, format, args);
+        text.resize(start + length);
+    }
+
+    // Drop everything printed so far
+    void discard() {
+        std::lock_guard<std::mutex> guard(lock);
+        text.clear();
+    }
+
+private:
+    std::mutex  lock; // Pool threads of the job print into the same buffer
+    std::string text;
+    PFS_JOB_OUTPUT* saved;
+
+    PFS_JOB_OUTPUT(const PFS_JOB_OUTPUT &);
+    PFS_JOB_OUTPUT & operator=(const PFS_JOB_OUTPUT &);
+};
+
+// Print into output of the job running on this thread, or to standard output if there is none
+void pfs_printf(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (jobOutput)
+        jobOutput->append(format, args);
+    else
+        vprintf(format, args);
+    va_end(args);
+}
+
+
+// Write file function
+uint8_t write_file(const char* filename, uint8_t* buffer, size_t size, bool sync = false)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        pfs_printf("write_file: can't create %s\n", filename);
+        return 1;
+    }
+
+    if (fwrite(buffer, 1, size, file) != size)
+    {
+        pfs_printf("write_file: can't write to %s\n", filename);
+        fclose(file);
+        return 2;
+    }
+
+    if (sync && (fflush(file) || !syncFileData(fileno(file)))) {
+        pfs_printf("write_file: can't flush %s to disk\n", filename);
+        fclose(file);
+        return 3;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+
+// FNV-1a 64-bit hash, pass the previous result to hash data in parts
+#define PFS_HASH_INIT 0xCBF29CE484222325ULL
+uint64_t pfs_hash(const void* data, size_t size, uint64_t hash = PFS_HASH_INIT)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ptr[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+
+// CRC-32 (IEEE 802.3, reflected) computed 8 bytes at a time, pass the previous result to checksum data in parts
+// Checksum in PFS file footer is the inverted CRC-32 of the data between file header and footer
+typedef struct PFS_CRC32_TABLE_ {
+    uint32_t table[8][256];
+    PFS_CRC32_TABLE_() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (uint32_t bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (uint32_t slice = 1; slice < 8; slice++)
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+        }
+    }
+} PFS_CRC32_TABLE;
+
+uint32_t pfs_crc32(const void* data, size_t size, uint32_t crc = 0)
+{
+    static const PFS_CRC32_TABLE crcTable;
+    const uint32_t (*table)[256] = crcTable.table;
+    const uint8_t* ptr = (const uint8_t*)data;
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, ptr, sizeof(low));
+        memcpy(&high, ptr + 4, sizeof(high));
+        low ^= crc;
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+            ^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+        ptr += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = table[0][(crc ^ *ptr++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+// Multiply polynomials a and b modulo CRC-32 polynomial, in reflected bit order, a must not be 0
+uint32_t pfs_crc32_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1U << 31;
+    uint32_t product = 0;
+    for (;;) {
+        if (a & m) {
+            product ^= b;
+            if (!(a & (m - 1)))
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+    return product;
+}
+
+// Move CRC-32 state over size bytes of zeros, which is multiplication by x^(8 * size)
+uint32_t pfs_crc32_shift(uint32_t crc, uint64_t size)
+{
+    // Powers x^(2^k) modulo polynomial
+    static const struct PFS_CRC32_POWERS_ {
+        uint32_t power[64];
+        PFS_CRC32_POWERS_() {
+            uint32_t p = 1U << 30; // x^1
+            for (uint32_t k = 0; k < 64; k++) {
+                power[k] = p;
+                p = pfs_crc32_multiply(p, p);
+            }
+        }
+    } powers;
+
+    uint32_t k = 3; // x^8 per byte
+    while (size) {
+        if (size & 1)
+            crc = pfs_crc32_multiply(powers.power[k], crc);
+        size >>= 1;
+        k++;
+    }
+    return crc;
+}
+
+// Check checksum updates of pfs_patch against pfs_crc32, returns false on mismatch
+// Shifting over zeros must match pfs_crc32 of zeros, and replacing bytes of data must change its CRC-32
+// by the CRC of the differences without initial and final inversion, shifted over the bytes after them
+bool pfs_crc32_self_check()
+{
+    std::vector<uint8_t> data(0x30000);
+    uint64_t random = PFS_HASH_INIT;
+    for (size_t i = 0; i < data.size(); i++) {
+        random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = (uint8_t)(random >> 56);
+    }
+    const size_t sizes[] = { 0, 1, 7, 8, 4095, 0x10000, 0x2FFFF };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        std::vector<uint8_t> zeros(sizes[i], 0);
+        uint32_t crc = pfs_crc32(data.data(), 64);
+        if (pfs_crc32(zeros.data(), zeros.size(), crc) != ~pfs_crc32_shift(~crc, zeros.size()))
+            return false;
+    }
+
+    std::vector<uint8_t> patched = data;
+    uint32_t original = pfs_crc32(data.data(), data.size());
+    size_t start = 0x1234;
+    size_t size = 0x10001;
+    std::vector<uint8_t> differences(size);
+    for (size_t i = 0; i < size; i++) {
+        patched[start + i] = (uint8_t)~patched[start + i] + (uint8_t)i;
+        differences[i] = data[start + i] ^ patched[start + i];
+    }
+    uint32_t delta = pfs_crc32_shift(~pfs_crc32(differences.data(), size, ~0U), data.size() - start - size);
+    return pfs_crc32(patched.data(), patched.size()) == (original ^ delta);
+}
+
+
+// Subsection chunk prefix
+// Each subsection chunk has 0x248 bytes of data before the actual payload
+// Structure and purpose of this data is mostly unknown, and the only thing required from that block
+// to properly reconstruct full subsection payload is the order number at offset 0x3E
+#pragma pack(push, 1)
+typedef struct PFS_CHUNK_PREFIX_ {
+    uint8_t  Unknown0[0x3E];
+    uint16_t OrderNumber;
+    uint8_t  Unknown1[0x208];
+} PFS_CHUNK_PREFIX;
+#pragma pack(pop)
+
+// Get chunk order number from chunk prefix
+inline uint16_t pfs_chunk_order(const PFS_CHUNK_PREFIX* prefix)
+{
+    return prefix->OrderNumber;
+}
+
+// Get chunk payload that follows chunk prefix
+inline const uint8_t* pfs_chunk_payload(const PFS_CHUNK_PREFIX* prefix)
+{
+    return (const uint8_t*)(prefix + 1);
+}
+
+
+// Section regions in the order they follow section header
+#define PFS_REGION_DATA      0
+#define PFS_REGION_SIGNATURE 1
+#define PFS_REGION_METADATA  2
+#define PFS_REGION_METADATA_SIGNATURE 3
+#define PFS_REGION_COUNT     4
+const char* pfsRegionNames[PFS_REGION_COUNT] = { "data", "sign", "meta", "mtsg" };
+
+// Format traits, one per combination of file header version and section header version
+// Every trait provides section header layout, region order, chunk prefix size and order number offset,
+// parsers are instantiated once per trait so the section loop has no version checks
+struct PFS_FORMAT_V1 {
+    typedef PFS_SECTION_HEADER SectionHeader;
+    enum {
+        FileVersion = 1,
+        SectionVersion = 1,
+        ChunkPrefixSize = sizeof(PFS_CHUNK_PREFIX),
+        OrderNumberOffset = offsetof(PFS_CHUNK_PREFIX, OrderNumber)
+    };
+
+    // Get region sizes in file order, region numbers are stored in regions
+    static inline void layout(const SectionHeader* header, uint8_t regions[PFS_REGION_COUNT], uint32_t sizes[PFS_REGION_COUNT])
+    {
+        regions[0] = PFS_REGION_DATA;               sizes[0] = header->DataSize;
+        regions[1] = PFS_REGION_SIGNATURE;          sizes[1] = header->DataSignatureSize;
+        regions[2] = PFS_REGION_METADATA;           sizes[2] = header->MetadataSize;
+        regions[3] = PFS_REGION_METADATA_SIGNATURE; sizes[3] = header->MetadataSignatureSize;
+    }
+
+    // Set size of region in header
+    static inline void resize(SectionHeader* header, uint8_t region, uint32_t size)
+    {
+        uint32_t* sizes[PFS_REGION_COUNT] = { &header->DataSize, &header->DataSignatureSize, &header->MetadataSize, &header->MetadataSignatureSize };
+        *sizes[region] = size;
+    }
+};
+
+// Version 2 section headers are longer, regions and chunks are the same as in version 1
+struct PFS_FORMAT_V1_R2 : PFS_FORMAT_V1 {
+    typedef PFS_SECTION_HEADER_V2 SectionHeader;
+    enum {
+        SectionVersion = 2
+    };
+
+    static inline void layout(const SectionHeader* header, uint8_t regions[PFS_REGION_COUNT], uint32_t sizes[PFS_REGION_COUNT])
+    {
+        PFS_FORMAT_V1::layout((const PFS_SECTION_HEADER*)header, regions, sizes);
+    }
+
+    static inline void resize(SectionHeader* header, uint8_t region, uint32_t size)
+    {
+        PFS_FORMAT_V1::resize((PFS_SECTION_HEADER*)header, region, size);
+    }
+};
+
+
+// Subsection chunk flags
+#define PFS_CHUNK_FLAG_TRUNCATED 0x01 // Chunk data is smaller than chunk prefix
+#define PFS_CHUNK_FLAG_DUPLICATE 0x02 // Another chunk has the same order number
+#define PFS_CHUNK_FLAG_GAP       0x04 // Chunk with previous order number is missing
+
+// Subsection chunk table, one entry per chunk in every array
+typedef struct PFS_CHUNK_TABLE_ {
+    std::vector<uint16_t> orderNum; // Chunk order number
+    std::vector<uint32_t> offset;   // Offset of chunk payload from base passed to pfs_chunk_table_add
+    std::vector<uint32_t> length;   // Size of chunk payload
+    std::vector<uint8_t>  flags;    // PFS_CHUNK_FLAG_*
+} PFS_CHUNK_TABLE;
+
+// Add chunk from subsection section data to chunk table
+template <class Format = PFS_FORMAT_V1>
+void pfs_chunk_table_add(PFS_CHUNK_TABLE & table, const uint8_t* base, const uint8_t* data, uint32_t dataSize)
+{
+    uint16_t order = 0;
+    if (dataSize >= Format::OrderNumberOffset + sizeof(order))
+        memcpy(&order, data + Format::OrderNumberOffset, sizeof(order));
+    if (dataSize < (uint32_t)Format::ChunkPrefixSize) {
+        table.orderNum.push_back(order);
+        table.offset.push_back((uint32_t)(data - base));
+        table.length.push_back(0);
+        table.flags.push_back(PFS_CHUNK_FLAG_TRUNCATED);
+        return;
+    }
+
+    table.orderNum.push_back(order);
+    table.offset.push_back((uint32_t)(data + Format::ChunkPrefixSize - base));
+    table.length.push_back(dataSize - (uint32_t)Format::ChunkPrefixSize);
+    table.flags.push_back(0);
+}
+
+// Get chunk indices sorted by chunk order number, chunks with equal order numbers stay in file order
+std::vector<uint32_t> pfs_chunk_table_order(const PFS_CHUNK_TABLE & table)
+{
+    std::vector<uint32_t> order(table.orderNum.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    const uint16_t* orderNum = table.orderNum.data();
+    std::stable_sort(order.begin(), order.end(), [orderNum](uint32_t lhs, uint32_t rhs) { return orderNum[lhs] < orderNum[rhs]; });
+    return order;
+}
+
+// Validate chunk table, returns the number of chunks with problems
+size_t pfs_chunk_table_validate(PFS_CHUNK_TABLE & table)
+{
+    std::vector<uint32_t> order = pfs_chunk_table_order(table);
+    for (size_t i = 1; i < order.size(); i++) {
+        uint16_t prev = table.orderNum[order[i - 1]];
+        uint16_t curr = table.orderNum[order[i]];
+        if (curr == prev)
+            table.flags[order[i]] |= PFS_CHUNK_FLAG_DUPLICATE;
+        else if (curr != prev + 1)
+            table.flags[order[i]] |= PFS_CHUNK_FLAG_GAP;
+    }
+
+    size_t problems = 0;
+    for (size_t i = 0; i < table.flags.size(); i++) {
+        if (table.flags[i])
+            problems++;
+    }
+    return problems;
+}
+
+// Get total size of reassembled subsection payload
+uint64_t pfs_chunk_table_size(const PFS_CHUNK_TABLE & table)
+{
+    uint64_t size = 0;
+    for (size_t i = 0; i < table.length.size(); i++)
+        size += table.length[i];
+    return size;
+}
+
+// Reassemble subsection payload from chunks into buffer of pfs_chunk_table_size() bytes
+void pfs_chunk_table_reassemble(const PFS_CHUNK_TABLE & table, const uint8_t* base, uint8_t* out)
+{
+    std::vector<uint32_t> order = pfs_chunk_table_order(table);
+    for (size_t i = 0; i < order.size(); i++) {
+        memcpy(out, base + table.offset[order[i]], table.length[order[i]]);
+        out += table.length[order[i]];
+    }
+}
+
+
+// Metadata region parser
+// Metadata region is a list of fixed-width NUL-padded ASCII fields in the order of pfsMetadataNames,
+// the layout public PFS tools describe, so field names are not stored in the region
+// Values end at the first NUL of their field, NUL is searched 16 bytes at a time with SSE2,
+// fields are offsets into the region so nothing is allocated
+#define PFS_METADATA_MAX_FIELDS 8
+const char* pfsMetadataNames[PFS_METADATA_MAX_FIELDS] = { "ModelIDs", "FileName", "FileVersion", "Date", "Brand", "ModelFile", "ModelName", "ModelVersion" };
+const uint32_t pfsMetadataWidths[PFS_METADATA_MAX_FIELDS] = { 501, 100, 33, 33, 80, 80, 100, 33 };
+
+typedef struct PFS_METADATA_FIELD_ {
+    uint32_t key;         // Index of field name in pfsMetadataNames
+    uint32_t valueOffset; // Offset of value from the start of region
+    uint32_t valueLength;
+} PFS_METADATA_FIELD;
+
+typedef struct PFS_METADATA_ {
+    uint32_t           count;
+    uint32_t           ignoredSize; // Bytes of region past the last known field, not parsed
+    PFS_METADATA_FIELD fields[PFS_METADATA_MAX_FIELDS];
+    PFS_METADATA_() : count(0), ignoredSize(0) {}
+} PFS_METADATA;
+
+// Get index of lowest set bit, value must not be zero
+inline uint32_t pfs_lowest_bit(uint32_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctz(value);
+#endif
+}
+
+// Index of the highest set bit, value must not be zero
+inline uint32_t pfs_highest_bit(uint32_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return (uint32_t)index;
+#else
+    return 31 - (uint32_t)__builtin_clz(value);
+#endif
+}
+
+// Get length of NUL-padded string in field of size bytes a byte at a time
+size_t pfs_metadata_length_scalar(const uint8_t* data, size_t size)
+{
+    size_t length = 0;
+    while (length < size && data[length])
+        length++;
+    return length;
+}
+
+// Get length of NUL-padded string in field of size bytes, 16 bytes at a time
+size_t pfs_metadata_length(const uint8_t* data, size_t size)
+{
+    size_t block = 0;
+#ifdef PFS_HAVE_SSE2
+    for (; block + 16 <= size; block += 16) {
+        uint32_t zeros = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + block)), _mm_setzero_si128()));
+        if (zeros)
+            return block + pfs_lowest_bit(zeros);
+    }
+#endif
+    return block + pfs_metadata_length_scalar(data + block, size - block);
+}
+
+// Parse metadata region into fields, empty fields are skipped and the last field may be cut short by the end of region
+// Bytes past the last known field are counted in ignoredSize, returns the number of fields
+uint32_t pfs_metadata_parse(const uint8_t* data, uint32_t size, PFS_METADATA & metadata,
+    size_t (*length)(const uint8_t*, size_t) = pfs_metadata_length)
+{
+    metadata.count = 0;
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < PFS_METADATA_MAX_FIELDS && offset < size; i++) {
+        uint32_t width = std::min(pfsMetadataWidths[i], size - offset);
+        uint32_t valueLength = (uint32_t)length(data + offset, width);
+        if (valueLength) {
+            PFS_METADATA_FIELD & field = metadata.fields[metadata.count++];
+            field.key = i;
+            field.valueOffset = offset;
+            field.valueLength = valueLength;
+        }
+        offset += width;
+    }
+    metadata.ignoredSize = size - offset;
+    return metadata.count;
+}
+
+// Packed version key, version components from the most significant 16 bits down, components after the end of version are zero
+// 'A' components are shown in hex and 'N' components in decimal, both from the same 16-bit value,
+// so comparing keys as integers orders versions the same way as comparing their components one by one
+uint64_t pfs_version_key(const uint8_t* versionType, const uint16_t* version)
+{
+    uint64_t key = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+        if (versionType[i] == ' ' || versionType[i] == 0)
+            break;
+        key |= (uint64_t)version[i] << (48 - 16 * i);
+    }
+    return key;
+}
+
+// Version key of an item in a group, e.g. of a section in the group of sections with the same GUID
+typedef struct PFS_VERSION_ENTRY_ {
+    uint64_t key;
+    uint32_t group; // Dense group number
+    uint32_t item;  // Index of item in caller's table
+} PFS_VERSION_ENTRY;
+
+// Sort entries by group and then by version key with LSD radix sort on 16-bit digits, equal entries keep their order
+// Passes over digits that are the same in all entries are skipped
+void pfs_version_sort(std::vector<PFS_VERSION_ENTRY> & entries)
+{
+    std::vector<PFS_VERSION_ENTRY> sorted(entries.size());
+    std::vector<uint32_t> counts(0x10000);
+    for (uint32_t pass = 0; pass < 6 && entries.size() > 1; pass++) {
+        uint32_t shift = (pass < 4) ? 16 * pass : 16 * (pass - 4);
+        auto digit = [pass, shift](const PFS_VERSION_ENTRY & entry) {
+            return (uint32_t)((pass < 4 ? entry.key : entry.group) >> shift) & 0xFFFF;
+        };
+
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < entries.size(); i++)
+            counts[digit(entries[i])]++;
+        if (counts[digit(entries[0])] == entries.size())
+            continue;
+
+        uint32_t position = 0;
+        for (uint32_t d = 0; d < counts.size(); d++) {
+            uint32_t count = counts[d];
+            counts[d] = position;
+            position += count;
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+            sorted[counts[digit(entries[i])]++] = entries[i];
+        entries.swap(sorted);
+    }
+}
+
+// Get the entry with the latest version of every group, in group order
+// Of entries with equal latest versions the last one is taken
+std::vector<PFS_VERSION_ENTRY> pfs_version_latest(std::vector<PFS_VERSION_ENTRY> entries)
+{
+    pfs_version_sort(entries);
+    std::vector<PFS_VERSION_ENTRY> latest;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (i + 1 == entries.size() || entries[i + 1].group != entries[i].group)
+            latest.push_back(entries[i]);
+    }
+    return latest;
+}
+
+
+// Extraction plan entry types
+#define PFS_PLAN_COPY   0 // Write a single range of input buffer
+#define PFS_PLAN_GATHER 1 // Write subsection payload reassembled from chunks
+
+// Extraction plan entry, describes a single output file
+typedef struct PFS_PLAN_ENTRY_ {
+    std::string     filename;
+    uint8_t         type;    // PFS_PLAN_*
+    uint32_t        section; // Number of top-level section this file belongs to
+    uint64_t        offset;  // Offset of copied range from the start of base or input buffer, PFS_PLAN_COPY only
+    uint64_t        size;    // Size of output file
+    PFS_CHUNK_TABLE chunks;  // Chunks with offsets from the start of base or input buffer, PFS_PLAN_GATHER only
+    uint32_t        headerSize; // Section header size of chunks, PFS_PLAN_GATHER only
+    const uint8_t*  base;    // Buffer offsets are relative to instead of input buffer, NULL for input buffer
+    const uint8_t*  payload; // Payload already reassembled while planning, PFS_PLAN_GATHER only, NULL if not reassembled yet
+} PFS_PLAN_ENTRY;
+
+// Top-level section of extraction plan
+typedef struct PFS_PLAN_SECTION_ {
+    uint32_t    number;
+    uint64_t    headerOffset; // Offset of section header from the start of input buffer
+    uint32_t    headerSize;   // Size of section header
+    EFI_GUID    guid;
+    std::string guidString;
+    std::string version;      // Version as used in output file names
+    uint64_t    versionKey;   // Packed version key, see pfs_version_key
+    uint32_t    dataSize;
+    uint32_t    dataSignatureSize;
+    uint32_t    metadataSize;
+    uint32_t    metadataSignatureSize;
+    std::string metadata;     // Copy of metadata region
+    PFS_METADATA metadataFields; // Fields of metadata region
+} PFS_PLAN_SECTION;
+
+// FFS file found in UEFI firmware volume
+typedef struct PFS_UEFI_FILE_ {
+    EFI_GUID    guid;
+    uint8_t     type;     // EFI_FV_FILETYPE_*
+    bool        encapsulated; // File has compressed or signed sections that were not walked
+    uint64_t    offset;   // Offset of file header from the start of payload
+    uint64_t    size;     // Size of file including its header
+    uint32_t    sections; // Number of sections, including sections in walked encapsulation sections
+    std::string name;     // Name from user interface section, empty if there is none
+} PFS_UEFI_FILE;
+
+// UEFI firmware volume found in reassembled payload
+typedef struct PFS_UEFI_VOLUME_ {
+    EFI_GUID    fileSystem;
+    EFI_GUID    name;     // Name from extended header, zero if there is none
+    uint64_t    offset;   // Offset of volume header from the start of payload
+    uint64_t    size;
+    int32_t     parent;   // Index of volume holding this one in a firmware volume image section, -1 for none
+    std::vector<PFS_UEFI_FILE> files;
+} PFS_UEFI_VOLUME;
+
+// UEFI firmware volumes of a reassembled payload
+typedef struct PFS_UEFI_INDEX_ {
+    std::string payload;  // Name of payload file
+    std::vector<PFS_UEFI_VOLUME> volumes;
+} PFS_UEFI_INDEX;
+
+class PFS_POOL;
+
+// Extraction plan
+typedef struct PFS_PLAN_ {
+    std::vector<PFS_PLAN_SECTION> sections;
+    std::vector<PFS_PLAN_ENTRY> entries;
+    uint64_t totalBytes;  // Sum of all output file sizes
+    uint64_t gatherBytes; // Sum of all reassembled payload sizes
+    uint32_t chunkCount;  // Number of chunks in all gathers
+    uint32_t maxDepth;    // Number of levels of reassembled subsection payloads descended into
+    bool     walkUefi;    // Index UEFI firmware volumes in reassembled subsection payloads
+    PFS_POOL* pool;       // Pool of the caller walking UEFI firmware volumes, NULL to walk them on the calling thread
+    std::deque<std::vector<uint8_t> > payloads; // Payloads reassembled while planning, entries are written from them
+    std::vector<PFS_UEFI_INDEX> uefi; // UEFI firmware volumes in plan order of their payloads
+    std::vector<EFI_GUID> guids; // GUID_1 of sections at every level, subsections and sections of nested images included, runs of equal GUIDs stored once
+    PFS_PLAN_() : totalBytes(0), gatherBytes(0), chunkCount(0), maxDepth(0), walkUefi(false), pool(NULL) {}
+} PFS_PLAN;
+
+// Image nested in a subsection payload reassembled in memory
+// Output files of nested images are named after the payload file followed by a dot and their own name,
+// e.g. section_1_1.2.payload.section_0_3.4.data, and belong to the top-level section of the payload
+typedef struct PFS_PLAN_NEST_ {
+    std::string prefix;  // Output file name prefix
+    uint32_t    section; // Top-level section the payload belongs to
+    uint32_t    depth;   // Number of payloads the image is nested in
+} PFS_PLAN_NEST;
+
+// Add single range output file to extraction plan
+void pfs_plan_copy(PFS_PLAN & plan, const char* filename, uint32_t section, const uint8_t* input, const uint8_t* data, uint32_t size, const uint8_t* base)
+{
+    PFS_PLAN_ENTRY entry;
+    entry.filename = filename;
+    entry.type = PFS_PLAN_COPY;
+    entry.section = section;
+    entry.offset = data - input;
+    entry.size = size;
+    entry.headerSize = 0;
+    entry.base = base;
+    entry.payload = NULL;
+    plan.totalBytes += size;
+    plan.entries.push_back(entry);
+}
+
+
+// Subsections are planned recursively with their own format
+uint8_t pfs_plan(const void* buffer, size_t bufferSize, const char* filename, const uint8_t* input, uint32_t parentSection, PFS_PLAN & plan,
+    const PFS_PLAN_NEST* nest = NULL);
+
+// Index UEFI firmware volumes in reassembled payload
+void pfs_uefi_index(const uint8_t* payload, uint64_t size, const std::string & filename, PFS_PLAN & plan);
+
+// Descend into subsection payload of the last plan entry if it holds another PFS image or UEFI firmware volumes are indexed
+// Payloads reassembled here are kept in plan and the entry is written from them instead of being reassembled again
+void pfs_plan_descend(const PFS_CHUNK_TABLE & chunks, const uint8_t* input, uint64_t size, const std::string & filename, uint32_t section, uint32_t depth,
+    PFS_PLAN & plan)
+{
+    if (!size || chunks.orderNum.empty())
+        return;
+
+    // Check signature in the first chunk before reassembling the whole payload
+    std::vector<uint32_t> order = pfs_chunk_table_order(chunks);
+    bool nested = size >= sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER)
+        && (chunks.length[order[0]] < sizeof(uint64_t) || *(const uint64_t*)(input + chunks.offset[order[0]]) == PFS_HEADER_SIGNATURE);
+    if (nested && depth >= plan.maxDepth) {
+        pfs_printf("pfs_extract: %s may hold another PFS image, maximum depth %u reached\n", filename.c_str(), plan.maxDepth);
+        nested = false;
+    }
+    if (!nested && !plan.walkUefi)
+        return;
+
+    PFS_TRACE_SPAN span("descend", filename.c_str());
+    plan.payloads.push_back(std::vector<uint8_t>());
+    std::vector<uint8_t> & payload = plan.payloads.back();
+    payload.resize((size_t)size);
+    pfs_chunk_table_reassemble(chunks, input, payload.data());
+    plan.entries.back().payload = payload.data();
+    if (nested && *(const uint64_t*)payload.data() == PFS_HEADER_SIGNATURE) {
+        PFS_PLAN_NEST nest;
+        nest.prefix = filename + ".";
+        nest.section = section;
+        nest.depth = depth + 1;
+        if (pfs_plan(payload.data(), payload.size(), NULL, payload.data(), section, plan, &nest)) {
+            pfs_printf("pfs_extract: nested image in %s can't be parsed\n", filename.c_str());
+            // Not a fatal error, files of nested image planned so far are still extracted
+        }
+        return;
+    }
+
+    if (plan.walkUefi)
+        pfs_uefi_index(payload.data(), payload.size(), filename, plan);
+}
+
+// Section parser for a single format, adds output files of all sections that follow file header to extraction plan
+template <class Format>
+uint8_t pfs_plan_sections(const PFS_FILE_HEADER* fileHeader, const char* filename, const uint8_t* input, uint32_t parentSection, PFS_PLAN & plan,
+    const PFS_PLAN_NEST* nest)
+{
+    typedef typename Format::SectionHeader SectionHeader;
+
+    bool isSubsection = (filename != NULL);
+    const uint8_t* base = nest ? input : NULL;
+    const char* prefix = nest ? nest->prefix.c_str() : "";
+    const uint8_t* dataEnd = (const uint8_t*)(fileHeader + 1) + fileHeader->DataSize;
+    const SectionHeader* sectionHeader = (const SectionHeader*)(fileHeader + 1);
+    uint8_t sectionNum = 0;
+    PFS_CHUNK_TABLE chunks;
+    while ((uint8_t*)sectionHeader < dataEnd) {
+        PFS_TRACE_SPAN span(isSubsection ? "parse subsection" : "parse section");
+        // Format is chosen once per image, so all sections must have the same header version
+        if (sectionHeader->HeaderVersion != (uint32_t)Format::SectionVersion) {
+            pfs_printf("pfs_extract: %s %d has header version %X, expected %X\n",
+                isSubsection ? "subsection" : "section",
+                sectionNum,
+                sectionHeader->HeaderVersion,
+                (uint32_t)Format::SectionVersion);
+            return 1;
+        }
+
+        // Show section header info
+        const char* guid1 = guid_to_string(&sectionHeader->Guid1);
+        const char* guid2 = guid_to_string(&sectionHeader->Guid2);
+        pfs_printf("PFS %s Header #%d:\nGUID_1: %s\nGUID_2: %s\n"
+            "DataSize: %X\nDataSignatureSize: %X\nMetadataSize: %X\nMetadataSignatureSize: %X\n",
+            isSubsection ? "Subsection" : "Section",
+            sectionNum,
+            guid1,
+            guid2,
+            sectionHeader->DataSize,
+            sectionHeader->DataSignatureSize,
+            sectionHeader->MetadataSize,
+            sectionHeader->MetadataSignatureSize
+            );
+        delete[] guid1;
+        delete[] guid2;
+
+        // Show version
+        char version[30] = {0};
+        for (uint8_t i = 0; i < 4; i++) {
+            if (sectionHeader->VersionType[i] == 'A') {
+                char component[6];
+                sprintf(component, "%X.", sectionHeader->Version[i]);
+                strcat(version, component);
+            }
+            else if (sectionHeader->VersionType[i] == 'N') {
+                char component[7];
+                sprintf(component, "%d.", sectionHeader->Version[i]);
+                strcat(version, component);
+            }
+            else if (sectionHeader->VersionType[i] == ' ' || sectionHeader->VersionType[i] == 0) {
+                break;
+            }
+            else {
+                pfs_printf("pfs_extract: unknown version type %X, value %X\n", sectionHeader->VersionType[i], sectionHeader->Version[i]);
+            }
+        }
+        if (version[0] != 0) {
+            pfs_printf("Version: %s\n", version);
+        }
+        else {
+            version[0] = '.';
+        }
+        pfs_printf("\n");
+
+        // Add section to section table, sections of nested images belong to the top-level section of their payload
+        uint32_t section = nest ? nest->section : sectionNum;
+        if (plan.guids.empty() || memcmp(&plan.guids.back(), &sectionHeader->Guid1, sizeof(EFI_GUID)))
+            plan.guids.push_back(sectionHeader->Guid1);
+        if (!isSubsection && !nest) {
+            PFS_PLAN_SECTION section;
+            section.number = sectionNum;
+            section.headerOffset = (const uint8_t*)sectionHeader - input;
+            section.headerSize = sizeof(SectionHeader);
+            section.guid = sectionHeader->Guid1;
+            const char* guid = guid_to_string(&sectionHeader->Guid1);
+            section.guidString = guid;
+            delete[] guid;
+            section.version = version;
+            section.versionKey = pfs_version_key(sectionHeader->VersionType, sectionHeader->Version);
+            section.dataSize = sectionHeader->DataSize;
+            section.dataSignatureSize = sectionHeader->DataSignatureSize;
+            section.metadataSize = sectionHeader->MetadataSize;
+            section.metadataSignatureSize = sectionHeader->MetadataSignatureSize;
+            plan.sections.push_back(section);
+        }
+
+        // Extract section data, dataSignature, pmim and pmimSignature in the order defined by format
+        uint8_t regions[PFS_REGION_COUNT];
+        uint32_t sizes[PFS_REGION_COUNT];
+        Format::layout(sectionHeader, regions, sizes);
+        uint8_t* ptr = (uint8_t*)(sectionHeader + 1);
+
+        char filename[240];
+        for (uint8_t i = 0; i < PFS_REGION_COUNT; i++) {
+            if (regions[i] == PFS_REGION_METADATA && sizes[i] && !isSubsection && !nest) {
+                PFS_PLAN_SECTION & planSection = plan.sections.back();
+                planSection.metadata.assign((const char*)ptr, sizes[i]);
+                pfs_metadata_parse((const uint8_t*)planSection.metadata.data(), sizes[i], planSection.metadataFields);
+                if (planSection.metadataFields.ignoredSize)
+                    pfs_printf("pfs_extract: last %u bytes of section %d metadata are past known fields and not parsed\n",
+                        planSection.metadataFields.ignoredSize, sectionNum);
+            }
+            if (sizes[i]) {
+                if (isSubsection) {
+                    // Each subsection has a chunk prefix before the actual payload
+                    if (regions[i] == PFS_REGION_DATA)
+                        pfs_chunk_table_add<Format>(chunks, input, ptr, sizes[i]);
+                }
+                else {
+                    snprintf(filename, sizeof(filename), "%ssection_%d_%s%s", prefix, sectionNum, version, pfsRegionNames[regions[i]]);
+                    pfs_plan_copy(plan, filename, section, input, ptr, sizes[i], base);
+                    if (regions[i] == PFS_REGION_DATA && *(uint64_t*)ptr == PFS_HEADER_SIGNATURE) { // Data is a PFS subsection
+                        snprintf(filename, sizeof(filename), "%ssection_%d_%spayload", prefix, sectionNum, version);
+                        pfs_plan(ptr, sizes[i], filename, input, section, plan, nest);
+                    }
+                }
+            }
+            ptr += sizes[i];
+        }
+
+        sectionNum++;
+        sectionHeader = (const SectionHeader*)ptr;
+    }
+
+    if (isSubsection) {
+        // Check that chunk set is complete
+        if (pfs_chunk_table_validate(chunks)) {
+            for (size_t i = 0; i < chunks.flags.size(); i++) {
+                if (chunks.flags[i] & PFS_CHUNK_FLAG_TRUNCATED)
+                    pfs_printf("pfs_extract: subsection chunk %d is truncated\n", (int)i);
+                if (chunks.flags[i] & PFS_CHUNK_FLAG_DUPLICATE)
+                    pfs_printf("pfs_extract: subsection chunk %d has duplicate order number %X\n", (int)i, chunks.orderNum[i]);
+                if (chunks.flags[i] & PFS_CHUNK_FLAG_GAP)
+                    pfs_printf("pfs_extract: subsection chunks before order number %X are missing\n", chunks.orderNum[i]);
+            }
+            // Not a fatal error
+        }
+
+        // Append all chunks sorted by order number into file
+        PFS_PLAN_ENTRY entry;
+        entry.filename = filename;
+        entry.type = PFS_PLAN_GATHER;
+        entry.section = parentSection;
+        entry.offset = 0;
+        entry.size = pfs_chunk_table_size(chunks);
+        entry.chunks = chunks;
+        entry.headerSize = sizeof(SectionHeader);
+        entry.base = base;
+        entry.payload = NULL;
+        plan.totalBytes += entry.size;
+        plan.gatherBytes += entry.size;
+        plan.chunkCount += (uint32_t)chunks.orderNum.size();
+        plan.entries.push_back(entry);
+
+        // Reassembled payload may hold another image
+        pfs_plan_descend(chunks, input, entry.size, entry.filename, parentSection, nest ? nest->depth : 0, plan);
+    }
+
+    return 0;
+}
+
+// Section header traits of format for code that isn't instantiated per format, such as repack and patch
+template <class Format>
+void pfs_format_layout(const uint8_t* header, uint8_t regions[PFS_REGION_COUNT], uint32_t sizes[PFS_REGION_COUNT])
+{
+    Format::layout((const typename Format::SectionHeader*)header, regions, sizes);
+}
+
+template <class Format>
+void pfs_format_resize(uint8_t* header, uint8_t region, uint32_t size)
+{
+    Format::resize((typename Format::SectionHeader*)header, region, size);
+}
+
+// Supported formats, new formats are added here together with their traits
+typedef struct PFS_FORMAT_ {
+    uint32_t fileVersion;
+    uint32_t sectionVersion;
+    uint32_t sectionHeaderSize;
+    uint32_t chunkPrefixSize;
+    uint8_t (*plan)(const PFS_FILE_HEADER* fileHeader, const char* filename, const uint8_t* input, uint32_t parentSection, PFS_PLAN & plan,
+        const PFS_PLAN_NEST* nest);
+    void (*layout)(const uint8_t* header, uint8_t regions[PFS_REGION_COUNT], uint32_t sizes[PFS_REGION_COUNT]);
+    void (*resize)(uint8_t* header, uint8_t region, uint32_t size);
+} PFS_FORMAT;
+
+#define PFS_FORMAT_ENTRY(Format) { Format::FileVersion, Format::SectionVersion, sizeof(Format::SectionHeader), Format::ChunkPrefixSize, \
+    pfs_plan_sections<Format>, pfs_format_layout<Format>, pfs_format_resize<Format> }
+
+const PFS_FORMAT pfsFormats[] = {
+    PFS_FORMAT_ENTRY(PFS_FORMAT_V1),
+    PFS_FORMAT_ENTRY(PFS_FORMAT_V1_R2),
+};
+
+// Largest section header of all supported formats
+#define PFS_SECTION_HEADER_MAX sizeof(PFS_SECTION_HEADER_V2)
+
+// Find format by file header version and section header version, returns NULL for unsupported versions
+const PFS_FORMAT* pfs_format_find(uint32_t fileVersion, uint32_t sectionVersion)
+{
+    for (size_t i = 0; i < sizeof(pfsFormats) / sizeof(pfsFormats[0]); i++) {
+        if (pfsFormats[i].fileVersion == fileVersion && pfsFormats[i].sectionVersion == sectionVersion)
+            return &pfsFormats[i];
+    }
+    return NULL;
+}
+
+// Find format of image the way pfs_plan chooses it, by the header version of its first section
+// Images without sections use the first format of their file version, returns NULL for unsupported versions
+const PFS_FORMAT* pfs_format_of(const uint8_t* image, uint64_t size)
+{
+    if (size < sizeof(PFS_FILE_HEADER))
+        return NULL;
+    const PFS_FILE_HEADER* fileHeader = (const PFS_FILE_HEADER*)image;
+    if (fileHeader->DataSize >= offsetof(PFS_SECTION_HEADER, VersionType) && size >= sizeof(PFS_FILE_HEADER) + offsetof(PFS_SECTION_HEADER, VersionType))
+        return pfs_format_find(fileHeader->HeaderVersion, ((const PFS_SECTION_HEADER*)(fileHeader + 1))->HeaderVersion);
+    for (size_t i = 0; i < sizeof(pfsFormats) / sizeof(pfsFormats[0]); i++) {
+        if (pfsFormats[i].fileVersion == fileHeader->HeaderVersion)
+            return &pfsFormats[i];
+    }
+    return NULL;
+}
+
+// Get section header size, returns 0 for unsupported versions
+uint32_t pfs_section_header_size(uint32_t fileVersion, uint32_t sectionVersion)
+{
+    const PFS_FORMAT* format = pfs_format_find(fileVersion, sectionVersion);
+    return format ? format->sectionHeaderSize : 0;
+}
+
+// Plan function, parses PFS file or subsection in buffer and adds its output files to extraction plan
+// Images nested in reassembled payloads are planned with nest set, their offsets are relative to input
+uint8_t pfs_plan(const void* buffer, size_t bufferSize, const char* filename, const uint8_t* input, uint32_t parentSection, PFS_PLAN & plan,
+    const PFS_PLAN_NEST* nest)
+{
+    // Check arguments for sanity
+    if (!buffer || bufferSize < sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER)) {
+        pfs_printf("pfs_extract: input file too small\n");
+        return 1;
+    }
+
+    bool isSubsection = (filename != NULL);
+
+    // Show file header
+    const PFS_FILE_HEADER* fileHeader = (const PFS_FILE_HEADER*)buffer;
+    pfs_printf("PFS %s Header:\nSignature: %llX\nVersion:   %X\nDataSize:  %X\n\n",
+        isSubsection ? "Subsection File" : "File",
+        fileHeader->Signature,
+        fileHeader->HeaderVersion,
+        fileHeader->DataSize);
+
+    // Check file header info
+    if (fileHeader->Signature != PFS_HEADER_SIGNATURE) {
+        pfs_printf("pfs_extract: invalid PFS header signature\n");
+        return 1;
+    }
+
+    // Check signature version
+    const PFS_FORMAT* format = NULL;
+    for (size_t i = 0; i < sizeof(pfsFormats) / sizeof(pfsFormats[0]) && !format; i++) {
+        if (pfsFormats[i].fileVersion == fileHeader->HeaderVersion)
+            format = &pfsFormats[i];
+    }
+    if (!format) {
+        pfs_printf("pfs_extract: unknown PFS file header version %X\n", fileHeader->HeaderVersion);
+        return 1;
+    }
+
+    // Check file size
+    if (bufferSize < sizeof(PFS_FILE_HEADER) + fileHeader->DataSize + sizeof(PFS_FILE_FOOTER)) {
+        pfs_printf("pfs_extract: file size too small to fit the whole image\n");
+        return 1;
+    }
+
+    // Show file footer info
+    const PFS_FILE_FOOTER* fileFooter = (const PFS_FILE_FOOTER*)((uint8_t*)buffer + sizeof(PFS_FILE_HEADER) + fileHeader->DataSize);
+    pfs_printf("PFS %s Footer:\nSignature: %llX\nChecksum:  %X\nDataSize:  %X\n\n",
+        isSubsection ? "Subsection File" : "File",
+        fileFooter->Signature,
+        fileFooter->Checksum,
+        fileFooter->DataSize);
+
+    // Check footer signature
+    if (fileFooter->Signature != PFS_FOOTER_SIGNATURE) {
+        pfs_printf("pfs_extract: invalid PFS footer signature\n");
+        // Not a fatal error 
+    }
+
+    if (fileFooter->DataSize != fileHeader->DataSize) {
+        pfs_printf("pfs_extract: data size mismatch between PFS header (%X) and PFS footer (%X)\n",
+            fileHeader->DataSize,
+            fileFooter->DataSize);
+        // Not a fatal error
+    }
+
+    // Choose format by the header version of the first section, empty images use the first format of their file version
+    const PFS_SECTION_HEADER* sectionHeader = (const PFS_SECTION_HEADER*)(fileHeader + 1);
+    if (fileHeader->DataSize >= offsetof(PFS_SECTION_HEADER, VersionType)) {
+        format = pfs_format_find(fileHeader->HeaderVersion, sectionHeader->HeaderVersion);
+        if (!format) {
+            pfs_printf("pfs_extract: unknown PFS section header version %X\n", sectionHeader->HeaderVersion);
+            return 1;
+        }
+    }
+
+    return format->plan(fileHeader, filename, input, parentSection, plan, nest);
+}
+
+
+// Print extraction plan
+void pfs_plan_print(const PFS_PLAN & plan)
+{
+    pfs_printf("PFS Extraction Plan:\n");
+    for (size_t i = 0; i < plan.entries.size(); i++) {
+        const PFS_PLAN_ENTRY & entry = plan.entries[i];
+        if (entry.type == PFS_PLAN_COPY)
+            pfs_printf("%s: copy %llu bytes at offset %llX\n", entry.filename.c_str(), (unsigned long long)entry.size, (unsigned long long)entry.offset);
+        else
+            pfs_printf("%s: gather %llu bytes from %d chunks\n", entry.filename.c_str(), (unsigned long long)entry.size, (int)entry.chunks.orderNum.size());
+    }
+    pfs_printf("\nFiles: %d\nBytes: %llu\nReassembled bytes: %llu\nChunks: %d\n\n",
+        (int)plan.entries.size(),
+        (unsigned long long)plan.totalBytes,
+        (unsigned long long)plan.gatherBytes,
+        plan.chunkCount);
+}
+
+
+// Work-stealing thread pool
+// Every worker owns a task queue, takes its own tasks from the back and steals from the front of other queues
+// The thread that waits for tasks to finish also runs them, so a pool of N threads starts N - 1 workers,
+// it sleeps while there is nothing to run and is woken when a task is added or finishes
+class PFS_POOL {
+public:
+    explicit PFS_POOL(uint32_t threads) : stopping(false), queued(0), nextQueue(0), waiting(0) {
+        if (threads == 0)
+            threads = 1;
+        for (uint32_t i = 0; i < threads; i++)
+            queues.push_back(new PFS_POOL_QUEUE);
+        for (uint32_t i = 1; i < threads; i++)
+            workers.push_back(std::thread(&PFS_POOL::worker, this, i));
+    }
+
+    ~PFS_POOL() {
+        {
+            std::lock_guard<std::mutex> guard(idleLock);
+            stopping = true;
+        }
+        idle.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+        for (size_t i = 0; i < queues.size(); i++)
+            delete queues[i];
+    }
+
+    uint32_t size() const { return (uint32_t)queues.size(); }
+
+    // Add task, tasks added from a pool worker go to its own queue
+    // Tasks inherit allocation phase and image and job output of submitting thread
+    void submit(const std::function<void()> & task) {
+        uint32_t index = (current == this) ? currentIndex : (nextQueue++ % (uint32_t)queues.size());
+        std::function<void()> queuedTask = task;
+        if (allocProfiling) {
+            uint8_t phase = allocPhase;
+            PFS_ALLOC_PROFILE* image = allocImage;
+            queuedTask = [task, phase, image]() {
+                PFS_ALLOC_SCOPE scope(phase, image);
+                task();
+            };
+        }
+        if (jobOutput) {
+            PFS_JOB_OUTPUT* output = jobOutput;
+            std::function<void()> inner = queuedTask;
+            queuedTask = [inner, output]() {
+                PFS_JOB_OUTPUT* saved = jobOutput;
+                jobOutput = output;
+                inner();
+                jobOutput = saved;
+            };
+        }
+        {
+            std::lock_guard<std::mutex> guard(queues[index]->lock);
+            queues[index]->tasks.push_back(queuedTask);
+        }
+        queued++;
+        std::lock_guard<std::mutex> guard(idleLock);
+        idle.notify_one();
+        if (waiting.load())
+            finished.notify_all();
+    }
+
+    // Run tasks until pending counter drops to zero
+    void wait(const std::atomic<uint32_t> & pending) {
+        PFS_POOL* savedPool = current;
+        uint32_t savedIndex = currentIndex;
+        if (current != this) {
+            current = this;
+            currentIndex = 0;
+        }
+        while (pending.load()) {
+            if (run_one(currentIndex))
+                continue;
+            waiting++;
+            {
+                std::unique_lock<std::mutex> guard(idleLock);
+                if (pending.load() && !queued.load())
+                    finished.wait(guard);
+            }
+            waiting--;
+        }
+        current = savedPool;
+        currentIndex = savedIndex;
+    }
+
+private:
+    typedef struct PFS_POOL_QUEUE_ {
+        std::mutex lock;
+        std::deque<std::function<void()> > tasks;
+    } PFS_POOL_QUEUE;
+
+    std::vector<PFS_POOL_QUEUE*> queues;
+    std::vector<std::thread> workers;
+    std::mutex idleLock;
+    std::condition_variable idle;
+    std::condition_variable finished; // Signaled for waiting threads when a task is added or finishes
+    bool stopping;
+    std::atomic<uint32_t> queued;
+    std::atomic<uint32_t> nextQueue;
+    std::atomic<uint32_t> waiting;    // Number of threads sleeping in wait
+    static thread_local PFS_POOL* current;
+    static thread_local uint32_t currentIndex;
+
+    // Run one task from own queue or stolen from another queue, returns false if there was none
+    bool run_one(uint32_t self) {
+        std::function<void()> task;
+        for (size_t i = 0; i < queues.size() && !task; i++) {
+            PFS_POOL_QUEUE* queue = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(queue->lock);
+            if (queue->tasks.empty())
+                continue;
+            if (i == 0) {
+                task = queue->tasks.back();
+                queue->tasks.pop_back();
+            }
+            else {
+                task = queue->tasks.front();
+                queue->tasks.pop_front();
+            }
+        }
+        if (!task)
+            return false;
+        queued--;
+        task();
+        if (waiting.load()) {
+            std::lock_guard<std::mutex> guard(idleLock);
+            finished.notify_all();
+        }
+        return true;
+    }
+
+    void worker(uint32_t index) {
+        current = this;
+        currentIndex = index;
+        for (;;) {
+            if (run_one(index))
+                continue;
+            std::unique_lock<std::mutex> guard(idleLock);
+            if (stopping)
+                return;
+            if (!queued.load())
+                idle.wait(guard);
+        }
+    }
+};
+
+thread_local PFS_POOL* PFS_POOL::current = NULL;
+thread_local uint32_t PFS_POOL::currentIndex = 0;
+
+
+// UEFI firmware volume walker
+// Reassembled BIOS payloads hold UEFI firmware volumes made of FFS files, every FFS file is a list of sections
+// Volumes are walked in place and only their layout is recorded, files in firmware volume image sections
+// and in uncompressed encapsulation sections are walked too
+#pragma pack(push, 1)
+typedef struct EFI_FIRMWARE_VOLUME_HEADER_ {
+    uint8_t  ZeroVector[16];
+    EFI_GUID FileSystemGuid;
+    uint64_t FvLength;
+    uint32_t Signature;
+    uint32_t Attributes;
+    uint16_t HeaderLength;
+    uint16_t Checksum;
+    uint16_t ExtHeaderOffset;
+    uint8_t  Reserved;
+    uint8_t  Revision;
+} EFI_FIRMWARE_VOLUME_HEADER;
+
+#define EFI_FVH_SIGNATURE *(uint32_t*)"_FVH"
+#define EFI_FVB2_ERASE_POLARITY 0x00000800
+
+typedef struct EFI_FIRMWARE_VOLUME_EXT_HEADER_ {
+    EFI_GUID FvName;
+    uint32_t ExtHeaderSize;
+} EFI_FIRMWARE_VOLUME_EXT_HEADER;
+
+// Large files have 64-bit size following the header and zero in Size
+typedef struct EFI_FFS_FILE_HEADER_ {
+    EFI_GUID Name;
+    uint16_t IntegrityCheck;
+    uint8_t  Type;
+    uint8_t  Attributes;
+    uint8_t  Size[3];
+    uint8_t  State;
+} EFI_FFS_FILE_HEADER;
+
+#define FFS_ATTRIB_LARGE_FILE   0x01
+#define EFI_FV_FILETYPE_RAW     0x01
+#define EFI_FV_FILETYPE_FFS_PAD 0xF0
+
+// Large sections have 32-bit size following the header and 0xFFFFFF in Size
+typedef struct EFI_COMMON_SECTION_HEADER_ {
+    uint8_t Size[3];
+    uint8_t Type;
+} EFI_COMMON_SECTION_HEADER;
+
+#define EFI_SECTION_COMPRESSION           0x01
+#define EFI_SECTION_GUID_DEFINED          0x02
+#define EFI_SECTION_USER_INTERFACE        0x15
+#define EFI_SECTION_FIRMWARE_VOLUME_IMAGE 0x17
+
+// Section data of compression section
+typedef struct EFI_COMPRESSION_SECTION_DATA_ {
+    uint32_t UncompressedLength;
+    uint8_t  CompressionType;
+} EFI_COMPRESSION_SECTION_DATA;
+
+#define EFI_NOT_COMPRESSED 0x00
+
+// Section data of GUID defined section, DataOffset is counted from the start of section header
+typedef struct EFI_GUID_DEFINED_SECTION_DATA_ {
+    EFI_GUID SectionDefinitionGuid;
+    uint16_t DataOffset;
+    uint16_t Attributes;
+} EFI_GUID_DEFINED_SECTION_DATA;
+
+#define EFI_GUIDED_SECTION_PROCESSING_REQUIRED 0x01
+#pragma pack(pop)
+
+// Maximum nesting of volumes and encapsulation sections walked
+#define PFS_UEFI_MAX_DEPTH 8
+
+// Get 24-bit size of FFS file or section
+inline uint32_t pfs_uefi_size24(const uint8_t* size)
+{
+    return size[0] | (size[1] << 8) | (size[2] << 16);
+}
+
+// Align offset counted from base up to alignment, which is a power of two
+inline uint64_t pfs_uefi_align(uint64_t offset, uint64_t base, uint64_t alignment)
+{
+    return base + ((offset - base + alignment - 1) & ~(alignment - 1));
+}
+
+// Volumes found by walking a single top-level volume, parents are indices into volumes
+typedef struct PFS_UEFI_WALK_ {
+    const uint8_t* payload;
+    std::vector<PFS_UEFI_VOLUME> volumes;
+} PFS_UEFI_WALK;
+
+void pfs_uefi_volume(PFS_UEFI_WALK & walk, uint64_t offset, uint64_t size, int32_t parent, uint32_t depth);
+
+// Walk sections from offset to end, returns the number of sections
+uint32_t pfs_uefi_sections(PFS_UEFI_WALK & walk, uint64_t offset, uint64_t end, PFS_UEFI_FILE & file, int32_t volume, uint32_t depth)
+{
+    uint32_t count = 0;
+    uint64_t base = offset;
+    while (offset + sizeof(EFI_COMMON_SECTION_HEADER) <= end) {
+        const EFI_COMMON_SECTION_HEADER* section = (const EFI_COMMON_SECTION_HEADER*)(walk.payload + offset);
+        uint64_t size = pfs_uefi_size24(section->Size);
+        uint64_t dataOffset = offset + sizeof(EFI_COMMON_SECTION_HEADER);
+        if (size == 0xFFFFFF) {
+            if (dataOffset + sizeof(uint32_t) > end)
+                break;
+            size = *(const uint32_t*)(section + 1);
+            dataOffset += sizeof(uint32_t);
+        }
+        if (size < dataOffset - offset || offset + size > end)
+            break;
+        uint64_t dataEnd = offset + size;
+        const uint8_t* data = walk.payload + dataOffset;
+        count++;
+
+        if (section->Type == EFI_SECTION_USER_INTERFACE) {
+            // UCS-2 name, characters outside of ASCII are shown as '?'
+            file.name.clear();
+            for (uint64_t i = dataOffset; i + 1 < dataEnd && (walk.payload[i] || walk.payload[i + 1]); i += 2)
+                file.name.push_back(walk.payload[i + 1] || walk.payload[i] >= 0x80 ? '?' : (char)walk.payload[i]);
+        }
+        else if (section->Type == EFI_SECTION_FIRMWARE_VOLUME_IMAGE && depth < PFS_UEFI_MAX_DEPTH) {
+            pfs_uefi_volume(walk, dataOffset, dataEnd - dataOffset, volume, depth + 1);
+        }
+        else if (section->Type == EFI_SECTION_COMPRESSION) {
+            const EFI_COMPRESSION_SECTION_DATA* compression = (const EFI_COMPRESSION_SECTION_DATA*)data;
+            if (dataOffset + sizeof(*compression) <= dataEnd && compression->CompressionType == EFI_NOT_COMPRESSED && depth < PFS_UEFI_MAX_DEPTH)
+                count += pfs_uefi_sections(walk, dataOffset + sizeof(*compression), dataEnd, file, volume, depth + 1);
+            else
+                file.encapsulated = true;
+        }
+        else if (section->Type == EFI_SECTION_GUID_DEFINED) {
+            const EFI_GUID_DEFINED_SECTION_DATA* guided = (const EFI_GUID_DEFINED_SECTION_DATA*)data;
+            // Data of guided section starts after its header, otherwise the section would be walked again
+            if (dataOffset + sizeof(*guided) <= dataEnd && !(guided->Attributes & EFI_GUIDED_SECTION_PROCESSING_REQUIRED)
+                && guided->DataOffset >= (dataOffset - offset) + sizeof(*guided) && guided->DataOffset <= size && depth < PFS_UEFI_MAX_DEPTH)
+                count += pfs_uefi_sections(walk, offset + guided->DataOffset, dataEnd, file, volume, depth + 1);
+            else
+                file.encapsulated = true;
+        }
+
+        // Sections are 4 byte aligned
+        offset = pfs_uefi_align(dataEnd, base, 4);
+    }
+    return count;
+}
+
+// Walk firmware volume at offset, size is the number of bytes available for it
+void pfs_uefi_volume(PFS_UEFI_WALK & walk, uint64_t offset, uint64_t size, int32_t parent, uint32_t depth)
+{
+    const EFI_FIRMWARE_VOLUME_HEADER* header = (const EFI_FIRMWARE_VOLUME_HEADER*)(walk.payload + offset);
+    if (size < sizeof(EFI_FIRMWARE_VOLUME_HEADER) || header->Signature != EFI_FVH_SIGNATURE
+        || header->FvLength > size || header->HeaderLength < sizeof(EFI_FIRMWARE_VOLUME_HEADER) || header->HeaderLength > header->FvLength)
+        return;
+
+    PFS_UEFI_VOLUME volume;
+    volume.fileSystem = header->FileSystemGuid;
+    memset(&volume.name, 0, sizeof(volume.name));
+    volume.offset = offset;
+    volume.size = header->FvLength;
+    volume.parent = parent;
+    uint64_t end = offset + header->FvLength;
+    uint64_t fileOffset = offset + header->HeaderLength;
+    if (header->ExtHeaderOffset && header->ExtHeaderOffset + sizeof(EFI_FIRMWARE_VOLUME_EXT_HEADER) <= header->FvLength) {
+        const EFI_FIRMWARE_VOLUME_EXT_HEADER* extHeader = (const EFI_FIRMWARE_VOLUME_EXT_HEADER*)(walk.payload + offset + header->ExtHeaderOffset);
+        volume.name = extHeader->FvName;
+        fileOffset = std::max(fileOffset, std::min(end, offset + header->ExtHeaderOffset + extHeader->ExtHeaderSize));
+    }
+    int32_t index = (int32_t)walk.volumes.size();
+    walk.volumes.push_back(volume);
+
+    // Files are 8 byte aligned, free space is filled with erased bytes
+    uint8_t erased = (header->Attributes & EFI_FVB2_ERASE_POLARITY) ? 0xFF : 0x00;
+    fileOffset = pfs_uefi_align(fileOffset, offset, 8);
+    while (fileOffset + sizeof(EFI_FFS_FILE_HEADER) <= end) {
+        const EFI_FFS_FILE_HEADER* ffs = (const EFI_FFS_FILE_HEADER*)(walk.payload + fileOffset);
+        bool free = true;
+        for (size_t i = 0; i < sizeof(EFI_FFS_FILE_HEADER) && free; i++)
+            free = (walk.payload[fileOffset + i] == erased);
+        if (free)
+            break;
+
+        uint64_t fileSize = pfs_uefi_size24(ffs->Size);
+        uint64_t headerSize = sizeof(EFI_FFS_FILE_HEADER);
+        if (ffs->Attributes & FFS_ATTRIB_LARGE_FILE) {
+            if (fileOffset + headerSize + sizeof(uint64_t) > end)
+                break;
+            fileSize = *(const uint64_t*)(ffs + 1);
+            headerSize += sizeof(uint64_t);
+        }
+        if (fileSize < headerSize || fileSize > end - fileOffset)
+            break;
+
+        PFS_UEFI_FILE file;
+        file.guid = ffs->Name;
+        file.type = ffs->Type;
+        file.encapsulated = false;
+        file.offset = fileOffset;
+        file.size = fileSize;
+        file.sections = 0;
+        if (ffs->Type != EFI_FV_FILETYPE_RAW && ffs->Type != EFI_FV_FILETYPE_FFS_PAD)
+            file.sections = pfs_uefi_sections(walk, fileOffset + headerSize, fileOffset + fileSize, file, index, depth);
+        walk.volumes[index].files.push_back(file);
+
+        fileOffset = pfs_uefi_align(fileOffset + fileSize, offset, 8);
+    }
+}
+
+// Index UEFI firmware volumes in reassembled payload, top-level volumes are walked in parallel on the pool of the plan
+void pfs_uefi_index(const uint8_t* payload, uint64_t size, const std::string & filename, PFS_PLAN & plan)
+{
+    PFS_TRACE_SPAN span("index volumes", filename.c_str());
+
+    // Find top-level volumes by signature, volumes are 8 byte aligned
+    std::vector<uint64_t> starts;
+    uint64_t offset = 0;
+    while (offset + sizeof(EFI_FIRMWARE_VOLUME_HEADER) <= size) {
+        const EFI_FIRMWARE_VOLUME_HEADER* header = (const EFI_FIRMWARE_VOLUME_HEADER*)(payload + offset);
+        if (header->Signature == EFI_FVH_SIGNATURE && header->FvLength >= sizeof(EFI_FIRMWARE_VOLUME_HEADER) && header->FvLength <= size - offset) {
+            starts.push_back(offset);
+            offset = pfs_uefi_align(offset + header->FvLength, 0, 8);
+        }
+        else {
+            offset += 8;
+        }
+    }
+    if (starts.empty())
+        return;
+
+    // Walk volumes, every volume is a separate pool task
+    std::vector<PFS_UEFI_WALK> walks(starts.size());
+    auto walkVolume = [&walks, &starts, payload, size](size_t i) {
+        walks[i].payload = payload;
+        pfs_uefi_volume(walks[i], starts[i], size - starts[i], -1, 0);
+    };
+    if (!plan.pool || starts.size() < 2) {
+        for (size_t i = 0; i < starts.size(); i++)
+            walkVolume(i);
+    }
+    else {
+        std::atomic<uint32_t> pending((uint32_t)starts.size());
+        for (size_t i = 0; i < starts.size(); i++) {
+            plan.pool->submit([&walkVolume, &pending, i]() {
+                walkVolume(i);
+                pending--;
+            });
+        }
+        plan.pool->wait(pending);
+    }
+
+    // Merge volumes in payload order
+    PFS_UEFI_INDEX index;
+    index.payload = filename;
+    size_t files = 0;
+    for (size_t i = 0; i < walks.size(); i++) {
+        int32_t first = (int32_t)index.volumes.size();
+        for (size_t v = 0; v < walks[i].volumes.size(); v++) {
+            index.volumes.push_back(walks[i].volumes[v]);
+            if (index.volumes.back().parent >= 0)
+                index.volumes.back().parent += first;
+            files += walks[i].volumes[v].files.size();
+        }
+    }
+    pfs_printf("UEFI Firmware Volumes in %s: %d volumes, %d files\n\n", filename.c_str(), (int)index.volumes.size(), (int)files);
+    plan.uefi.push_back(index);
+}
+
+
+// Large buffer, optionally backed by huge pages
+// Huge pages are taken from the hugetlbfs pool with MAP_HUGETLB if it has enough free pages,
+// otherwise the buffer is an anonymous mapping advised to use transparent huge pages
+#define PFS_HUGE_PAGE_SIZE 0x200000
+class PFS_BUFFER {
+public:
+    PFS_BUFFER() : ptr(NULL), size(0), mapped(0), profile(NULL) {}
+    ~PFS_BUFFER() { release(); }
+
+    // Allocate buffer of size bytes, returns false if out of memory
+    bool allocate(size_t bytes, bool hugePages) {
+        release();
+        size = bytes;
+        profile = pfs_alloc_acquire(bytes);
+#if !defined(WIN32) && defined(MADV_HUGEPAGE)
+        if (hugePages && bytes >= PFS_HUGE_PAGE_SIZE) {
+            size_t length = (bytes + PFS_HUGE_PAGE_SIZE - 1) & ~(size_t)(PFS_HUGE_PAGE_SIZE - 1);
+            void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (map == MAP_FAILED) {
+                map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (map != MAP_FAILED)
+                    madvise(map, length, MADV_HUGEPAGE);
+            }
+            if (map != MAP_FAILED) {
+                ptr = (uint8_t*)map;
+                mapped = length;
+                return true;
+            }
+        }
+#else
+        (void)hugePages;
+#endif
+        ptr = (uint8_t*)malloc(bytes ? bytes : 1);
+        return ptr != NULL;
+    }
+
+    // Load whole file of size bytes, mapped read-only where possible so only pages touched are read
+    bool load(int fd, size_t bytes) {
+        release();
+#ifndef WIN32
+        if (bytes) {
+            void* map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                ptr = (uint8_t*)map;
+                size = bytes;
+                mapped = bytes;
+                return true;
+            }
+        }
+#endif
+        return allocate(bytes, false) && readFileAt(fd, ptr, bytes, 0);
+    }
+
+    void release() {
+#ifndef WIN32
+        if (mapped)
+            munmap(ptr, mapped);
+        else
+#endif
+            free(ptr);
+        pfs_alloc_release(profile, size);
+        ptr = NULL;
+        size = 0;
+        mapped = 0;
+        profile = NULL;
+    }
+
+    uint8_t* data() const { return ptr; }
+
+private:
+    uint8_t* ptr;
+    size_t   size;
+    size_t   mapped; // Length of mapping, 0 if allocated with malloc
+    PFS_ALLOC_PROFILE* profile; // Allocation profile the buffer is counted in
+
+    PFS_BUFFER(const PFS_BUFFER &);
+    PFS_BUFFER & operator=(const PFS_BUFFER &);
+};
+
+
+// Output backends
+#define PFS_BACKEND_STDIO 0 // Buffered stdio, subsection payloads are reassembled in memory first
+#define PFS_BACKEND_WRITE 1 // Unbuffered write, subsection payloads are gathered straight from input buffer
+#define PFS_BACKEND_DIRECT 2 // O_DIRECT write bypassing page cache, for files of PFS_DIRECT_MIN_SIZE and larger
+#define PFS_BACKEND_MMAP   3 // Output file is sized up front and mapped, chunks are copied straight to their final position
+#define PFS_BACKEND_URING  4 // Every region or chunk is a separate io_uring write request
+
+// Names of output backends, indexed by PFS_BACKEND_*
+const char* pfsBackendNames[] = { "stdio", "write", "direct", "mmap", "uring" };
+
+// Default number of levels of nested images extracted from reassembled subsection payloads
+#define PFS_MAX_DEPTH 4
+
+// Executor options
+typedef struct PFS_EXEC_OPTIONS_ {
+    const char* directory; // Output directory, NULL for current directory
+    uint8_t     backend;   // PFS_BACKEND_*
+    uint32_t    threads;   // Number of threads writing output files
+    bool        syncFiles; // Flush every output file to disk after writing it
+    bool        hugePages; // Back input and reassembly buffers with huge pages
+    uint32_t    maxDepth;  // Number of levels of reassembled subsection payloads descended into
+    bool        uefi;      // Index UEFI firmware volumes in reassembled subsection payloads
+    std::function<void()> checkpoint; // Called before every top-level section, may run other jobs
+    PFS_EXEC_OPTIONS_() : directory(NULL), backend(PFS_BACKEND_STDIO), threads(1), syncFiles(false), hugePages(false), maxDepth(PFS_MAX_DEPTH),
+        uefi(false) {}
+} PFS_EXEC_OPTIONS;
+
+#ifndef WIN32
+// Write all iovecs to file descriptor, handling partial writes
+bool write_all_v(int fd, struct iovec* iov, size_t count)
+{
+    while (count) {
+        ssize_t written = writev(fd, iov, (int)std::min(count, (size_t)IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (count && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// Write file from a list of buffers without joining them first
+uint8_t write_file_v(const char* filename, struct iovec* iov, size_t count, bool sync)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        pfs_printf("write_file: can't create %s\n", filename);
+        return 1;
+    }
+
+    if (!write_all_v(fd, iov, count)) {
+        pfs_printf("write_file: can't write to %s\n", filename);
+        close(fd);
+        return 2;
+    }
+
+    if (sync && !syncFileData(fd)) {
+        pfs_printf("write_file: can't flush %s to disk\n", filename);
+        close(fd);
+        return 3;
+    }
+
+    close(fd);
+    return 0;
+}
+
+#ifdef PFS_HAVE_URING
+// Per-thread ring for io_uring writes
+thread_local PFS_URING writeRing;
+thread_local int writeRingState = 0; // 0 - not initialized, 1 - ready, 2 - io_uring is not available
+
+// Write file from a list of buffers with io_uring, every buffer is a separate write request at its file offset
+// Falls back to write_file_v if io_uring is not available
+uint8_t write_file_uring(const char* filename, struct iovec* iov, size_t count, bool sync)
+{
+    if (writeRingState == 0)
+        writeRingState = writeRing.init(64) ? 1 : 2;
+    if (writeRingState != 1)
+        return write_file_v(filename, iov, count, sync);
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        pfs_printf("write_file: can't create %s\n", filename);
+        return 1;
+    }
+
+    typedef struct URING_WRITE_ {
+        const uint8_t* data;
+        size_t         size;
+        uint64_t       offset;
+    } URING_WRITE;
+    std::deque<URING_WRITE> pending;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (iov[i].iov_len) {
+            URING_WRITE write = { (const uint8_t*)iov[i].iov_base, iov[i].iov_len, offset };
+            pending.push_back(write);
+        }
+        offset += iov[i].iov_len;
+    }
+
+    // Submit writes in batches of ring capacity, short writes are resubmitted for the rest
+    bool result = true;
+    std::vector<URING_WRITE> batch;
+    while (!pending.empty() && result) {
+        batch.clear();
+        while (!pending.empty() && batch.size() < writeRing.capacity()) {
+            struct io_uring_sqe* sqe = writeRing.next();
+            if (!sqe)
+                break;
+            URING_WRITE write = pending.front();
+            pending.pop_front();
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)write.data;
+            sqe->len = (uint32_t)std::min(write.size, (size_t)0x40000000);
+            sqe->off = write.offset;
+            sqe->user_data = batch.size();
+            batch.push_back(write);
+        }
+        if (batch.empty() || !writeRing.submit((unsigned)batch.size())) {
+            result = false;
+            break;
+        }
+        struct io_uring_cqe cqe;
+        for (size_t done = 0; done < batch.size(); ) {
+            if (!writeRing.complete(cqe)) {
+                if (!writeRing.submit(1))
+                    result = false;
+                if (!result)
+                    break;
+                continue;
+            }
+            done++;
+            if (cqe.user_data >= batch.size()) {
+                result = false;
+                break;
+            }
+            URING_WRITE write = batch[cqe.user_data];
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                pending.push_back(write);
+            }
+            else if (cqe.res <= 0) {
+                result = false;
+            }
+            else if ((size_t)cqe.res < write.size) {
+                write.data += cqe.res;
+                write.size -= cqe.res;
+                write.offset += cqe.res;
+                pending.push_back(write);
+            }
+        }
+    }
+
+    // The ring is reused by the next file of this thread, it must not keep entries or completions of this one
+    if (!result) {
+        writeRing.drain();
+        pfs_printf("write_file: can't write to %s\n", filename);
+        close(fd);
+        return 2;
+    }
+
+    if (sync && !syncFileData(fd)) {
+        pfs_printf("write_file: can't flush %s to disk\n", filename);
+        close(fd);
+        return 3;
+    }
+
+    close(fd);
+    return 0;
+}
+#endif
+
+#ifdef O_DIRECT
+// O_DIRECT alignment of file offsets, sizes and buffer addresses
+#define PFS_DIRECT_ALIGNMENT 0x1000
+// Size of aligned buffer used to feed O_DIRECT writes
+#define PFS_DIRECT_BUFFER_SIZE 0x100000
+// Files smaller than this are written through page cache
+#define PFS_DIRECT_MIN_SIZE 0x10000
+
+// Write file from a list of buffers with O_DIRECT, bypassing page cache
+// Data is copied into an aligned buffer, the unaligned tail at the end is written through page cache
+// Falls back to write_file_v for small files and filesystems without O_DIRECT support
+uint8_t write_file_direct(const char* filename, struct iovec* iov, size_t count, bool sync)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+        size += iov[i].iov_len;
+    if (size < PFS_DIRECT_MIN_SIZE)
+        return write_file_v(filename, iov, count, sync);
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+    if (fd < 0 && errno == EINVAL)
+        return write_file_v(filename, iov, count, sync);
+    if (fd < 0) {
+        pfs_printf("write_file: can't create %s\n", filename);
+        return 1;
+    }
+
+    void* aligned = NULL;
+    if (posix_memalign(&aligned, PFS_DIRECT_ALIGNMENT, PFS_DIRECT_BUFFER_SIZE)) {
+        pfs_printf("write_file: can't allocate aligned buffer for %s\n", filename);
+        close(fd);
+        return 2;
+    }
+
+    // Fill aligned buffer and write it out whenever it is full
+    uint8_t* buffer = (uint8_t*)aligned;
+    size_t used = 0;
+    bool result = true;
+    for (size_t i = 0; i < count && result; i++) {
+        const uint8_t* src = (const uint8_t*)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left && result) {
+            size_t part = std::min(left, (size_t)PFS_DIRECT_BUFFER_SIZE - used);
+            memcpy(buffer + used, src, part);
+            used += part;
+            src += part;
+            left -= part;
+            if (used == PFS_DIRECT_BUFFER_SIZE) {
+                struct iovec full = { buffer, used };
+                result = write_all_v(fd, &full, 1);
+                used = 0;
+            }
+        }
+    }
+
+    // Write aligned part of the rest with O_DIRECT and the tail through page cache
+    size_t alignedSize = used & ~(size_t)(PFS_DIRECT_ALIGNMENT - 1);
+    if (result && alignedSize) {
+        struct iovec head = { buffer, alignedSize };
+        result = write_all_v(fd, &head, 1);
+    }
+    if (result && used > alignedSize) {
+        struct iovec tail = { buffer + alignedSize, used - alignedSize };
+        result = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) == 0 && write_all_v(fd, &tail, 1);
+    }
+    free(aligned);
+
+    if (!result) {
+        pfs_printf("write_file: can't write to %s\n", filename);
+        close(fd);
+        return 2;
+    }
+
+    if (sync && !syncFileData(fd)) {
+        pfs_printf("write_file: can't flush %s to disk\n", filename);
+        close(fd);
+        return 3;
+    }
+
+#ifdef POSIX_FADV_DONTNEED
+    // Drop the tail from page cache too
+    if (used > alignedSize)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+    return 0;
+}
+#endif
+#endif
+
+// Minimal size of subsection payload to reassemble in parallel
+#define PFS_PARALLEL_GATHER_SIZE 0x100000
+
+// Reassemble subsection payload, large payloads are split into per-chunk pool tasks
+void pfs_execute_reassemble(const PFS_CHUNK_TABLE & chunks, const uint8_t* input, uint8_t* out, uint64_t size, PFS_POOL* pool)
+{
+    PFS_TRACE_SPAN span("reassemble");
+    uint64_t start = clock_us();
+    if (!pool || pool->size() < 2 || size < PFS_PARALLEL_GATHER_SIZE || chunks.orderNum.size() < 2) {
+        pfs_chunk_table_reassemble(chunks, input, out);
+        pfs_metric_observe(PFS_PHASE_REASSEMBLE, clock_us() - start);
+        return;
+    }
+
+    std::vector<uint32_t> order = pfs_chunk_table_order(chunks);
+    std::atomic<uint32_t> pending((uint32_t)order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        const uint8_t* src = input + chunks.offset[order[i]];
+        uint32_t length = chunks.length[order[i]];
+        pool->submit([out, src, length, &pending]() {
+            memcpy(out, src, length);
+            pending--;
+        });
+        out += length;
+    }
+    pool->wait(pending);
+    pfs_metric_observe(PFS_PHASE_REASSEMBLE, clock_us() - start);
+}
+
+#ifndef WIN32
+// Execute extraction plan entry by writing into memory mapped output file
+// Disk blocks are allocated before mapping, a full disk would otherwise raise SIGBUS on write,
+// mapped is set to false without writing anything if they can't be allocated
+uint8_t pfs_execute_mmap(const PFS_PLAN_ENTRY & entry, const char* filename, const uint8_t* input, const PFS_EXEC_OPTIONS & options, PFS_POOL* pool, uint64_t* hash, bool & mapped)
+{
+    mapped = true;
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        pfs_printf("write_file: can't create %s\n", filename);
+        return 1;
+    }
+
+    if (hash)
+        *hash = PFS_HASH_INIT;
+    if (!entry.size) {
+        close(fd);
+        return 0;
+    }
+
+    if (!allocateFile(fd, entry.size)) {
+        mapped = false;
+        close(fd);
+        return 0;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)entry.size) == 0)
+        map = mmap(NULL, (size_t)entry.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        pfs_printf("write_file: can't map %s\n", filename);
+        close(fd);
+        return 2;
+    }
+
+    if (entry.type == PFS_PLAN_COPY)
+        memcpy(map, input + entry.offset, (size_t)entry.size);
+    else
+        pfs_execute_reassemble(entry.chunks, input, (uint8_t*)map, entry.size, pool);
+    if (hash)
+        *hash = pfs_hash(map, (size_t)entry.size);
+
+    bool result = true;
+    if (options.syncFiles)
+        result = msync(map, (size_t)entry.size, MS_SYNC) == 0 && syncFileData(fd);
+    munmap(map, (size_t)entry.size);
+    close(fd);
+    if (!result) {
+        pfs_printf("write_file: can't flush %s to disk\n", filename);
+        return 3;
+    }
+    return 0;
+}
+#endif
+
+// Write output file of single extraction plan entry
+uint8_t pfs_execute_write(const PFS_PLAN_ENTRY & entry, const uint8_t* input, const PFS_EXEC_OPTIONS & options, PFS_POOL* pool, uint64_t* hash)
+{
+    PFS_ALLOC_SCOPE allocScope(entry.type == PFS_PLAN_GATHER ? PFS_PHASE_REASSEMBLE : allocPhase);
+    std::string path = entry.filename;
+    if (options.directory)
+        path = std::string(options.directory) + "/" + entry.filename;
+
+#ifndef WIN32
+    // Entries that can't be mapped are written with write_file_v
+    bool mapped = false;
+    if (options.backend == PFS_BACKEND_MMAP) {
+        uint8_t result = pfs_execute_mmap(entry, path.c_str(), input, options, pool, hash, mapped);
+        if (mapped)
+            return result;
+    }
+
+    if (options.backend == PFS_BACKEND_WRITE || options.backend == PFS_BACKEND_DIRECT || options.backend == PFS_BACKEND_URING
+        || options.backend == PFS_BACKEND_MMAP) {
+        std::vector<struct iovec> iov;
+        if (entry.type == PFS_PLAN_COPY) {
+            struct iovec range = { (void*)(input + entry.offset), (size_t)entry.size };
+            iov.push_back(range);
+            if (hash)
+                *hash = pfs_hash(range.iov_base, range.iov_len);
+        }
+        else {
+            std::vector<uint32_t> order = pfs_chunk_table_order(entry.chunks);
+            for (size_t i = 0; i < order.size(); i++) {
+                struct iovec chunk = { (void*)(input + entry.chunks.offset[order[i]]), entry.chunks.length[order[i]] };
+                iov.push_back(chunk);
+            }
+            if (hash) {
+                *hash = PFS_HASH_INIT;
+                for (size_t i = 0; i < iov.size(); i++)
+                    *hash = pfs_hash(iov[i].iov_base, iov[i].iov_len, *hash);
+            }
+        }
+#ifdef O_DIRECT
+        if (options.backend == PFS_BACKEND_DIRECT)
+            return write_file_direct(path.c_str(), iov.data(), iov.size(), options.syncFiles);
+#endif
+#ifdef PFS_HAVE_URING
+        if (options.backend == PFS_BACKEND_URING)
+            return write_file_uring(path.c_str(), iov.data(), iov.size(), options.syncFiles);
+#endif
+        return write_file_v(path.c_str(), iov.data(), iov.size(), options.syncFiles);
+    }
+#endif
+
+    if (entry.type == PFS_PLAN_COPY) {
+        if (hash)
+            *hash = pfs_hash(input + entry.offset, (size_t)entry.size);
+        return write_file(path.c_str(), (uint8_t*)input + entry.offset, (size_t)entry.size, options.syncFiles);
+    }
+
+    PFS_BUFFER out;
+    if (!out.allocate((size_t)entry.size, options.hugePages)) {
+        pfs_printf("write_file: can't allocate memory for %s\n", path.c_str());
+        return 1;
+    }
+    pfs_execute_reassemble(entry.chunks, input, out.data(), entry.size, pool);
+    if (hash)
+        *hash = pfs_hash(out.data(), (size_t)entry.size);
+    return write_file(path.c_str(), out.data(), (size_t)entry.size, options.syncFiles);
+}
+
+// Execute single extraction plan entry, computes hash of output file if hash is not NULL
+uint8_t pfs_execute_entry(const PFS_PLAN_ENTRY & entry, const uint8_t* input, const PFS_EXEC_OPTIONS & options, PFS_POOL* pool, uint64_t* hash)
+{
+    if (entry.type == PFS_PLAN_GATHER)
+        PFS_PROBE3(reassembly__start, entry.filename.c_str(), (uint32_t)entry.chunks.orderNum.size(), entry.size);
+    PFS_PROBE2(write__start, entry.filename.c_str(), entry.size);
+    PFS_TRACE_SPAN span("write", entry.filename.c_str());
+    uint8_t result;
+    if (entry.payload) {
+        // Payload reassembled while planning is written as a single range
+        PFS_PLAN_ENTRY copy;
+        copy.filename = entry.filename;
+        copy.type = PFS_PLAN_COPY;
+        copy.section = entry.section;
+        copy.offset = 0;
+        copy.size = entry.size;
+        copy.headerSize = 0;
+        copy.base = entry.payload;
+        copy.payload = NULL;
+        result = pfs_execute_write(copy, copy.base, options, pool, hash);
+    }
+    else {
+        result = pfs_execute_write(entry, entry.base ? entry.base : input, options, pool, hash);
+    }
+    if (!result)
+        pfs_metric_add(PFS_METRIC_BYTES_OUT, entry.size);
+    PFS_PROBE3(write__end, entry.filename.c_str(), entry.size, result);
+    if (entry.type == PFS_PLAN_GATHER)
+        PFS_PROBE2(reassembly__end, entry.filename.c_str(), result);
+    return result;
+}
+
+// Execute extraction plan, returns the number of output files that failed
+// Hashes of output files are stored in plan order if hashes is not NULL
+// With a pool every top-level section is a separate pool task, without one the plan is executed on the calling thread
+uint32_t pfs_execute(const PFS_PLAN & plan, const uint8_t* input, const PFS_EXEC_OPTIONS & options, PFS_POOL* pool, std::vector<uint64_t>* hashes)
+{
+    if (hashes)
+        hashes->assign(plan.entries.size(), 0);
+
+    // Collect section table, entries of a section are contiguous in plan
+    std::vector<size_t> sectionStart;
+    for (size_t i = 0; i < plan.entries.size(); i++) {
+        if (i == 0 || plan.entries[i].section != plan.entries[i - 1].section)
+            sectionStart.push_back(i);
+    }
+    sectionStart.push_back(plan.entries.size());
+
+    // Execute all entries of a section
+    std::atomic<uint32_t> failed(0);
+    auto runSection = [&](size_t first, size_t last, PFS_POOL* pool) {
+        if (options.checkpoint)
+            options.checkpoint();
+        uint32_t number = plan.entries[first].section;
+        const PFS_PLAN_SECTION* section = (number < plan.sections.size()) ? &plan.sections[number] : NULL;
+        PFS_PROBE4(section__start, number, section ? section->guidString.c_str() : "", section ? section->dataSize : 0, (uint32_t)(last - first));
+        PFS_TRACE_SPAN span("section", section ? section->guidString.c_str() : NULL);
+        uint32_t sectionFailed = 0;
+        for (size_t i = first; i < last; i++) {
+            if (pfs_execute_entry(plan.entries[i], input, options, pool, hashes ? &hashes->at(i) : NULL))
+                sectionFailed++;
+        }
+        failed += sectionFailed;
+        PFS_PROBE2(section__end, number, sectionFailed);
+    };
+
+    if (!pool) {
+        for (size_t s = 0; s + 1 < sectionStart.size(); s++)
+            runSection(sectionStart[s], sectionStart[s + 1], NULL);
+        return failed;
+    }
+
+    // Every section is a separate pool task
+    std::atomic<uint32_t> pending((uint32_t)sectionStart.size() - 1);
+    for (size_t s = 0; s + 1 < sectionStart.size(); s++) {
+        size_t first = sectionStart[s];
+        size_t last = sectionStart[s + 1];
+        pool->submit([&, first, last]() {
+            runSection(first, last, pool);
+            pending--;
+        });
+    }
+    pool->wait(pending);
+
+    return failed;
+}
+
+
+// Escape string for JSON output
+std::string json_escape(const std::string & str)
+{
+    std::string result;
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        }
+        else if (c < 0x20) {
+            char escaped[7];
+            sprintf(escaped, "\\u%04X", c);
+            result += escaped;
+        }
+        else {
+            result += c;
+        }
+    }
+    return result;
+}
+
+// Format section description with metadata fields as JSON object members
+std::string pfs_section_json(const PFS_PLAN_SECTION & section)
+{
+    char versionKey[20];
+    sprintf(versionKey, "%016llX", (unsigned long long)section.versionKey);
+    std::string result = "\"guid\": \"" + section.guidString + "\", \"version\": \"" + json_escape(section.version)
+        + "\", \"versionKey\": \"" + versionKey + "\", \"metadata\": {";
+    const PFS_METADATA & metadata = section.metadataFields;
+    for (uint32_t i = 0; i < metadata.count; i++) {
+        const PFS_METADATA_FIELD & field = metadata.fields[i];
+        result += std::string(i ? ", \"" : " \"") + pfsMetadataNames[field.key] + "\": \""
+            + json_escape(section.metadata.substr(field.valueOffset, field.valueLength)) + "\"";
+    }
+    result += metadata.count ? " }" : "}";
+    return result;
+}
+
+
+// Minimal JSON reader, enough to read manifests back
+#define PFS_JSON_NULL   0
+#define PFS_JSON_BOOL   1
+#define PFS_JSON_NUMBER 2
+#define PFS_JSON_STRING 3
+#define PFS_JSON_ARRAY  4
+#define PFS_JSON_OBJECT 5
+#define PFS_JSON_MAX_DEPTH 64
+
+typedef struct PFS_JSON_ {
+    uint8_t     type;    // PFS_JSON_*
+    bool        boolean;
+    double      number;
+    std::string string;
+    std::vector<struct PFS_JSON_> items;    // Array items or object member values
+    std::vector<std::string>      names;    // Object member names
+    PFS_JSON_() : type(PFS_JSON_NULL), boolean(false), number(0) {}
+
+    // Get object member, NULL if not found or not an object
+    const struct PFS_JSON_* get(const char* name) const {
+        for (size_t i = 0; type == PFS_JSON_OBJECT && i < names.size(); i++) {
+            if (names[i] == name)
+                return &items[i];
+        }
+        return NULL;
+    }
+} PFS_JSON;
+
+class PFS_JSON_PARSER {
+public:
+    explicit PFS_JSON_PARSER(const std::string & text) : ptr(text.c_str()), start(text.c_str()), end(text.c_str() + text.size()) {}
+
+    // Parse the whole text, returns false and prints position of syntax error
+    bool parse(PFS_JSON & value) {
+        if (!parse_value(value, 0) || (skip_space(), ptr != end)) {
+            printf("pfs_json_parse: syntax error at offset %d\n", (int)(ptr - start));
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const char* ptr;
+    const char* start;
+    const char* end;
+
+    void skip_space() {
+        while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n'))
+            ptr++;
+    }
+
+    bool literal(const char* word) {
+        size_t length = strlen(word);
+        if ((size_t)(end - ptr) < length || memcmp(ptr, word, length))
+            return false;
+        ptr += length;
+        return true;
+    }
+
+    bool parse_string(std::string & result) {
+        if (ptr >= end || *ptr != '"')
+            return false;
+        ptr++;
+        while (ptr < end && *ptr != '"') {
+            char c = *ptr++;
+            if ((unsigned char)c < 0x20)
+                return false;
+            if (c != '\\') {
+                result += c;
+                continue;
+            }
+            if (ptr >= end)
+                return false;
+            c = *ptr++;
+            switch (c) {
+            case '"': case '\\': case '/': result += c; break;
+            case 'b': result += '\b'; break;
+            case 'f': result += '\f'; break;
+            case 'n': result += '\n'; break;
+            case 'r': result += '\r'; break;
+            case 't': result += '\t'; break;
+            case 'u': {
+                uint32_t code;
+                if (!parse_hex4(code))
+                    return false;
+                // Combine surrogate pair
+                if (code >= 0xD800 && code < 0xDC00) {
+                    uint32_t low;
+                    if (!literal("\\u") || !parse_hex4(low) || low < 0xDC00 || low >= 0xE000)
+                        return false;
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                append_utf8(result, code);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        if (ptr >= end)
+            return false;
+        ptr++;
+        return true;
+    }
+
+    bool parse_hex4(uint32_t & code) {
+        if (end - ptr < 4)
+            return false;
+        code = 0;
+        for (int i = 0; i < 4; i++, ptr++) {
+            char c = *ptr;
+            code <<= 4;
+            if (c >= '0' && c <= '9')
+                code |= (uint32_t)(c - '0');
+            else if (c >= 'a' && c <= 'f')
+                code |= (uint32_t)(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F')
+                code |= (uint32_t)(c - 'A' + 10);
+            else
+                return false;
+        }
+        return true;
+    }
+
+    static void append_utf8(std::string & result, uint32_t code) {
+        if (code < 0x80) {
+            result += (char)code;
+        }
+        else if (code < 0x800) {
+            result += (char)(0xC0 | (code >> 6));
+            result += (char)(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000) {
+            result += (char)(0xE0 | (code >> 12));
+            result += (char)(0x80 | ((code >> 6) & 0x3F));
+            result += (char)(0x80 | (code & 0x3F));
+        }
+        else {
+            result += (char)(0xF0 | (code >> 18));
+            result += (char)(0x80 | ((code >> 12) & 0x3F));
+            result += (char)(0x80 | ((code >> 6) & 0x3F));
+            result += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    bool parse_value(PFS_JSON & value, uint32_t depth) {
+        skip_space();
+        if (ptr >= end || depth > PFS_JSON_MAX_DEPTH)
+            return false;
+        if (*ptr == '"') {
+            value.type = PFS_JSON_STRING;
+            return parse_string(value.string);
+        }
+        if (*ptr == '{' || *ptr == '[') {
+            bool isObject = (*ptr++ == '{');
+            char close = isObject ? '}' : ']';
+            value.type = isObject ? PFS_JSON_OBJECT : PFS_JSON_ARRAY;
+            skip_space();
+            if (ptr < end && *ptr == close) {
+                ptr++;
+                return true;
+            }
+            for (;;) {
+                if (isObject) {
+                    std::string name;
+                    skip_space();
+                    if (!parse_string(name))
+                        return false;
+                    skip_space();
+                    if (ptr >= end || *ptr++ != ':')
+                        return false;
+                    value.names.push_back(name);
+                }
+                value.items.push_back(PFS_JSON());
+                if (!parse_value(value.items.back(), depth + 1))
+                    return false;
+                skip_space();
+                if (ptr >= end)
+                    return false;
+                if (*ptr == close) {
+                    ptr++;
+                    return true;
+                }
+                if (*ptr++ != ',')
+                    return false;
+            }
+        }
+        if (literal("true")) {
+            value.type = PFS_JSON_BOOL;
+            value.boolean = true;
+            return true;
+        }
+        if (literal("false")) {
+            value.type = PFS_JSON_BOOL;
+            return true;
+        }
+        if (literal("null"))
+            return true;
+
+        // Number, the text is terminated by std::string so strtod stops in time
+        char* numberEnd;
+        value.type = PFS_JSON_NUMBER;
+        value.number = strtod(ptr, &numberEnd);
+        if (numberEnd == ptr || (*ptr != '-' && (*ptr < '0' || *ptr > '9')))
+            return false;
+        ptr = numberEnd;
+        return true;
+    }
+};
+
+// Read and parse JSON file
+bool pfs_json_read(const char* filename, PFS_JSON & value)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        printf("pfs_json_read: can't open %s\n", filename);
+        return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return PFS_JSON_PARSER(text).parse(value);
+}
+
+
+// Write recorded trace spans of all threads in Chrome trace-event format
+uint8_t pfs_trace_write(const char* filename)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        printf("pfs_trace_write: can't create %s\n", filename);
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> guard(traceLock);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (size_t r = 0; r < traceRings.size(); r++) {
+        const PFS_TRACE_RING* ring = traceRings[r];
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+            first ? "" : ",\n", ring->threadId, ring->threadId);
+        first = false;
+
+        uint64_t written = ring->written.load(std::memory_order_acquire);
+        uint64_t start = written > PFS_TRACE_RING_SIZE ? written - PFS_TRACE_RING_SIZE : 0;
+        for (uint64_t i = start; i < written; i++) {
+            const PFS_TRACE_EVENT & event = ring->events[i % PFS_TRACE_RING_SIZE];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"pfs\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%llu,\"args\":{\"detail\":\"%s\"}}",
+                event.name,
+                ring->threadId,
+                (unsigned long long)event.startUs,
+                (unsigned long long)event.durationUs,
+                json_escape(event.detail).c_str());
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    if (ferror(file)) {
+        printf("pfs_trace_write: can't write to %s\n", filename);
+        fclose(file);
+        return 2;
+    }
+    fclose(file);
+    return 0;
+}
+
+
+// Manifest hash, covers names, sizes and hashes of all output files in plan order
+uint64_t pfs_manifest_hash(const PFS_PLAN & plan, const std::vector<uint64_t> & hashes)
+{
+    uint64_t hash = PFS_HASH_INIT;
+    for (size_t i = 0; i < plan.entries.size(); i++) {
+        char line[64];
+        sprintf(line, " %llu %016llX\n", (unsigned long long)plan.entries[i].size, (unsigned long long)hashes[i]);
+        hash = pfs_hash(plan.entries[i].filename.data(), plan.entries[i].filename.size(), hash);
+        hash = pfs_hash(line, strlen(line), hash);
+    }
+    return hash;
+}
+
+// Write manifest of extracted files in JSON format
+// Allocations of the image are added when allocations is not NULL
+uint8_t pfs_manifest_write(const char* filename, const char* input, const PFS_PLAN & plan, const std::vector<uint64_t> & hashes, const PFS_ALLOC_PROFILE* allocations)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        pfs_printf("pfs_manifest_write: can't create %s\n", filename);
+        return 1;
+    }
+
+    fprintf(file, "{\n  \"input\": \"%s\",\n  \"files\": [\n", json_escape(input).c_str());
+    for (size_t i = 0; i < plan.entries.size(); i++) {
+        const PFS_PLAN_ENTRY & entry = plan.entries[i];
+        fprintf(file, "    { \"name\": \"%s\", \"section\": %u, \"size\": %llu, \"hash\": \"%016llX\" }%s\n",
+            json_escape(entry.filename).c_str(),
+            entry.section,
+            (unsigned long long)entry.size,
+            (unsigned long long)hashes[i],
+            i + 1 < plan.entries.size() ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"sections\": [\n");
+    for (size_t i = 0; i < plan.sections.size(); i++) {
+        fprintf(file, "    { \"number\": %u, %s }%s\n",
+            plan.sections[i].number,
+            pfs_section_json(plan.sections[i]).c_str(),
+            i + 1 < plan.sections.size() ? "," : "");
+    }
+    if (!plan.uefi.empty()) {
+        fprintf(file, "  ],\n  \"uefi\": [\n");
+        for (size_t i = 0; i < plan.uefi.size(); i++) {
+            const PFS_UEFI_INDEX & index = plan.uefi[i];
+            fprintf(file, "    { \"payload\": \"%s\", \"volumes\": [\n", json_escape(index.payload).c_str());
+            for (size_t v = 0; v < index.volumes.size(); v++) {
+                const PFS_UEFI_VOLUME & volume = index.volumes[v];
+                const char* fileSystem = guid_to_string(&volume.fileSystem);
+                const char* name = guid_to_string(&volume.name);
+                fprintf(file, "      { \"offset\": %llu, \"size\": %llu, \"fileSystem\": \"%s\", \"name\": \"%s\", \"parent\": %d, \"files\": [\n",
+                    (unsigned long long)volume.offset,
+                    (unsigned long long)volume.size,
+                    fileSystem,
+                    name,
+                    volume.parent);
+                delete[] fileSystem;
+                delete[] name;
+                for (size_t f = 0; f < volume.files.size(); f++) {
+                    const PFS_UEFI_FILE & ffs = volume.files[f];
+                    const char* guid = guid_to_string(&ffs.guid);
+                    fprintf(file, "        { \"guid\": \"%s\", \"type\": %u, \"offset\": %llu, \"size\": %llu, \"sections\": %u, \"encapsulated\": %s, \"name\": \"%s\" }%s\n",
+                        guid,
+                        ffs.type,
+                        (unsigned long long)ffs.offset,
+                        (unsigned long long)ffs.size,
+                        ffs.sections,
+                        ffs.encapsulated ? "true" : "false",
+                        json_escape(ffs.name).c_str(),
+                        f + 1 < volume.files.size() ? "," : "");
+                    delete[] guid;
+                }
+                fprintf(file, "      ] }%s\n", v + 1 < index.volumes.size() ? "," : "");
+            }
+            fprintf(file, "    ] }%s\n", i + 1 < plan.uefi.size() ? "," : "");
+        }
+    }
+    if (allocations) {
+        fprintf(file, "  ],\n  \"allocations\": [\n");
+        for (uint32_t p = 0; p < PFS_ALLOC_PHASES; p++) {
+            fprintf(file, "    { \"phase\": \"%s\", \"count\": %llu, \"bytes\": %llu, \"peakLive\": %llu }%s\n",
+                pfsPhaseNames[p],
+                (unsigned long long)allocations->count[p].load(),
+                (unsigned long long)allocations->bytes[p].load(),
+                (unsigned long long)allocations->peak[p].load(),
+                p + 1 < PFS_ALLOC_PHASES ? "," : "");
+        }
+    }
+    fprintf(file, "  ],\n  \"manifestHash\": \"%016llX\"\n}\n", (unsigned long long)pfs_manifest_hash(plan, hashes));
+
+    if (ferror(file)) {
+        pfs_printf("pfs_manifest_write: can't write to %s\n", filename);
+        fclose(file);
+        return 2;
+    }
+    fclose(file);
+    return 0;
+}
+
+
+// Batch journal
+// Append-only text file with one record per line, every record is flushed to disk before extraction continues:
+// "S <input>" when extraction starts, "C <manifest hash> <input>" when it completes, "F <exit code> <input>" when it fails
+// A record without newline at the end of file was cut short by a crash and is ignored
+class PFS_JOURNAL {
+public:
+    PFS_JOURNAL() : file(NULL) {}
+    ~PFS_JOURNAL() {
+        if (file)
+            fclose(file);
+    }
+
+    // Load existing records and open journal for appending, a record cut short by a crash is removed
+    bool open(const char* path) {
+        FILE* in = fopen(path, "rb");
+        if (in) {
+            std::string line;
+            uint64_t size = 0;
+            int c;
+            while ((c = fgetc(in)) != EOF) {
+                if (c != '\n') {
+                    line += (char)c;
+                    continue;
+                }
+                load(line);
+                size += line.size() + 1;
+                line.clear();
+            }
+            fclose(in);
+            if (!line.empty() && !truncateFile(path, size))
+                return false;
+        }
+
+        file = fopen(path, "ab");
+        return file != NULL;
+    }
+
+    // Check if extraction of input has completed in a previous run
+    bool isCompleted(const std::string & input) const {
+        std::unordered_map<std::string, char>::const_iterator it = states.find(input);
+        return it != states.end() && it->second == 'C';
+    }
+
+    // Check if extraction of input has started but not completed in a previous run
+    bool isPartial(const std::string & input) const {
+        std::unordered_map<std::string, char>::const_iterator it = states.find(input);
+        return it != states.end() && it->second != 'C';
+    }
+
+    // Check if output directory of input may be left by a previous run that was interrupted or failed after publishing it
+    bool isReplaceable(const std::string & input) const {
+        std::unordered_map<std::string, char>::const_iterator it = states.find(input);
+        return it != states.end() && (it->second == 'S' || it->second == 'F');
+    }
+
+    void started(const std::string & input) {
+        record("S ", input);
+    }
+
+    void completed(const std::string & input, uint64_t manifestHash) {
+        char prefix[24];
+        sprintf(prefix, "C %016llX ", (unsigned long long)manifestHash);
+        record(prefix, input);
+    }
+
+    void failed(const std::string & input, int code) {
+        char prefix[24];
+        sprintf(prefix, "F %d ", code);
+        record(prefix, input);
+    }
+
+private:
+    FILE* file;
+    std::mutex lock;
+    std::unordered_map<std::string, char> states;
+
+    void load(const std::string & line) {
+        size_t start = 2;
+        if (line.size() < 2 || line[1] != ' ')
+            return;
+        if (line[0] == 'C' || line[0] == 'F') {
+            start = line.find(' ', 2);
+            if (start == std::string::npos)
+                return;
+            start++;
+        }
+        else if (line[0] != 'S') {
+            return;
+        }
+        // Exit code 5 means output directory existed before, it was not written by this journal
+        char state = line[0];
+        if (state == 'F' && atoi(line.c_str() + 2) == 5)
+            state = 'E';
+        states[line.substr(start)] = state;
+    }
+
+    void record(const char* prefix, const std::string & input) {
+        std::lock_guard<std::mutex> guard(lock);
+        fprintf(file, "%s%s\n", prefix, input.c_str());
+        if (!syncFile(file))
+            printf("PFS_JOURNAL: can't write journal record for %s\n", input.c_str());
+    }
+};
+
+
+// Section catalog
+// JSON Lines file with one line per top-level section of every extracted image, appended to by all jobs
+class PFS_CATALOG {
+public:
+    PFS_CATALOG() : file(NULL) {}
+    ~PFS_CATALOG() {
+        if (file)
+            fclose(file);
+    }
+
+    bool open(const char* path) {
+        file = fopen(path, "ab");
+        return file != NULL;
+    }
+
+    // Add sections of extracted image, lines of an image are written at once
+    bool add(const char* input, const PFS_PLAN & plan) {
+        std::string lines;
+        for (size_t i = 0; i < plan.sections.size(); i++) {
+            char number[16];
+            sprintf(number, "%u", plan.sections[i].number);
+            lines += "{ \"input\": \"" + json_escape(input) + "\", \"section\": " + number + ", " + pfs_section_json(plan.sections[i]) + " }\n";
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        return fwrite(lines.data(), 1, lines.size(), file) == lines.size() && fflush(file) == 0;
+    }
+
+private:
+    FILE* file;
+    std::mutex lock;
+};
+
+
+// Estimate peak memory needed to extract a file, using file size and a prescan of section headers
+// Input buffer is held for the whole extraction and every subsection may need a reassembly buffer
+// of at most its data size, all of them at once when sections are extracted in parallel
+uint64_t pfs_estimate_memory(const char* path, uint32_t threads)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return 0;
+
+    fseek(file, 0, SEEK_END);
+    uint64_t filesize = (uint64_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint64_t gatherTotal = 0;
+    uint64_t gatherMax = 0;
+    PFS_FILE_HEADER fileHeader;
+    if (fread(&fileHeader, sizeof(fileHeader), 1, file) == 1 && fileHeader.Signature == PFS_HEADER_SIGNATURE) {
+        uint64_t offset = sizeof(PFS_FILE_HEADER);
+        uint64_t dataEnd = std::min(filesize, (uint64_t)sizeof(PFS_FILE_HEADER) + fileHeader.DataSize);
+        PFS_SECTION_HEADER sectionHeader;
+        uint64_t signature;
+        uint32_t headerSize;
+        while (offset + sizeof(PFS_SECTION_HEADER) <= dataEnd
+            && !fseek(file, (long)offset, SEEK_SET)
+            && fread(&sectionHeader, sizeof(sectionHeader), 1, file) == 1
+            && (headerSize = pfs_section_header_size(fileHeader.HeaderVersion, sectionHeader.HeaderVersion)) != 0
+            && !fseek(file, (long)(offset + headerSize), SEEK_SET)) {
+            if (sectionHeader.DataSize >= sizeof(signature)
+                && fread(&signature, sizeof(signature), 1, file) == 1
+                && signature == PFS_HEADER_SIGNATURE) {
+                gatherTotal += sectionHeader.DataSize;
+                gatherMax = std::max(gatherMax, (uint64_t)sectionHeader.DataSize);
+            }
+            offset += headerSize + (uint64_t)sectionHeader.DataSize + sectionHeader.DataSignatureSize
+                + sectionHeader.MetadataSize + sectionHeader.MetadataSignatureSize;
+        }
+    }
+    fclose(file);
+
+    return filesize + (threads > 1 ? gatherTotal : gatherMax);
+}
+
+// Probe results
+#define PFS_PROBE_OK        0 // PFS image with valid header and footer
+#define PFS_PROBE_UNREADABLE 1 // File can't be opened or read
+#define PFS_PROBE_NOT_PFS   2 // No PFS header signature
+#define PFS_PROBE_TRUNCATED 3 // File ends before footer
+#define PFS_PROBE_BAD_FOOTER 4 // Footer signature or data size don't match header
+#define PFS_PROBE_BAD_SECTION 5 // Section header runs past end of data
+
+typedef struct PFS_PROBE_RESULT_ {
+    uint8_t  status;        // PFS_PROBE_*
+    uint32_t headerVersion;
+    uint32_t dataSize;
+    uint32_t sections;      // Counted only when section headers are probed
+    uint32_t subsections;
+    uint64_t bytesRead;
+} PFS_PROBE_RESULT;
+
+// Identify PFS image reading only file header, footer and optionally section headers
+PFS_PROBE_RESULT pfs_probe_file(const char* path, bool probeSections)
+{
+    PFS_PROBE_RESULT result;
+    memset(&result, 0, sizeof(result));
+    result.status = PFS_PROBE_UNREADABLE;
+
+    int fd = openFileRead(path);
+    if (fd < 0)
+        return result;
+    uint64_t filesize = getFileSize(fd);
+
+    // Check header
+    PFS_FILE_HEADER fileHeader;
+    if (filesize < sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER)) {
+        result.status = PFS_PROBE_NOT_PFS;
+        closeFile(fd);
+        return result;
+    }
+    if (!readFileAt(fd, &fileHeader, sizeof(fileHeader), 0)) {
+        closeFile(fd);
+        return result;
+    }
+    result.bytesRead += sizeof(fileHeader);
+    if (fileHeader.Signature != PFS_HEADER_SIGNATURE) {
+        result.status = PFS_PROBE_NOT_PFS;
+        closeFile(fd);
+        return result;
+    }
+    result.headerVersion = fileHeader.HeaderVersion;
+    result.dataSize = fileHeader.DataSize;
+
+    // Check footer
+    uint64_t dataEnd = sizeof(PFS_FILE_HEADER) + (uint64_t)fileHeader.DataSize;
+    PFS_FILE_FOOTER fileFooter;
+    if (dataEnd + sizeof(PFS_FILE_FOOTER) > filesize) {
+        result.status = PFS_PROBE_TRUNCATED;
+        closeFile(fd);
+        return result;
+    }
+    if (!readFileAt(fd, &fileFooter, sizeof(fileFooter), dataEnd)) {
+        closeFile(fd);
+        return result;
+    }
+    result.bytesRead += sizeof(fileFooter);
+    if (fileFooter.Signature != PFS_FOOTER_SIGNATURE || fileFooter.DataSize != fileHeader.DataSize) {
+        result.status = PFS_PROBE_BAD_FOOTER;
+        closeFile(fd);
+        return result;
+    }
+    result.status = PFS_PROBE_OK;
+
+    // Walk section headers, a section header is read together with the signature of its data
+    if (probeSections) {
+        uint64_t offset = sizeof(PFS_FILE_HEADER);
+        while (offset < dataEnd) {
+            uint8_t header[sizeof(PFS_SECTION_HEADER) + sizeof(uint64_t)];
+            const PFS_SECTION_HEADER* sectionHeader = (const PFS_SECTION_HEADER*)header;
+            if (offset + sizeof(PFS_SECTION_HEADER) > dataEnd || !readFileAt(fd, header, sizeof(header), offset)) {
+                result.status = PFS_PROBE_BAD_SECTION;
+                break;
+            }
+            result.bytesRead += sizeof(header);
+            uint32_t headerSize = pfs_section_header_size(fileHeader.HeaderVersion, sectionHeader->HeaderVersion);
+            if (!headerSize) {
+                result.status = PFS_PROBE_BAD_SECTION;
+                break;
+            }
+            // Longer section headers need another read for the data signature
+            if (headerSize != sizeof(PFS_SECTION_HEADER)) {
+                if (!readFileAt(fd, header + sizeof(PFS_SECTION_HEADER), sizeof(uint64_t), offset + headerSize)) {
+                    result.status = PFS_PROBE_BAD_SECTION;
+                    break;
+                }
+                result.bytesRead += sizeof(uint64_t);
+            }
+            uint64_t sectionSize = headerSize + (uint64_t)sectionHeader->DataSize + sectionHeader->DataSignatureSize
+                + sectionHeader->MetadataSize + sectionHeader->MetadataSignatureSize;
+            if (offset + sectionSize > dataEnd) {
+                result.status = PFS_PROBE_BAD_SECTION;
+                break;
+            }
+            result.sections++;
+            uint64_t signature;
+            memcpy(&signature, header + sizeof(PFS_SECTION_HEADER), sizeof(signature));
+            if (sectionHeader->DataSize >= sizeof(signature) && signature == PFS_HEADER_SIGNATURE)
+                result.subsections++;
+            offset += sectionSize;
+        }
+    }
+
+    closeFile(fd);
+    return result;
+}
+
+// Probe all inputs and inputs read from standard input with a pool of threads, printing one line per file
+int pfs_probe(const std::vector<const char*> & inputs, bool fromStdin, bool probeSections, uint32_t threads)
+{
+    static const char* statusNames[] = { "PFS", "unreadable", "not PFS", "truncated", "bad footer", "bad section" };
+    PFS_POOL pool(threads);
+    std::mutex printLock;
+    std::atomic<uint32_t> pending(0);
+    std::atomic<uint32_t> probed(0);
+    std::atomic<uint32_t> found(0);
+    std::atomic<uint64_t> bytesRead(0);
+
+    // Without worker threads inputs are probed right away, keeping their order
+    auto submit = [&](const std::string & path) {
+        pending++;
+        std::function<void()> task = [&, path]() {
+            PFS_PROBE_RESULT result = pfs_probe_file(path.c_str(), probeSections);
+            char line[128];
+            int length = sprintf(line, "%s", statusNames[result.status]);
+            if (result.status != PFS_PROBE_UNREADABLE && result.status != PFS_PROBE_NOT_PFS)
+                length += sprintf(line + length, " v%u, data %u bytes", result.headerVersion, result.dataSize);
+            if (probeSections && (result.status == PFS_PROBE_OK || result.status == PFS_PROBE_BAD_SECTION))
+                sprintf(line + length, ", %u sections, %u subsections", result.sections, result.subsections);
+            {
+                std::lock_guard<std::mutex> guard(printLock);
+                printf("%s: %s\n", path.c_str(), line);
+            }
+            probed++;
+            if (result.status == PFS_PROBE_OK)
+                found++;
+            bytesRead += result.bytesRead;
+            pending--;
+        };
+        if (pool.size() < 2)
+            task();
+        else
+            pool.submit(task);
+    };
+
+    for (size_t i = 0; i < inputs.size(); i++)
+        submit(inputs[i]);
+    if (fromStdin) {
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            if (!line.empty())
+                submit(line);
+        }
+    }
+    pool.wait(pending);
+
+    printf("Probed %u files, %u PFS images, %llu bytes read\n", (uint32_t)probed, (uint32_t)found, (unsigned long long)bytesRead.load());
+    return 0;
+}
+
+// Corpus statistics, distributions collected by stats subcommand
+#define PFS_STATS_SECTIONS           0 // Top-level sections per image
+#define PFS_STATS_DATA_SIZE          1 // Sizes of section regions
+#define PFS_STATS_DATA_SIGNATURE_SIZE 2
+#define PFS_STATS_METADATA_SIZE      3
+#define PFS_STATS_METADATA_SIGNATURE_SIZE 4
+#define PFS_STATS_CHUNKS             5 // Chunks per subsection
+#define PFS_STATS_DEPTH              6 // Nesting depth, 1 for images without subsections
+#define PFS_STATS_COUNT              7
+
+const char* pfsStatsNames[PFS_STATS_COUNT] = {
+    "sectionCount", "dataSize", "dataSignatureSize", "metadataSize", "metadataSignatureSize", "chunkCount", "nestingDepth" };
+
+// Distribution of values in log-linear buckets, its size doesn't depend on the size of the corpus
+// Values below 32 have a bucket each, every power of two above is split into 32 buckets,
+// so percentiles are exact below 32 and within 1/32 of the value above
+#define PFS_STATS_SUB_BITS 5
+#define PFS_STATS_SUB_BUCKETS (1u << PFS_STATS_SUB_BITS)
+#define PFS_STATS_FINE_BUCKETS ((32 - PFS_STATS_SUB_BITS + 1) * PFS_STATS_SUB_BUCKETS)
+
+typedef struct PFS_STATS_DISTRIBUTION_ {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t minimum;
+    uint32_t maximum;
+    uint64_t buckets[PFS_STATS_FINE_BUCKETS];
+} PFS_STATS_DISTRIBUTION;
+
+// Bucket of value in distribution
+inline uint32_t pfs_stats_fine_bucket(uint32_t value)
+{
+    if (value < PFS_STATS_SUB_BUCKETS)
+        return value;
+    uint32_t bit = pfs_highest_bit(value);
+    return (bit - PFS_STATS_SUB_BITS + 1) * PFS_STATS_SUB_BUCKETS + ((value >> (bit - PFS_STATS_SUB_BITS)) & (PFS_STATS_SUB_BUCKETS - 1));
+}
+
+// Largest value counted in bucket of distribution
+uint32_t pfs_stats_fine_bound(uint32_t bucket)
+{
+    if (bucket < PFS_STATS_SUB_BUCKETS)
+        return bucket;
+    uint32_t shift = bucket / PFS_STATS_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(PFS_STATS_SUB_BUCKETS + bucket % PFS_STATS_SUB_BUCKETS) << shift;
+    return (uint32_t)(lower + (1ULL << shift) - 1);
+}
+
+void pfs_stats_add(PFS_STATS_DISTRIBUTION & distribution, uint32_t value)
+{
+    distribution.count++;
+    distribution.sum += value;
+    distribution.minimum = std::min(distribution.minimum, value);
+    distribution.maximum = std::max(distribution.maximum, value);
+    distribution.buckets[pfs_stats_fine_bucket(value)]++;
+}
+
+typedef struct PFS_STATS_ {
+    uint64_t files;  // All files walked
+    uint64_t images; // Files with PFS header signature
+    uint64_t errors; // Images with damaged structure, counted in images too
+    uint64_t bytes;  // Size of all images
+    PFS_STATS_DISTRIBUTION distributions[PFS_STATS_COUNT];
+    std::map<std::string, uint64_t> versionSchemes; // Version type characters of sections
+    std::unordered_map<std::string, uint32_t> guidGroups; // Dense group number of every GUID_1 of top-level sections, keyed by its bytes
+    std::vector<std::string> groupGuids;            // GUID_1 string of every group
+    std::vector<uint64_t> groupSections;            // Number of top-level sections of every group
+    std::vector<uint64_t> groupLatest;              // Latest version key of every group, memory grows with groups only
+    PFS_STATS_() : files(0), images(0), errors(0), bytes(0) {
+        memset(distributions, 0, sizeof(distributions));
+        for (uint32_t i = 0; i < PFS_STATS_COUNT; i++)
+            distributions[i].minimum = UINT32_MAX;
+    }
+} PFS_STATS;
+
+// Reader of image bytes, reads size bytes at offset into buffer, returns false if they can't be read
+// Files are read with readFileAt, reassembled payloads through their chunks so they are never copied whole
+typedef std::function<bool(void*, size_t, uint64_t)> PFS_STATS_READER;
+
+// Number of levels of images nested in reassembled payloads followed, deeper levels are not counted
+#define PFS_STATS_MAX_DEPTH 16
+
+uint32_t pfs_stats_subsection(const PFS_STATS_READER & read, uint64_t offset, uint64_t size, PFS_STATS* stats, uint32_t level);
+
+// Walk sections of image nested in reassembled payload reading their headers only, returns nesting depth of image
+// Damaged nested images are counted up to the damage, they don't make the file damaged
+uint32_t pfs_stats_nested(const PFS_STATS_READER & read, uint64_t size, uint32_t level)
+{
+    PFS_FILE_HEADER fileHeader;
+    if (size < sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER) || !read(&fileHeader, sizeof(fileHeader), 0))
+        return 1;
+    uint64_t dataEnd = std::min(size, (uint64_t)sizeof(PFS_FILE_HEADER) + fileHeader.DataSize);
+    uint64_t offset = sizeof(PFS_FILE_HEADER);
+    uint32_t depth = 1;
+    while (offset < dataEnd) {
+        uint8_t header[sizeof(PFS_SECTION_HEADER) + sizeof(uint64_t)];
+        const PFS_SECTION_HEADER* sectionHeader = (const PFS_SECTION_HEADER*)header;
+        if (offset + sizeof(header) > dataEnd || !read(header, sizeof(header), offset))
+            break;
+        uint32_t headerSize = pfs_section_header_size(fileHeader.HeaderVersion, sectionHeader->HeaderVersion);
+        if (!headerSize || (headerSize != sizeof(PFS_SECTION_HEADER)
+            && !read(header + sizeof(PFS_SECTION_HEADER), sizeof(uint64_t), offset + headerSize)))
+            break;
+        uint64_t dataOffset = offset + headerSize;
+        offset = dataOffset + (uint64_t)sectionHeader->DataSize + sectionHeader->DataSignatureSize
+            + sectionHeader->MetadataSize + sectionHeader->MetadataSignatureSize;
+        if (offset > dataEnd)
+            break;
+        uint64_t signature;
+        memcpy(&signature, header + sizeof(PFS_SECTION_HEADER), sizeof(signature));
+        if (sectionHeader->DataSize >= sizeof(signature) && signature == PFS_HEADER_SIGNATURE)
+            depth = std::max(depth, 1 + pfs_stats_subsection(read, dataOffset, sectionHeader->DataSize, NULL, level));
+    }
+    return depth;
+}
+
+// Walk subsection chunks reading their headers only, chunk count is added to stats if not NULL
+// Image nested in reassembled payload is walked through the chunks, returns nesting depth below parent or 0 if damaged
+uint32_t pfs_stats_subsection(const PFS_STATS_READER & read, uint64_t offset, uint64_t size, PFS_STATS* stats, uint32_t level)
+{
+    PFS_FILE_HEADER fileHeader;
+    if (size < sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER) || !read(&fileHeader, sizeof(fileHeader), offset))
+        return 0;
+    uint64_t dataEnd = offset + sizeof(PFS_FILE_HEADER) + (uint64_t)fileHeader.DataSize;
+    if (dataEnd + sizeof(PFS_FILE_FOOTER) > offset + size)
+        return 0;
+
+    // Chunk headers are read up to order number, chunk payloads are only located
+    std::vector<std::pair<uint16_t, std::pair<uint64_t, uint64_t> > > chunks; // Order number, payload offset and size
+    uint32_t chunkCount = 0;
+    uint64_t sectionOffset = offset + sizeof(PFS_FILE_HEADER);
+    while (sectionOffset < dataEnd) {
+        uint8_t header[sizeof(PFS_SECTION_HEADER) + offsetof(PFS_CHUNK_PREFIX, Unknown1)];
+        const PFS_SECTION_HEADER* sectionHeader = (const PFS_SECTION_HEADER*)header;
+        if (sectionOffset + sizeof(header) > dataEnd || !read(header, sizeof(header), sectionOffset))
+            return 0;
+        uint32_t headerSize = pfs_section_header_size(fileHeader.HeaderVersion, sectionHeader->HeaderVersion);
+        if (!headerSize || (headerSize != sizeof(PFS_SECTION_HEADER)
+            && !read(header + sizeof(PFS_SECTION_HEADER), sizeof(header) - sizeof(PFS_SECTION_HEADER), sectionOffset + headerSize)))
+            return 0;
+        const PFS_CHUNK_PREFIX* prefix = (const PFS_CHUNK_PREFIX*)(sectionHeader + 1);
+        if (sectionHeader->DataSize >= sizeof(PFS_CHUNK_PREFIX))
+            chunks.push_back(std::make_pair(pfs_chunk_order(prefix),
+                std::make_pair(sectionOffset + headerSize + sizeof(PFS_CHUNK_PREFIX), (uint64_t)sectionHeader->DataSize - sizeof(PFS_CHUNK_PREFIX))));
+        sectionOffset += headerSize + (uint64_t)sectionHeader->DataSize + sectionHeader->DataSignatureSize
+            + sectionHeader->MetadataSize + sectionHeader->MetadataSignatureSize;
+        chunkCount++;
+    }
+    if (stats)
+        pfs_stats_add(stats->distributions[PFS_STATS_CHUNKS], chunkCount);
+
+    // Payload is read in order of chunk order numbers
+    std::stable_sort(chunks.begin(), chunks.end(),
+        [](const std::pair<uint16_t, std::pair<uint64_t, uint64_t> > & a, const std::pair<uint16_t, std::pair<uint64_t, uint64_t> > & b) { return a.first < b.first; });
+    uint64_t payloadSize = 0;
+    for (size_t i = 0; i < chunks.size(); i++)
+        payloadSize += chunks[i].second.second;
+    uint64_t signature;
+    if (level >= PFS_STATS_MAX_DEPTH || payloadSize < sizeof(signature) || chunks[0].second.second < sizeof(signature)
+        || !read(&signature, sizeof(signature), chunks[0].second.first) || signature != PFS_HEADER_SIGNATURE)
+        return 1;
+    PFS_STATS_READER payload = [&read, &chunks](void* buffer, size_t bytes, uint64_t at) {
+        uint8_t* out = (uint8_t*)buffer;
+        for (size_t i = 0; i < chunks.size() && bytes; i++) {
+            uint64_t length = chunks[i].second.second;
+            if (at >= length) {
+                at -= length;
+                continue;
+            }
+            size_t part = (size_t)std::min((uint64_t)bytes, length - at);
+            if (!read(out, part, chunks[i].second.first + at))
+                return false;
+            out += part;
+            bytes -= part;
+            at = 0;
+        }
+        return bytes == 0;
+    };
+    return 1 + pfs_stats_nested(payload, payloadSize, level + 1);
+}
+
+// Collect statistics of a file reading only headers
+void pfs_stats_file(const char* path, PFS_STATS & stats)
+{
+    stats.files++;
+    int fd = openFileRead(path);
+    if (fd < 0)
+        return;
+    uint64_t filesize = getFileSize(fd);
+    PFS_STATS_READER read = [fd](void* buffer, size_t size, uint64_t offset) { return readFileAt(fd, buffer, size, offset); };
+
+    PFS_FILE_HEADER fileHeader;
+    if (filesize < sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER)
+        || !readFileAt(fd, &fileHeader, sizeof(fileHeader), 0)
+        || fileHeader.Signature != PFS_HEADER_SIGNATURE) {
+        closeFile(fd);
+        return;
+    }
+    stats.images++;
+    stats.bytes += filesize;
+
+    uint64_t dataEnd = std::min(filesize, (uint64_t)sizeof(PFS_FILE_HEADER) + fileHeader.DataSize);
+    uint64_t offset = sizeof(PFS_FILE_HEADER);
+    uint32_t sections = 0;
+    uint32_t depth = 1;
+    bool damaged = (dataEnd + sizeof(PFS_FILE_FOOTER) > filesize);
+    while (offset < dataEnd && !damaged) {
+        uint8_t header[sizeof(PFS_SECTION_HEADER) + sizeof(uint64_t)];
+        const PFS_SECTION_HEADER* sectionHeader = (const PFS_SECTION_HEADER*)header;
+        if (offset + sizeof(header) > dataEnd || !readFileAt(fd, header, sizeof(header), offset)) {
+            damaged = true;
+            break;
+        }
+        uint32_t headerSize = pfs_section_header_size(fileHeader.HeaderVersion, sectionHeader->HeaderVersion);
+        if (!headerSize || (headerSize != sizeof(PFS_SECTION_HEADER)
+            && !readFileAt(fd, header + sizeof(PFS_SECTION_HEADER), sizeof(uint64_t), offset + headerSize))) {
+            damaged = true;
+            break;
+        }
+        uint64_t dataOffset = offset + headerSize;
+        offset = dataOffset + (uint64_t)sectionHeader->DataSize + sectionHeader->DataSignatureSize
+            + sectionHeader->MetadataSize + sectionHeader->MetadataSignatureSize;
+        if (offset > dataEnd) {
+            damaged = true;
+            break;
+        }
+        sections++;
+        pfs_stats_add(stats.distributions[PFS_STATS_DATA_SIZE], sectionHeader->DataSize);
+        pfs_stats_add(stats.distributions[PFS_STATS_DATA_SIGNATURE_SIZE], sectionHeader->DataSignatureSize);
+        pfs_stats_add(stats.distributions[PFS_STATS_METADATA_SIZE], sectionHeader->MetadataSize);
+        pfs_stats_add(stats.distributions[PFS_STATS_METADATA_SIGNATURE_SIZE], sectionHeader->MetadataSignatureSize);
+
+        // Version scheme is the string of version type characters, unknown types are shown as '?'
+        char scheme[5] = { 0 };
+        for (uint8_t i = 0; i < 4; i++) {
+            char type = (char)sectionHeader->VersionType[i];
+            if (type == ' ' || type == 0)
+                break;
+            scheme[i] = (type == 'A' || type == 'N') ? type : '?';
+        }
+        stats.versionSchemes[scheme[0] ? scheme : "none"]++;
+
+        // GUID string is made once per group, sections refer to their group by number
+        std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> group = stats.guidGroups.insert(
+            std::make_pair(std::string((const char*)&sectionHeader->Guid1, sizeof(EFI_GUID)), (uint32_t)stats.groupGuids.size()));
+        if (group.second) {
+            const char* guid = guid_to_string(&sectionHeader->Guid1);
+            stats.groupGuids.push_back(guid);
+            stats.groupSections.push_back(0);
+            stats.groupLatest.push_back(0);
+            delete[] guid;
+        }
+        stats.groupSections[group.first->second]++;
+        uint64_t & latest = stats.groupLatest[group.first->second];
+        latest = std::max(latest, pfs_version_key(sectionHeader->VersionType, sectionHeader->Version));
+
+        uint64_t signature;
+        memcpy(&signature, header + sizeof(PFS_SECTION_HEADER), sizeof(signature));
+        if (sectionHeader->DataSize >= sizeof(signature) && signature == PFS_HEADER_SIGNATURE) {
+            uint32_t below = pfs_stats_subsection(read, dataOffset, sectionHeader->DataSize, &stats, 1);
+            if (!below)
+                damaged = true;
+            depth = std::max(depth, 1 + below);
+        }
+    }
+    closeFile(fd);
+
+    pfs_stats_add(stats.distributions[PFS_STATS_SECTIONS], sections);
+    pfs_stats_add(stats.distributions[PFS_STATS_DEPTH], depth);
+    if (damaged)
+        stats.errors++;
+}
+
+// Merge statistics collected by one thread into total
+void pfs_stats_merge(PFS_STATS & total, const PFS_STATS & stats)
+{
+    total.files += stats.files;
+    total.images += stats.images;
+    total.errors += stats.errors;
+    total.bytes += stats.bytes;
+    for (uint32_t i = 0; i < PFS_STATS_COUNT; i++) {
+        PFS_STATS_DISTRIBUTION & distribution = total.distributions[i];
+        distribution.count += stats.distributions[i].count;
+        distribution.sum += stats.distributions[i].sum;
+        distribution.minimum = std::min(distribution.minimum, stats.distributions[i].minimum);
+        distribution.maximum = std::max(distribution.maximum, stats.distributions[i].maximum);
+        for (uint32_t b = 0; b < PFS_STATS_FINE_BUCKETS; b++)
+            distribution.buckets[b] += stats.distributions[i].buckets[b];
+    }
+    for (std::map<std::string, uint64_t>::const_iterator it = stats.versionSchemes.begin(); it != stats.versionSchemes.end(); ++it)
+        total.versionSchemes[it->first] += it->second;
+
+    // Groups of thread are merged once per group
+    for (std::unordered_map<std::string, uint32_t>::const_iterator it = stats.guidGroups.begin(); it != stats.guidGroups.end(); ++it) {
+        std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> group = total.guidGroups.insert(
+            std::make_pair(it->first, (uint32_t)total.groupGuids.size()));
+        if (group.second) {
+            total.groupGuids.push_back(stats.groupGuids[it->second]);
+            total.groupSections.push_back(0);
+            total.groupLatest.push_back(0);
+        }
+        total.groupSections[group.first->second] += stats.groupSections[it->second];
+        total.groupLatest[group.first->second] = std::max(total.groupLatest[group.first->second], stats.groupLatest[it->second]);
+    }
+}
+
+// Renumber groups in the order of their GUID strings, so reports list GUIDs sorted
+void pfs_stats_sort_groups(PFS_STATS & stats)
+{
+    std::vector<uint32_t> order(stats.groupGuids.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&stats](uint32_t a, uint32_t b) { return stats.groupGuids[a] < stats.groupGuids[b]; });
+
+    std::vector<uint32_t> groups(order.size());
+    std::vector<std::string> groupGuids(order.size());
+    std::vector<uint64_t> groupSections(order.size());
+    std::vector<uint64_t> groupLatest(order.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        groups[order[i]] = i;
+        groupGuids[i].swap(stats.groupGuids[order[i]]);
+        groupSections[i] = stats.groupSections[order[i]];
+        groupLatest[i] = stats.groupLatest[order[i]];
+    }
+    stats.groupGuids.swap(groupGuids);
+    stats.groupSections.swap(groupSections);
+    stats.groupLatest.swap(groupLatest);
+    for (std::unordered_map<std::string, uint32_t>::iterator it = stats.guidGroups.begin(); it != stats.guidGroups.end(); ++it)
+        it->second = groups[it->second];
+}
+
+// Summary of a distribution, histogram buckets are powers of two with bucket i counting values up to 2^i - 1
+#define PFS_STATS_BUCKETS 33
+#define PFS_STATS_PERCENTILES 4
+const uint32_t pfsStatsPercentiles[PFS_STATS_PERCENTILES] = { 50, 90, 95, 99 };
+
+typedef struct PFS_STATS_SUMMARY_ {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t minimum;
+    uint32_t maximum;
+    uint32_t percentiles[PFS_STATS_PERCENTILES];
+    uint64_t buckets[PFS_STATS_BUCKETS];
+} PFS_STATS_SUMMARY;
+
+// Summarize distribution, buckets of distribution never cross powers of two, so histogram counts are exact
+PFS_STATS_SUMMARY pfs_stats_summarize(const PFS_STATS_DISTRIBUTION & distribution)
+{
+    PFS_STATS_SUMMARY summary;
+    memset(&summary, 0, sizeof(summary));
+    summary.count = distribution.count;
+    if (!distribution.count)
+        return summary;
+
+    summary.sum = distribution.sum;
+    summary.minimum = distribution.minimum;
+    summary.maximum = distribution.maximum;
+    for (uint32_t i = 0; i < PFS_STATS_PERCENTILES; i++) {
+        // Nearest-rank percentile, reported as the largest value of its bucket within observed range
+        uint64_t rank = std::max((uint64_t)1, ((uint64_t)pfsStatsPercentiles[i] * distribution.count + 99) / 100);
+        uint64_t seen = 0;
+        uint32_t b = 0;
+        while (seen + distribution.buckets[b] < rank)
+            seen += distribution.buckets[b++];
+        summary.percentiles[i] = std::max(distribution.minimum, std::min(distribution.maximum, pfs_stats_fine_bound(b)));
+    }
+    for (uint32_t b = 0; b < PFS_STATS_FINE_BUCKETS; b++) {
+        if (!distribution.buckets[b])
+            continue;
+        uint32_t value = pfs_stats_fine_bound(b);
+        summary.buckets[value ? pfs_highest_bit(value) + 1 : 0] += distribution.buckets[b];
+    }
+    return summary;
+}
+
+// Upper bound of histogram bucket
+uint64_t pfs_stats_bucket_bound(uint32_t bucket)
+{
+    return (1ULL << bucket) - 1;
+}
+
+void pfs_stats_write_json(FILE* file, const PFS_STATS & stats, const PFS_STATS_SUMMARY* summaries)
+{
+    fprintf(file, "{\n  \"files\": %llu,\n  \"images\": %llu,\n  \"damaged\": %llu,\n  \"bytes\": %llu,\n  \"distributions\": {\n",
+        (unsigned long long)stats.files, (unsigned long long)stats.images, (unsigned long long)stats.errors, (unsigned long long)stats.bytes);
+    for (uint32_t i = 0; i < PFS_STATS_COUNT; i++) {
+        const PFS_STATS_SUMMARY & summary = summaries[i];
+        fprintf(file, "    \"%s\": { \"count\": %llu, \"min\": %u, \"max\": %u, \"mean\": %.2f",
+            pfsStatsNames[i],
+            (unsigned long long)summary.count,
+            summary.minimum,
+            summary.maximum,
+            summary.count ? (double)summary.sum / summary.count : 0.0);
+        for (uint32_t p = 0; p < PFS_STATS_PERCENTILES; p++)
+            fprintf(file, ", \"p%u\": %u", pfsStatsPercentiles[p], summary.percentiles[p]);
+        fprintf(file, ",\n      \"histogram\": [");
+        bool first = true;
+        for (uint32_t b = 0; b < PFS_STATS_BUCKETS; b++) {
+            if (!summary.buckets[b])
+                continue;
+            fprintf(file, "%s{ \"le\": %llu, \"count\": %llu }", first ? " " : ", ",
+                (unsigned long long)pfs_stats_bucket_bound(b), (unsigned long long)summary.buckets[b]);
+            first = false;
+        }
+        fprintf(file, " ] }%s\n", i + 1 < PFS_STATS_COUNT ? "," : "");
+    }
+
+    fprintf(file, "  },\n  \"versionSchemes\": {");
+    for (std::map<std::string, uint64_t>::const_iterator it = stats.versionSchemes.begin(); it != stats.versionSchemes.end(); ++it)
+        fprintf(file, "%s\n    \"%s\": %llu", it == stats.versionSchemes.begin() ? "" : ",", json_escape(it->first).c_str(), (unsigned long long)it->second);
+    fprintf(file, "\n  },\n  \"guids\": {");
+    for (size_t i = 0; i < stats.groupGuids.size(); i++)
+        fprintf(file, "%s\n    \"%s\": %llu", i ? "," : "", stats.groupGuids[i].c_str(), (unsigned long long)stats.groupSections[i]);
+    fprintf(file, "\n  },\n  \"latestVersions\": {");
+    for (size_t i = 0; i < stats.groupGuids.size(); i++)
+        fprintf(file, "%s\n    \"%s\": \"%016llX\"", i ? "," : "", stats.groupGuids[i].c_str(), (unsigned long long)stats.groupLatest[i]);
+    fprintf(file, "\n  }\n}\n");
+}
+
+// CSV in long format, one metric,key,value row per number
+void pfs_stats_write_csv(FILE* file, const PFS_STATS & stats, const PFS_STATS_SUMMARY* summaries)
+{
+    fprintf(file, "metric,key,value\n");
+    fprintf(file, "total,files,%llu\ntotal,images,%llu\ntotal,damaged,%llu\ntotal,bytes,%llu\n",
+        (unsigned long long)stats.files, (unsigned long long)stats.images, (unsigned long long)stats.errors, (unsigned long long)stats.bytes);
+    for (uint32_t i = 0; i < PFS_STATS_COUNT; i++) {
+        const PFS_STATS_SUMMARY & summary = summaries[i];
+        fprintf(file, "%s,count,%llu\n%s,min,%u\n%s,max,%u\n%s,mean,%.2f\n",
+            pfsStatsNames[i], (unsigned long long)summary.count,
+            pfsStatsNames[i], summary.minimum,
+            pfsStatsNames[i], summary.maximum,
+            pfsStatsNames[i], summary.count ? (double)summary.sum / summary.count : 0.0);
+        for (uint32_t p = 0; p < PFS_STATS_PERCENTILES; p++)
+            fprintf(file, "%s,p%u,%u\n", pfsStatsNames[i], pfsStatsPercentiles[p], summary.percentiles[p]);
+        for (uint32_t b = 0; b < PFS_STATS_BUCKETS; b++) {
+            if (summary.buckets[b])
+                fprintf(file, "%s,le_%llu,%llu\n", pfsStatsNames[i], (unsigned long long)pfs_stats_bucket_bound(b), (unsigned long long)summary.buckets[b]);
+        }
+    }
+    for (std::map<std::string, uint64_t>::const_iterator it = stats.versionSchemes.begin(); it != stats.versionSchemes.end(); ++it)
+        fprintf(file, "versionScheme,%s,%llu\n", it->first.c_str(), (unsigned long long)it->second);
+    for (size_t i = 0; i < stats.groupGuids.size(); i++)
+        fprintf(file, "guid,%s,%llu\n", stats.groupGuids[i].c_str(), (unsigned long long)stats.groupSections[i]);
+    for (size_t i = 0; i < stats.groupGuids.size(); i++)
+        fprintf(file, "latestVersion,%s,%016llX\n", stats.groupGuids[i].c_str(), (unsigned long long)stats.groupLatest[i]);
+}
+
+// Walk directory trees in parallel, every directory is a pool task and its files are visited by the thread that lists it
+// Returns the number of directories that can't be listed
+uint32_t pfs_walk_directories(const std::vector<std::string> & roots, uint32_t threads, const std::function<void(const std::string &)> & visit)
+{
+    PFS_POOL pool(threads);
+    std::atomic<uint32_t> pending(0);
+    std::atomic<uint32_t> unreadable(0);
+    std::function<void(const std::string &)> walk = [&](const std::string & dir) {
+        std::vector<std::string> files;
+        std::vector<std::string> directories;
+        if (!listDirectory(dir.c_str(), files, directories))
+            unreadable++;
+        for (size_t i = 0; i < directories.size(); i++) {
+            pending++;
+            std::string subdirectory = directories[i];
+            pool.submit([&walk, subdirectory]() { walk(subdirectory); });
+        }
+        for (size_t i = 0; i < files.size(); i++)
+            visit(files[i]);
+        pending--;
+    };
+    for (size_t i = 0; i < roots.size(); i++) {
+        pending++;
+        std::string root = roots[i];
+        pool.submit([&walk, root]() { walk(root); });
+    }
+    pool.wait(pending);
+    return unreadable;
+}
+
+// Statistics of thread walking the corpus, merged when the walk is done
+thread_local PFS_STATS* statsShard = NULL;
+
+// Stats subcommand, walks directory trees in parallel and writes distributions as JSON and CSV
+int pfs_stats_main(int argc, char* argv[])
+{
+    std::vector<std::string> roots;
+    const char* jsonPath = NULL;
+    const char* csvPath = NULL;
+    uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+    bool usage = false;
+    for (int i = 2; i < argc && !usage; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = (uint32_t)atoi(argv[++i]);
+            if (threads == 0)
+                usage = true;
+        }
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (!strcmp(argv[i], "--csv") && i + 1 < argc)
+            csvPath = argv[++i];
+        else if (argv[i][0] == '-')
+            usage = true;
+        else
+            roots.push_back(argv[i]);
+    }
+    if (usage || roots.empty()) {
+        printf("Usage: PFSExtractor stats [options] directory [directory ...]\n\n"
+            "Options:\n"
+            "  --threads N            number of threads walking directories (default: number of CPUs)\n"
+            "  --json FILE            write distributions as JSON to FILE, - for standard output (default)\n"
+            "  --csv FILE             write distributions as CSV to FILE, - for standard output\n");
+        return 1;
+    }
+    if (!jsonPath && !csvPath)
+        jsonPath = "-";
+
+    // Files are parsed into statistics of the thread that lists their directory
+    std::mutex shardsLock;
+    std::vector<PFS_STATS*> shards;
+    uint32_t unreadable = pfs_walk_directories(roots, threads, [&](const std::string & path) {
+        if (!statsShard) {
+            statsShard = new PFS_STATS;
+            std::lock_guard<std::mutex> guard(shardsLock);
+            shards.push_back(statsShard);
+        }
+        pfs_stats_file(path.c_str(), *statsShard);
+    });
+
+    PFS_STATS total;
+    for (size_t i = 0; i < shards.size(); i++) {
+        pfs_stats_merge(total, *shards[i]);
+        delete shards[i];
+    }
+    statsShard = NULL;
+    PFS_STATS_SUMMARY summaries[PFS_STATS_COUNT];
+    for (uint32_t i = 0; i < PFS_STATS_COUNT; i++)
+        summaries[i] = pfs_stats_summarize(total.distributions[i]);
+    pfs_stats_sort_groups(total);
+    if (unreadable)
+        fprintf(stderr, "Can't read %u directories\n", unreadable);
+
+    // Write reports
+    const char* paths[2] = { jsonPath, csvPath };
+    for (uint32_t i = 0; i < 2; i++) {
+        if (!paths[i])
+            continue;
+        bool toStdout = !strcmp(paths[i], "-");
+        FILE* file = toStdout ? stdout : fopen(paths[i], "w");
+        if (!file) {
+            printf("Can't create %s\n", paths[i]);
+            return 7;
+        }
+        if (i == 0)
+            pfs_stats_write_json(file, total, summaries);
+        else
+            pfs_stats_write_csv(file, total, summaries);
+        if (!toStdout && fclose(file)) {
+            printf("Can't write %s\n", paths[i]);
+            return 7;
+        }
+    }
+    return 0;
+}
+
+// Bloom filter sidecar of an image, written into output directory as <input>.extracted/bloom.pfsbloom
+// The filter is split into 128-bit blocks, all bits of an item are set in one block,
+// so testing an item reads a single block and compares it with one 128-bit mask
+#define PFS_BLOOM_SIGNATURE 0x4D4F4F4C42534650ULL // PFSBLOOM
+#define PFS_BLOOM_VERSION 1
+#define PFS_BLOOM_SUFFIX ".pfsbloom"
+#define PFS_BLOOM_FILENAME "bloom" PFS_BLOOM_SUFFIX
+#define PFS_BLOOM_BLOCK_SIZE 16
+#define PFS_BLOOM_MIN_BLOCKS 4
+#define PFS_BLOOM_MAX_BLOCKS (1u << 24)
+#define PFS_BLOOM_BITS_PER_ITEM 16 // Under 1% false positives with 8 bits set per item
+#define PFS_BLOOM_ITEM_BITS 8
+
+// Items of different kinds never hash alike
+#define PFS_BLOOM_ITEM_GUID 'G' // Section GUID or FFS file GUID
+#define PFS_BLOOM_ITEM_HASH 'H' // Content hash of output file
+
+#pragma pack(push, 1)
+typedef struct PFS_BLOOM_HEADER_ {
+    uint64_t Signature; // PFS_BLOOM_SIGNATURE
+    uint32_t Version;   // PFS_BLOOM_VERSION
+    uint32_t Blocks;    // Number of blocks following the header, a power of two
+    uint32_t Items;     // Number of items added, duplicates included
+    uint32_t Reserved;
+} PFS_BLOOM_HEADER;
+#pragma pack(pop)
+
+// Block index and 128-bit mask of an item
+typedef struct PFS_BLOOM_PROBE_ {
+    uint32_t block;
+    uint8_t  mask[PFS_BLOOM_BLOCK_SIZE];
+} PFS_BLOOM_PROBE;
+
+// Finalizer of splitmix64, spreads FNV-1a hash over all bits
+uint64_t pfs_bloom_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Compute probe of item for filter of blocks blocks, blocks must be a power of two
+void pfs_bloom_probe(uint8_t kind, const void* item, size_t size, uint32_t blocks, PFS_BLOOM_PROBE & probe)
+{
+    uint64_t hash = pfs_bloom_mix(pfs_hash(item, size, pfs_hash(&kind, 1)));
+    uint64_t bits = pfs_bloom_mix(hash);
+    probe.block = (uint32_t)(hash >> 32) & (blocks - 1);
+    memset(probe.mask, 0, sizeof(probe.mask));
+    for (uint32_t i = 0; i < PFS_BLOOM_ITEM_BITS; i++) {
+        uint32_t bit = (uint32_t)(bits >> (i * 7)) & 0x7F;
+        probe.mask[bit >> 3] |= (uint8_t)(1u << (bit & 7));
+    }
+}
+
+// Test if all bits of mask are set in block
+inline bool pfs_bloom_test(const uint8_t* block, const uint8_t* mask)
+{
+#ifdef PFS_HAVE_SSE2
+    __m128i bits = _mm_loadu_si128((const __m128i*)mask);
+    __m128i set = _mm_and_si128(_mm_loadu_si128((const __m128i*)block), bits);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(set, bits)) == 0xFFFF;
+#else
+    uint64_t b[2], m[2];
+    memcpy(b, block, sizeof(b));
+    memcpy(m, mask, sizeof(m));
+    return (b[0] & m[0]) == m[0] && (b[1] & m[1]) == m[1];
+#endif
+}
+
+// Build filter over section GUIDs at every level, FFS file GUIDs and output file hashes of plan
+void pfs_bloom_build(const PFS_PLAN & plan, const std::vector<uint64_t> & hashes, PFS_BLOOM_HEADER & header, std::vector<uint8_t> & blocks)
+{
+    uint32_t items = (uint32_t)(plan.guids.size() + hashes.size());
+    for (size_t i = 0; i < plan.uefi.size(); i++)
+        for (size_t j = 0; j < plan.uefi[i].volumes.size(); j++)
+            items += (uint32_t)plan.uefi[i].volumes[j].files.size();
+    uint32_t count = PFS_BLOOM_MIN_BLOCKS;
+    while (count < PFS_BLOOM_MAX_BLOCKS && (uint64_t)count * PFS_BLOOM_BLOCK_SIZE * 8 < (uint64_t)items * PFS_BLOOM_BITS_PER_ITEM)
+        count <<= 1;
+    header.Signature = PFS_BLOOM_SIGNATURE;
+    header.Version = PFS_BLOOM_VERSION;
+    header.Blocks = count;
+    header.Items = items;
+    header.Reserved = 0;
+    blocks.assign((size_t)count * PFS_BLOOM_BLOCK_SIZE, 0);
+
+    PFS_BLOOM_PROBE probe;
+    std::function<void(uint8_t, const void*, size_t)> add = [&](uint8_t kind, const void* item, size_t size) {
+        pfs_bloom_probe(kind, item, size, count, probe);
+        uint8_t* block = &blocks[(size_t)probe.block * PFS_BLOOM_BLOCK_SIZE];
+        for (uint32_t i = 0; i < PFS_BLOOM_BLOCK_SIZE; i++)
+            block[i] |= probe.mask[i];
+    };
+    for (size_t i = 0; i < plan.guids.size(); i++)
+        add(PFS_BLOOM_ITEM_GUID, &plan.guids[i], sizeof(EFI_GUID));
+    for (size_t i = 0; i < plan.uefi.size(); i++)
+        for (size_t j = 0; j < plan.uefi[i].volumes.size(); j++)
+            for (size_t k = 0; k < plan.uefi[i].volumes[j].files.size(); k++)
+                add(PFS_BLOOM_ITEM_GUID, &plan.uefi[i].volumes[j].files[k].guid, sizeof(EFI_GUID));
+    for (size_t i = 0; i < hashes.size(); i++)
+        add(PFS_BLOOM_ITEM_HASH, &hashes[i], sizeof(uint64_t));
+}
+
+// Write filter of plan to filename in staging directory, it is published together with output files
+bool pfs_bloom_write(const char* filename, const PFS_PLAN & plan, const std::vector<uint64_t> & hashes)
+{
+    PFS_BLOOM_HEADER header;
+    std::vector<uint8_t> blocks;
+    pfs_bloom_build(plan, hashes, header, blocks);
+    FILE* file = fopen(filename, "wb");
+    if (!file)
+        return false;
+    bool result = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(blocks.data(), 1, blocks.size(), file) == blocks.size();
+    return (fclose(file) == 0) && result;
+}
+
+// Get image a filter was written for, filters are written into output directory <input>.extracted
+std::string pfs_bloom_image(const std::string & path)
+{
+    size_t separator = path.find_last_of("/\\");
+    std::string directory = (separator == std::string::npos) ? std::string(".") : path.substr(0, separator);
+    size_t suffixLength = strlen(".extracted");
+    if (directory.size() > suffixLength && !directory.compare(directory.size() - suffixLength, suffixLength, ".extracted"))
+        directory.resize(directory.size() - suffixLength);
+    return directory;
+}
+
+// Parse GUID in the format of guid_to_string
+bool pfs_parse_guid(const char* string, EFI_GUID & guid)
+{
+    unsigned int data[11];
+    int length = 0;
+    if (strlen(string) != 36
+        || sscanf(string, "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x%n", &data[0], &data[1], &data[2], &data[3], &data[4],
+            &data[5], &data[6], &data[7], &data[8], &data[9], &data[10], &length) != 11 || length != 36)
+        return false;
+    guid.Data1 = data[0];
+    guid.Data2 = (uint16_t)data[1];
+    guid.Data3 = (uint16_t)data[2];
+    for (uint32_t i = 0; i < 8; i++)
+        guid.Data4[i] = (uint8_t)data[3 + i];
+    return true;
+}
+
+// Query item, probes are computed once for every filter size found
+typedef struct PFS_BLOOM_QUERY_ITEM_ {
+    uint8_t     kind;
+    uint8_t     data[sizeof(EFI_GUID)];
+    size_t      size;
+    PFS_BLOOM_PROBE probes[32]; // Probe for filter of 1 << i blocks
+} PFS_BLOOM_QUERY_ITEM;
+
+// Test filter file against all query items, returns 1 if image may contain all of them, 0 if it does not, -1 if filter can't be read
+int pfs_bloom_query_file(const char* path, const std::vector<PFS_BLOOM_QUERY_ITEM> & items)
+{
+    int fd = openFileRead(path);
+    if (fd < 0)
+        return -1;
+    uint64_t filesize = getFileSize(fd);
+    PFS_BUFFER buffer;
+    if (filesize < sizeof(PFS_BLOOM_HEADER) || !buffer.load(fd, (size_t)filesize)) {
+        closeFile(fd);
+        return -1;
+    }
+    closeFile(fd);
+    const PFS_BLOOM_HEADER* header = (const PFS_BLOOM_HEADER*)buffer.data();
+    if (header->Signature != PFS_BLOOM_SIGNATURE || header->Version != PFS_BLOOM_VERSION
+        || header->Blocks == 0 || (header->Blocks & (header->Blocks - 1)) || header->Blocks > PFS_BLOOM_MAX_BLOCKS
+        || filesize != sizeof(PFS_BLOOM_HEADER) + (uint64_t)header->Blocks * PFS_BLOOM_BLOCK_SIZE)
+        return -1;
+    uint32_t order = pfs_lowest_bit(header->Blocks);
+    const uint8_t* blocks = buffer.data() + sizeof(PFS_BLOOM_HEADER);
+    for (size_t i = 0; i < items.size(); i++) {
+        const PFS_BLOOM_PROBE & probe = items[i].probes[order];
+        if (!pfs_bloom_test(blocks + (size_t)probe.block * PFS_BLOOM_BLOCK_SIZE, probe.mask))
+            return 0;
+    }
+    return 1;
+}
+
+// Bloom query subcommand, walks directory trees in parallel, tests every filter found and prints candidate images
+int pfs_bloom_query_main(int argc, char* argv[])
+{
+    std::vector<std::string> roots;
+    std::vector<PFS_BLOOM_QUERY_ITEM> items;
+    uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+    bool usage = false;
+    for (int i = 2; i < argc && !usage; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = (uint32_t)atoi(argv[++i]);
+            if (threads == 0)
+                usage = true;
+        }
+        else if (!strcmp(argv[i], "--guid") && i + 1 < argc) {
+            PFS_BLOOM_QUERY_ITEM item;
+            EFI_GUID guid;
+            if (!pfs_parse_guid(argv[++i], guid)) {
+                printf("Invalid GUID %s\n", argv[i]);
+                return 1;
+            }
+            item.kind = PFS_BLOOM_ITEM_GUID;
+            item.size = sizeof(EFI_GUID);
+            memcpy(item.data, &guid, sizeof(EFI_GUID));
+            items.push_back(item);
+        }
+        else if (!strcmp(argv[i], "--hash") && i + 1 < argc) {
+            PFS_BLOOM_QUERY_ITEM item;
+            char* end;
+            uint64_t hash = strtoull(argv[++i], &end, 16);
+            if (!*argv[i] || *end) {
+                printf("Invalid hash %s\n", argv[i]);
+                return 1;
+            }
+            item.kind = PFS_BLOOM_ITEM_HASH;
+            item.size = sizeof(uint64_t);
+            memcpy(item.data, &hash, sizeof(uint64_t));
+            items.push_back(item);
+        }
+        else if (argv[i][0] == '-')
+            usage = true;
+        else
+            roots.push_back(argv[i]);
+    }
+    if (usage || roots.empty() || items.empty()) {
+        printf("Usage: PFSExtractor bloom-query [options] path [path ...]\n\n"
+            "Prints images whose " PFS_BLOOM_SUFFIX " filters may contain all queried items,\n"
+            "paths are filter files or directories searched for them.\n\n"
+            "Options:\n"
+            "  --guid GUID            section or FFS file GUID, as written in manifest\n"
+            "  --hash HASH            content hash of output file, as written in manifest\n"
+            "  --threads N            number of threads walking directories (default: number of CPUs)\n");
+        return 1;
+    }
+    for (size_t i = 0; i < items.size(); i++)
+        for (uint32_t order = 0; order < 32; order++)
+            pfs_bloom_probe(items[i].kind, items[i].data, items[i].size, 1u << order, items[i].probes[order]);
+
+    // Filters are tested by the thread that lists their directory, paths that are filters are tested first
+    std::mutex candidatesLock;
+    std::vector<std::string> candidates;
+    std::atomic<uint32_t> filters(0);
+    std::atomic<uint32_t> unreadable(0);
+    size_t suffixLength = strlen(PFS_BLOOM_SUFFIX);
+    auto isFilter = [suffixLength](const std::string & path) {
+        return path.size() > suffixLength && !path.compare(path.size() - suffixLength, suffixLength, PFS_BLOOM_SUFFIX);
+    };
+    std::function<void(const std::string &)> test = [&](const std::string & path) {
+        int result = pfs_bloom_query_file(path.c_str(), items);
+        if (result < 0) {
+            fprintf(stderr, "Can't read Bloom filter %s\n", path.c_str());
+            unreadable++;
+            return;
+        }
+        filters++;
+        if (result) {
+            std::lock_guard<std::mutex> guard(candidatesLock);
+            candidates.push_back(pfs_bloom_image(path));
+        }
+    };
+    std::vector<std::string> directories;
+    for (size_t i = 0; i < roots.size(); i++) {
+        if (isFilter(roots[i]))
+            test(roots[i]);
+        else
+            directories.push_back(roots[i]);
+    }
+    unreadable += pfs_walk_directories(directories, threads, [&](const std::string & path) {
+        if (isFilter(path))
+            test(path);
+    });
+
+    std::sort(candidates.begin(), candidates.end());
+    for (size_t i = 0; i < candidates.size(); i++)
+        printf("%s\n", candidates[i].c_str());
+    fprintf(stderr, "Tested %u filters, %u candidates\n", (uint32_t)filters, (uint32_t)candidates.size());
+    return unreadable ? 7 : 0;
+}
+
+// Piece of repacked image, its bytes are readable in memory and may also be copied from a file inside the kernel
+typedef struct PFS_REPACK_PIECE_ {
+    const uint8_t* data;
+    uint64_t size;
+    int      fd;     // File holding the same bytes, -1 if only in memory
+    uint64_t offset; // Offset of bytes in file
+} PFS_REPACK_PIECE;
+
+typedef struct PFS_REPACK_ {
+    std::deque<std::vector<uint8_t> > headers; // Generated headers and footers
+    std::deque<PFS_BUFFER> files;              // Source image and replacement files
+    std::vector<int> fds;
+    uint32_t replaced;                         // Replacement files used
+    PFS_REPACK_() : replaced(0) {}
+    ~PFS_REPACK_() {
+        for (size_t i = 0; i < fds.size(); i++)
+            closeFile(fds[i]);
+    }
+} PFS_REPACK;
+
+// Append piece, pieces continuing the previous one in the same file are merged into it
+void pfs_repack_add(std::vector<PFS_REPACK_PIECE> & pieces, const uint8_t* data, uint64_t size, int fd, uint64_t offset)
+{
+    if (!size)
+        return;
+    if (!pieces.empty()) {
+        PFS_REPACK_PIECE & last = pieces.back();
+        if (fd >= 0 && last.fd == fd && last.offset + last.size == offset && last.data + last.size == data) {
+            last.size += size;
+            return;
+        }
+    }
+    PFS_REPACK_PIECE piece = { data, size, fd, offset };
+    pieces.push_back(piece);
+}
+
+// Append generated bytes
+void pfs_repack_bytes(PFS_REPACK & repack, std::vector<PFS_REPACK_PIECE> & pieces, const void* data, size_t size)
+{
+    repack.headers.push_back(std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + size));
+    pfs_repack_add(pieces, repack.headers.back().data(), size, -1, 0);
+}
+
+uint64_t pfs_repack_size(const std::vector<PFS_REPACK_PIECE> & pieces)
+{
+    uint64_t size = 0;
+    for (size_t i = 0; i < pieces.size(); i++)
+        size += pieces[i].size;
+    return size;
+}
+
+// Open and map file, returns NULL if it can't be read
+const PFS_BUFFER* pfs_repack_open(PFS_REPACK & repack, const char* path, uint64_t size, int & fd)
+{
+    fd = openFileRead(path);
+    if (fd < 0) {
+        printf("pfs_repack: can't open %s\n", path);
+        return NULL;
+    }
+    repack.fds.push_back(fd);
+    repack.files.emplace_back();
+    if (!repack.files.back().load(fd, (size_t)size)) {
+        printf("pfs_repack: can't read %s\n", path);
+        return NULL;
+    }
+    return &repack.files.back();
+}
+
+// Wrap body into PFS image with file header and footer, the footer checksum is computed over body
+bool pfs_repack_image(PFS_REPACK & repack, const std::vector<PFS_REPACK_PIECE> & body, uint32_t headerVersion, std::vector<PFS_REPACK_PIECE> & out)
+{
+    uint64_t size = pfs_repack_size(body);
+    if (size > UINT32_MAX) {
+        printf("pfs_repack: image data too large\n");
+        return false;
+    }
+
+    uint32_t crc = 0;
+    for (size_t i = 0; i < body.size(); i++)
+        crc = pfs_crc32(body[i].data, (size_t)body[i].size, crc);
+
+    PFS_FILE_HEADER header;
+    header.Signature = PFS_HEADER_SIGNATURE;
+    header.HeaderVersion = headerVersion;
+    header.DataSize = (uint32_t)size;
+    PFS_FILE_FOOTER footer;
+    footer.DataSize = (uint32_t)size;
+    footer.Checksum = ~crc;
+    footer.Signature = PFS_FOOTER_SIGNATURE;
+
+    pfs_repack_bytes(repack, out, &header, sizeof(header));
+    for (size_t i = 0; i < body.size(); i++)
+        pfs_repack_add(out, body[i].data, body[i].size, body[i].fd, body[i].offset);
+    pfs_repack_bytes(repack, out, &footer, sizeof(footer));
+    return true;
+}
+
+// Build subsection image from new payload, split into chunks of original lengths with the last chunk taking the rest
+// Chunk prefixes, section headers and other regions are taken from the original subsection and laid out by its format
+bool pfs_repack_chunks(PFS_REPACK & repack, const uint8_t* source, int sourceFd, uint64_t subsectionOffset, uint64_t subsectionSize,
+    const PFS_CHUNK_TABLE & chunks, const uint8_t* payload, uint64_t payloadSize, int payloadFd, std::vector<PFS_REPACK_PIECE> & out)
+{
+    const PFS_FORMAT* format = pfs_format_of(source + subsectionOffset, subsectionSize);
+    if (!format) {
+        printf("pfs_repack: subsection has unsupported header version\n");
+        return false;
+    }
+    PFS_CHUNK_TABLE checked = chunks;
+    if (chunks.orderNum.empty() || pfs_chunk_table_validate(checked)) {
+        printf("pfs_repack: subsection chunks are damaged, can't split new payload\n");
+        return false;
+    }
+
+    std::vector<uint32_t> order = pfs_chunk_table_order(chunks);
+    std::vector<uint64_t> starts(order.size());
+    std::vector<uint64_t> lengths(order.size());
+    uint64_t position = 0;
+    for (size_t k = 0; k < order.size(); k++) {
+        uint64_t length = (k + 1 == order.size()) ? payloadSize - position : std::min((uint64_t)chunks.length[order[k]], payloadSize - position);
+        starts[order[k]] = position;
+        lengths[order[k]] = length;
+        position += length;
+    }
+
+    std::vector<PFS_REPACK_PIECE> body;
+    for (size_t i = 0; i < chunks.orderNum.size(); i++) {
+        uint64_t prefixOffset = chunks.offset[i] - format->chunkPrefixSize;
+        uint64_t headerOffset = prefixOffset - format->sectionHeaderSize;
+        std::vector<uint8_t> header(source + headerOffset, source + headerOffset + format->sectionHeaderSize);
+        uint8_t regions[PFS_REGION_COUNT];
+        uint32_t sizes[PFS_REGION_COUNT];
+        format->layout(header.data(), regions, sizes);
+        if (format->chunkPrefixSize + lengths[i] > UINT32_MAX) {
+            printf("pfs_repack: subsection chunk too large\n");
+            return false;
+        }
+        format->resize(header.data(), PFS_REGION_DATA, (uint32_t)(format->chunkPrefixSize + lengths[i]));
+
+        pfs_repack_bytes(repack, body, header.data(), header.size());
+        uint64_t offset = headerOffset + format->sectionHeaderSize;
+        for (uint8_t r = 0; r < PFS_REGION_COUNT; r++) {
+            if (regions[r] == PFS_REGION_DATA) {
+                pfs_repack_add(body, source + prefixOffset, format->chunkPrefixSize, sourceFd, prefixOffset);
+                pfs_repack_add(body, payload + starts[i], lengths[i], payloadFd, starts[i]);
+            }
+            else {
+                pfs_repack_add(body, source + offset, sizes[r], sourceFd, offset);
+            }
+            offset += sizes[r];
+        }
+    }
+
+    const PFS_FILE_HEADER* subsectionHeader = (const PFS_FILE_HEADER*)(source + subsectionOffset);
+    return pfs_repack_image(repack, body, subsectionHeader->HeaderVersion, out);
+}
+
+// Write pieces to file, pieces backed by a file are copied inside the kernel where it is supported
+uint8_t pfs_repack_write(const char* filename, const std::vector<PFS_REPACK_PIECE> & pieces, uint64_t & copiedInKernel)
+{
+    copiedInKernel = 0;
+#ifndef WIN32
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        printf("write_file: can't create %s\n", filename);
+        return 1;
+    }
+
+    std::vector<struct iovec> iov;
+    bool copyRange = true;
+    bool result = true;
+    for (size_t i = 0; i < pieces.size() && result; i++) {
+        const PFS_REPACK_PIECE & piece = pieces[i];
+        uint64_t left = piece.size;
+#if defined(__linux__) && defined(__NR_copy_file_range)
+        if (piece.fd >= 0 && copyRange) {
+            if (!iov.empty()) {
+                result = write_all_v(fd, iov.data(), iov.size());
+                iov.clear();
+            }
+            loff_t offset = (loff_t)piece.offset;
+            while (left && result) {
+                ssize_t done = syscall(__NR_copy_file_range, piece.fd, &offset, fd, NULL, (size_t)std::min(left, (uint64_t)0x40000000), 0);
+                if (done < 0 && errno == EINTR)
+                    continue;
+                if (done <= 0)
+                    break;
+                left -= (uint64_t)done;
+                copiedInKernel += (uint64_t)done;
+            }
+            // Write the rest from memory, stop trying when not supported between these files
+            if (left && left == piece.size)
+                copyRange = false;
+        }
+#endif
+        if (left) {
+            struct iovec range = { (void*)(piece.data + piece.size - left), (size_t)left };
+            iov.push_back(range);
+        }
+    }
+    if (result && !iov.empty())
+        result = write_all_v(fd, iov.data(), iov.size());
+    if (!result) {
+        printf("write_file: can't write to %s\n", filename);
+        close(fd);
+        return 2;
+    }
+    close(fd);
+    return 0;
+#else
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        printf("write_file: can't create %s\n", filename);
+        return 1;
+    }
+    for (size_t i = 0; i < pieces.size(); i++) {
+        if (fwrite(pieces[i].data, 1, (size_t)pieces[i].size, file) != pieces[i].size) {
+            printf("write_file: can't write to %s\n", filename);
+            fclose(file);
+            return 2;
+        }
+    }
+    fclose(file);
+    return 0;
+#endif
+}
+
+// Hash contents of file with pfs_hash, returns false if it can't be read
+bool pfs_hash_file(const char* path, uint64_t size, uint64_t & hash)
+{
+    int fd = openFileRead(path);
+    if (fd < 0)
+        return false;
+    PFS_BUFFER buffer;
+    bool result = buffer.load(fd, (size_t)size);
+    closeFile(fd);
+    if (result)
+        hash = pfs_hash(buffer.data(), (size_t)size);
+    return result;
+}
+
+// Build PFS image from files listed in manifest, files changed since extraction replace their regions
+// A file is changed when its size or hash differs from the manifest, so copies that don't keep modification times
+// still repack the same image, unchanged regions are copied from the image the manifest was made from
+int pfs_repack(const char* manifestPath, const char* outputPath)
+{
+    PFS_JSON manifest;
+    if (!pfs_json_read(manifestPath, manifest))
+        return 11;
+    const PFS_JSON* input = manifest.get("input");
+    const PFS_JSON* files = manifest.get("files");
+    if (!input || input->type != PFS_JSON_STRING || !files || files->type != PFS_JSON_ARRAY) {
+        printf("pfs_repack: %s is not a manifest\n", manifestPath);
+        return 11;
+    }
+
+    // Files are next to manifest
+    std::string directory = manifestPath;
+    size_t separator = directory.find_last_of(PATH_SEPARATORS);
+    directory = (separator == std::string::npos) ? "." : directory.substr(0, separator);
+    std::map<std::string, uint64_t> changed; // Changed files with their current size
+    for (size_t i = 0; i < files->items.size(); i++) {
+        const PFS_JSON* name = files->items[i].get("name");
+        const PFS_JSON* size = files->items[i].get("size");
+        const PFS_JSON* hash = files->items[i].get("hash");
+        if (!name || name->type != PFS_JSON_STRING || !size || size->type != PFS_JSON_NUMBER || !hash || hash->type != PFS_JSON_STRING) {
+            printf("pfs_repack: file %d in %s has no name, size or hash\n", (int)i, manifestPath);
+            return 11;
+        }
+        uint64_t fileSize;
+        uint64_t fileTime;
+        std::string path = directory + "/" + name->string;
+        if (!getFileInfo(path.c_str(), fileSize, fileTime)) {
+            printf("pfs_repack: can't find %s\n", path.c_str());
+            return 11;
+        }
+        if (fileSize != (uint64_t)size->number) {
+            changed[name->string] = fileSize;
+            continue;
+        }
+        uint64_t fileHash;
+        if (!pfs_hash_file(path.c_str(), fileSize, fileHash)) {
+            printf("pfs_repack: can't read %s\n", path.c_str());
+            return 11;
+        }
+        if (fileHash != strtoull(hash->string.c_str(), NULL, 16))
+            changed[name->string] = fileSize;
+    }
+
+    // Plan extraction of source image to find regions
+    PFS_REPACK repack;
+    int sourceFd;
+    uint64_t sourceSize;
+    uint64_t sourceTime;
+    if (!getFileInfo(input->string.c_str(), sourceSize, sourceTime)) {
+        printf("Can't open input file %s\n", input->string.c_str());
+        return 2;
+    }
+    const PFS_BUFFER* sourceBuffer = pfs_repack_open(repack, input->string.c_str(), sourceSize, sourceFd);
+    if (!sourceBuffer)
+        return 2;
+    const uint8_t* source = sourceBuffer->data();
+    PFS_PLAN plan;
+    uint8_t result;
+    {
+        // Headers are only shown when the source image can't be planned
+        PFS_JOB_OUTPUT planOutput;
+        result = pfs_plan(source, (size_t)sourceSize, NULL, source, 0, plan);
+        if (!result)
+            planOutput.discard();
+    }
+    if (result)
+        return result;
+
+    // Sections are rebuilt with the header layout of the format the image was planned with
+    const PFS_FORMAT* format = pfs_format_of(source, sourceSize);
+    if (!format) {
+        printf("pfs_repack: %s has unsupported header version\n", input->string.c_str());
+        return 11;
+    }
+
+    std::vector<PFS_REPACK_PIECE> body;
+    for (size_t s = 0; s < plan.sections.size(); s++) {
+        const PFS_PLAN_SECTION & section = plan.sections[s];
+        std::vector<uint8_t> header(source + section.headerOffset, source + section.headerOffset + section.headerSize);
+        uint8_t regionOrder[PFS_REGION_COUNT];
+        uint32_t regionSizes[PFS_REGION_COUNT];
+        format->layout(header.data(), regionOrder, regionSizes);
+        std::vector<PFS_REPACK_PIECE> regions;
+        uint64_t offset = section.headerOffset + section.headerSize;
+        for (uint8_t i = 0; i < PFS_REGION_COUNT; i++) {
+            uint8_t r = regionOrder[i];
+            uint64_t regionOffset = offset;
+            uint32_t regionSize = regionSizes[i];
+            offset += regionSize;
+            char name[240];
+            sprintf(name, "section_%d_%s%s", section.number, section.version.c_str(), pfsRegionNames[r]);
+            std::map<std::string, uint64_t>::const_iterator file = changed.find(name);
+
+            // Changed payload of subsection is split into chunks again
+            if (r == PFS_REGION_DATA) {
+                char payloadName[240];
+                sprintf(payloadName, "section_%d_%spayload", section.number, section.version.c_str());
+                std::map<std::string, uint64_t>::const_iterator payload = changed.find(payloadName);
+                if (payload != changed.end()) {
+                    if (file != changed.end()) {
+                        printf("pfs_repack: both %s and %s are changed\n", name, payloadName);
+                        return 11;
+                    }
+                    const PFS_PLAN_ENTRY* entry = NULL;
+                    for (size_t e = 0; e < plan.entries.size() && !entry; e++) {
+                        if (plan.entries[e].type == PFS_PLAN_GATHER && plan.entries[e].section == section.number)
+                            entry = &plan.entries[e];
+                    }
+                    int payloadFd;
+                    const PFS_BUFFER* buffer = entry ? pfs_repack_open(repack, (directory + "/" + payloadName).c_str(), payload->second, payloadFd) : NULL;
+                    if (!buffer)
+                        return 11;
+                    std::vector<PFS_REPACK_PIECE> subsection;
+                    if (!pfs_repack_chunks(repack, source, sourceFd, regionOffset, regionSize, entry->chunks, buffer->data(), payload->second, payloadFd,
+                            subsection))
+                        return 11;
+                    uint64_t subsectionSize = pfs_repack_size(subsection);
+                    if (subsectionSize > UINT32_MAX) {
+                        printf("pfs_repack: %s too large\n", payloadName);
+                        return 11;
+                    }
+                    format->resize(header.data(), r, (uint32_t)subsectionSize);
+                    regions.insert(regions.end(), subsection.begin(), subsection.end());
+                    repack.replaced++;
+                    changed.erase(payload);
+                    continue;
+                }
+            }
+
+            if (file == changed.end()) {
+                pfs_repack_add(regions, source + regionOffset, regionSize, sourceFd, regionOffset);
+                continue;
+            }
+            if (file->second > UINT32_MAX) {
+                printf("pfs_repack: %s too large\n", name);
+                return 11;
+            }
+            int fileFd;
+            const PFS_BUFFER* buffer = pfs_repack_open(repack, (directory + "/" + name).c_str(), file->second, fileFd);
+            if (!buffer)
+                return 11;
+            format->resize(header.data(), r, (uint32_t)file->second);
+            pfs_repack_add(regions, buffer->data(), file->second, fileFd, 0);
+            repack.replaced++;
+            changed.erase(file);
+        }
+
+        // Section header is copied as is when sizes stay the same
+        if (!memcmp(header.data(), source + section.headerOffset, header.size()))
+            pfs_repack_add(body, source + section.headerOffset, header.size(), sourceFd, section.headerOffset);
+        else
+            pfs_repack_bytes(repack, body, header.data(), header.size());
+        for (size_t i = 0; i < regions.size(); i++)
+            pfs_repack_add(body, regions[i].data, regions[i].size, regions[i].fd, regions[i].offset);
+    }
+
+    // Changed files that aren't top-level regions or payloads, such as files of nested images, are never used
+    if (!changed.empty()) {
+        for (std::map<std::string, uint64_t>::const_iterator it = changed.begin(); it != changed.end(); ++it)
+            printf("pfs_repack: changed %s can't be repacked, only top-level regions and payloads can\n", it->first.c_str());
+        return 11;
+    }
+
+    std::vector<PFS_REPACK_PIECE> image;
+    if (!pfs_repack_image(repack, body, ((const PFS_FILE_HEADER*)source)->HeaderVersion, image))
+        return 11;
+
+    // Write into temporary file first, so a failed repack never leaves a partial image in place
+    std::string output = outputPath ? outputPath : input->string + ".repacked";
+    std::string temporary = output + ".tmp";
+    uint64_t copiedInKernel;
+    if (pfs_repack_write(temporary.c_str(), image, copiedInKernel)) {
+        remove(temporary.c_str());
+        return 7;
+    }
+#ifdef WIN32
+    // Rename replaces existing file atomically elsewhere, but fails on Windows
+    remove(output.c_str());
+#endif
+    if (rename(temporary.c_str(), output.c_str())) {
+        printf("Can't rename %s to %s\n", temporary.c_str(), output.c_str());
+        return 7;
+    }
+    printf("Repacked %s into %s: %llu bytes, %u files replaced, %llu bytes copied by kernel\n",
+        input->string.c_str(),
+        output.c_str(),
+        (unsigned long long)pfs_repack_size(image),
+        repack.replaced,
+        (unsigned long long)copiedInKernel);
+    return 0;
+}
+
+// Region of a section replaced by patch
+typedef struct PFS_PATCH_ {
+    uint32_t    section;
+    uint8_t     region; // PFS_REGION_*
+    std::string file;
+} PFS_PATCH;
+
+// Parse patch specification section=N,region=NAME,file=PATH, file must be the last key
+bool pfs_parse_patch(const char* spec, PFS_PATCH & patch)
+{
+    bool hasSection = false;
+    patch.region = PFS_REGION_DATA;
+    patch.file.clear();
+    while (*spec) {
+        if (!strncmp(spec, "file=", 5)) {
+            patch.file = spec + 5;
+            break;
+        }
+        const char* end = strchr(spec, ',');
+        std::string item = end ? std::string(spec, end - spec) : std::string(spec);
+        if (!item.compare(0, 8, "section=")) {
+            char* numberEnd;
+            patch.section = (uint32_t)strtoul(item.c_str() + 8, &numberEnd, 0);
+            hasSection = (*numberEnd == '\0' && item.size() > 8);
+        }
+        else if (!item.compare(0, 7, "region=")) {
+            uint8_t region = 0;
+            while (region < PFS_REGION_COUNT && item.compare(7, std::string::npos, pfsRegionNames[region]))
+                region++;
+            if (region == PFS_REGION_COUNT)
+                return false;
+            patch.region = region;
+        }
+        else {
+            return false;
+        }
+        if (!end)
+            break;
+        spec = end + 1;
+    }
+    return hasSection && !patch.file.empty();
+}
+
+// Patch regions of image into a copy sharing unchanged blocks with the original
+// Regions of the same size overwrite changed blocks only and the checksum is updated from CRC of the differences,
+// otherwise everything after the first size change is moved with large kernel copies and only data before
+// the last changed region is read to update the checksum, the original checksum is assumed to be valid
+int pfs_patch(const char* input, std::vector<PFS_PATCH> patches, const char* outputPath)
+{
+#ifndef WIN32
+    PFS_REPACK repack;
+    uint64_t sourceSize;
+    uint64_t sourceTime;
+    int sourceFd;
+    if (!getFileInfo(input, sourceSize, sourceTime)) {
+        printf("Can't open input file %s\n", input);
+        return 2;
+    }
+    const PFS_BUFFER* sourceBuffer = pfs_repack_open(repack, input, sourceSize, sourceFd);
+    if (!sourceBuffer)
+        return 2;
+    const uint8_t* source = sourceBuffer->data();
+
+    // Find sections
+    const PFS_FILE_HEADER* fileHeader = (const PFS_FILE_HEADER*)source;
+    if (sourceSize < sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER) || fileHeader->Signature != PFS_HEADER_SIGNATURE
+        || sizeof(PFS_FILE_HEADER) + (uint64_t)fileHeader->DataSize + sizeof(PFS_FILE_FOOTER) > sourceSize) {
+        printf("pfs_patch: %s is not a valid PFS image\n", input);
+        return 1;
+    }
+    uint64_t dataEnd = sizeof(PFS_FILE_HEADER) + (uint64_t)fileHeader->DataSize;
+
+    // All sections are laid out by the format of the first one, as in pfs_plan
+    const PFS_FORMAT* format = pfs_format_of(source, dataEnd);
+    if (!format) {
+        printf("pfs_patch: %s has unsupported header version\n", input);
+        return 11;
+    }
+    std::vector<uint64_t> sectionOffsets;
+    for (uint64_t offset = sizeof(PFS_FILE_HEADER); offset < dataEnd; ) {
+        // Header must be in data before its sizes are read
+        const PFS_SECTION_HEADER* sectionHeader = (const PFS_SECTION_HEADER*)(source + offset);
+        if (offset + format->sectionHeaderSize > dataEnd) {
+            printf("pfs_patch: section %d of %s is damaged\n", (int)sectionOffsets.size(), input);
+            return 1;
+        }
+        if (sectionHeader->HeaderVersion != format->sectionVersion) {
+            printf("pfs_patch: section %d of %s has unsupported header version %X\n", (int)sectionOffsets.size(), input, sectionHeader->HeaderVersion);
+            return 11;
+        }
+        uint8_t regions[PFS_REGION_COUNT];
+        uint32_t sizes[PFS_REGION_COUNT];
+        format->layout(source + offset, regions, sizes);
+        uint64_t next = offset + format->sectionHeaderSize + (uint64_t)sizes[0] + sizes[1] + sizes[2] + sizes[3];
+        if (next > dataEnd) {
+            printf("pfs_patch: section %d of %s is damaged\n", (int)sectionOffsets.size(), input);
+            return 1;
+        }
+        sectionOffsets.push_back(offset);
+        offset = next;
+    }
+
+    // Map replacement files, a region can be patched only once
+    std::vector<const PFS_BUFFER*> buffers(patches.size());
+    std::vector<int> fds(patches.size());
+    std::vector<uint64_t> sizes(patches.size());
+    for (size_t i = 0; i < patches.size(); i++) {
+        if (patches[i].section >= sectionOffsets.size()) {
+            printf("pfs_patch: %s has no section %u\n", input, patches[i].section);
+            return 11;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (patches[j].section == patches[i].section && patches[j].region == patches[i].region) {
+                printf("pfs_patch: section %u region %s is patched twice\n", patches[i].section, pfsRegionNames[patches[i].region]);
+                return 11;
+            }
+        }
+        uint64_t fileTime;
+        if (!getFileInfo(patches[i].file.c_str(), sizes[i], fileTime) || sizes[i] > UINT32_MAX) {
+            printf("pfs_patch: can't use %s\n", patches[i].file.c_str());
+            return 11;
+        }
+        buffers[i] = pfs_repack_open(repack, patches[i].file.c_str(), sizes[i], fds[i]);
+        if (!buffers[i])
+            return 11;
+    }
+
+    // Lay out patched image, changed pieces and their positions in source are remembered for the checksum update
+    std::vector<PFS_REPACK_PIECE> body;
+    bool sameLayout = true;
+    uint64_t lastChangeEnd = sizeof(PFS_FILE_HEADER); // End of last changed byte in source
+    uint32_t delta = 0;                                // CRC of differences for patches of the same size
+    for (size_t s = 0; s < sectionOffsets.size(); s++) {
+        std::vector<uint8_t> header(source + sectionOffsets[s], source + sectionOffsets[s] + format->sectionHeaderSize);
+        uint8_t regionOrder[PFS_REGION_COUNT];
+        uint32_t regionSizes[PFS_REGION_COUNT];
+        format->layout(header.data(), regionOrder, regionSizes);
+        std::vector<PFS_REPACK_PIECE> regions;
+        uint64_t offset = sectionOffsets[s] + format->sectionHeaderSize;
+        for (uint8_t k = 0; k < PFS_REGION_COUNT; k++) {
+            uint8_t r = regionOrder[k];
+            uint64_t regionOffset = offset;
+            uint32_t regionSize = regionSizes[k];
+            offset += regionSize;
+            size_t i = 0;
+            while (i < patches.size() && (patches[i].section != s || patches[i].region != r))
+                i++;
+            if (i == patches.size()) {
+                pfs_repack_add(regions, source + regionOffset, regionSize, sourceFd, regionOffset);
+                continue;
+            }
+
+            pfs_repack_add(regions, buffers[i]->data(), sizes[i], fds[i], 0);
+            lastChangeEnd = regionOffset + regionSize;
+            if (sizes[i] != regionSize) {
+                sameLayout = false;
+                format->resize(header.data(), r, (uint32_t)sizes[i]);
+                continue;
+            }
+
+            // CRC of differences between old and new region, moved to the end of data
+            // pfs_crc32 is given and returns inverted state, so it runs without initial and final inversion
+            uint32_t differences = 0;
+            uint8_t block[0x10000];
+            for (uint64_t done = 0; done < regionSize; done += sizeof(block)) {
+                size_t length = (size_t)std::min((uint64_t)sizeof(block), regionSize - done);
+                for (size_t b = 0; b < length; b++)
+                    block[b] = source[regionOffset + done + b] ^ buffers[i]->data()[done + b];
+                differences = ~pfs_crc32(block, length, ~differences);
+            }
+            delta ^= pfs_crc32_shift(differences, dataEnd - (regionOffset + regionSize));
+        }
+
+        if (!memcmp(header.data(), source + sectionOffsets[s], header.size()))
+            pfs_repack_add(body, source + sectionOffsets[s], header.size(), sourceFd, sectionOffsets[s]);
+        else
+            pfs_repack_bytes(repack, body, header.data(), header.size());
+        for (size_t i = 0; i < regions.size(); i++)
+            pfs_repack_add(body, regions[i].data, regions[i].size, regions[i].fd, regions[i].offset);
+    }
+    uint64_t newDataSize = pfs_repack_size(body);
+    if (newDataSize > UINT32_MAX) {
+        printf("pfs_patch: patched image data too large\n");
+        return 11;
+    }
+
+    // With sizes changed, the CRC of data after the last change follows from the original checksum,
+    // so only data up to the last change is checksummed, before and after patching
+    const PFS_FILE_FOOTER* fileFooter = (const PFS_FILE_FOOTER*)(source + dataEnd);
+    if (!sameLayout) {
+        uint64_t suffixSize = dataEnd - lastChangeEnd;
+        uint32_t oldPrefix = pfs_crc32(source + sizeof(PFS_FILE_HEADER), (size_t)(lastChangeEnd - sizeof(PFS_FILE_HEADER)));
+        uint32_t newPrefix = 0;
+        uint64_t left = newDataSize - suffixSize;
+        for (size_t i = 0; i < body.size() && left; i++) {
+            uint64_t length = std::min(left, body[i].size);
+            newPrefix = pfs_crc32(body[i].data, (size_t)length, newPrefix);
+            left -= length;
+        }
+        delta = pfs_crc32_shift(oldPrefix ^ newPrefix, suffixSize);
+    }
+
+    std::vector<PFS_REPACK_PIECE> image;
+    PFS_FILE_HEADER newHeader = *fileHeader;
+    newHeader.DataSize = (uint32_t)newDataSize;
+    PFS_FILE_FOOTER newFooter = *fileFooter;
+    newFooter.DataSize = (uint32_t)newDataSize;
+    newFooter.Checksum = fileFooter->Checksum ^ delta;
+    pfs_repack_bytes(repack, image, &newHeader, sizeof(newHeader));
+    for (size_t i = 0; i < body.size(); i++)
+        pfs_repack_add(image, body[i].data, body[i].size, body[i].fd, body[i].offset);
+    pfs_repack_bytes(repack, image, &newFooter, sizeof(newFooter));
+    pfs_repack_add(image, source + dataEnd + sizeof(PFS_FILE_FOOTER), sourceSize - dataEnd - sizeof(PFS_FILE_FOOTER), sourceFd, dataEnd + sizeof(PFS_FILE_FOOTER));
 
+    // Clone original, then write pieces not already in place
+    std::string output = outputPath ? outputPath : std::string(input) + ".patched";
+    std::string temporary = output + ".tmp";
+    bool cloned;
+    if (!cloneFile(input, temporary.c_str(), cloned)) {
+        printf("pfs_patch: can't create %s\n", temporary.c_str());
+        remove(temporary.c_str());
+        return 7;
+    }
+    int fd = open(temporary.c_str(), O_WRONLY | O_CLOEXEC);
+    bool result = (fd >= 0);
+    uint64_t position = 0;
+    uint64_t written = 0;
+    for (size_t i = 0; i < image.size() && result; i++) {
+        const PFS_REPACK_PIECE & piece = image[i];
+        if (piece.fd == sourceFd && piece.offset == position) {
+            position += piece.size;
+            continue;
+        }
+
+        // Same size replacement only writes blocks that differ
+        if (sameLayout && piece.fd >= 0) {
+            for (uint64_t done = 0; done < piece.size && result; done += 0x1000) {
+                size_t length = (size_t)std::min((uint64_t)0x1000, piece.size - done);
+                if (memcmp(piece.data + done, source + position + done, length)) {
+                    result = writeFileAt(fd, piece.data + done, length, position + done);
+                    written += length;
+                }
+            }
+        }
+        else {
+            uint64_t copied = (piece.fd >= 0) ? copyFileRange(piece.fd, piece.offset, fd, position, piece.size) : 0;
+            if (copied < piece.size)
+                result = writeFileAt(fd, piece.data + copied, (size_t)(piece.size - copied), position + copied);
+            written += piece.size;
+        }
+        position += piece.size;
+    }
+    result = result && ftruncate(fd, (off_t)position) == 0;
+    if (fd >= 0)
+        result = (close(fd) == 0) && result;
+    if (!result) {
+        printf("pfs_patch: can't write to %s\n", temporary.c_str());
+        remove(temporary.c_str());
+        return 7;
+    }
+    if (rename(temporary.c_str(), output.c_str())) {
+        printf("Can't rename %s to %s\n", temporary.c_str(), output.c_str());
+        return 7;
+    }
+    printf("Patched %s into %s: %llu bytes, %llu bytes written, %s\n",
+        input,
+        output.c_str(),
+        (unsigned long long)position,
+        (unsigned long long)written,
+        cloned ? "unchanged blocks shared with original" : "original copied");
     return 0;
+#else
+    (void)input;
+    (void)patches;
+    (void)outputPath;
+    printf("pfs_patch: not supported on this platform\n");
+    return 1;
+#endif
 }
 
 
-// Main function
-int main(int argc, char* argv[])
+// Number of times the oldest queued job of a class may be overtaken by smaller jobs before it blocks admission
+#define PFS_SCHED_MAX_BYPASS 16
+
+// Job priority classes
+#define PFS_CLASS_INTERACTIVE 0 // Someone is waiting for this job
+#define PFS_CLASS_BULK        1 // Background job
+#define PFS_CLASS_COUNT       2
+
+// Scheduler statistics of a priority class
+typedef struct PFS_SCHED_STATS_ {
+    uint32_t jobs;          // Admitted jobs
+    uint32_t maxQueueDepth; // Maximum number of queued jobs
+    uint64_t totalWaitMs;   // Sum of queue wait times
+    uint64_t maxWaitMs;     // Maximum queue wait time
+    uint32_t preemptions;   // Jobs of this class paused to run a job of higher class
+    PFS_SCHED_STATS_() : jobs(0), maxQueueDepth(0), totalWaitMs(0), maxWaitMs(0), preemptions(0) {}
+} PFS_SCHED_STATS;
+
+// Extraction job scheduler with priority classes and memory budget admission control
+// Interactive jobs are admitted before bulk ones, and bulk jobs never take the workers reserved for interactive ones
+// A running bulk job lets waiting interactive jobs run at its section boundaries, see preempt()
+// Within a class, jobs are admitted in queue order while the sum of memory estimates of running jobs fits the budget
+// A job that doesn't fit can be overtaken by smaller ones, at most PFS_SCHED_MAX_BYPASS times
+// A job larger than the whole budget runs alone
+class PFS_SCHEDULER {
+public:
+    PFS_SCHEDULER(uint64_t budget, uint32_t workers, uint32_t reserved)
+        : budget(budget), workers(workers), reserved(std::min(reserved, workers - 1)), closed(false), inUse(0), peakMemory(0) {
+        running[PFS_CLASS_INTERACTIVE] = running[PFS_CLASS_BULK] = 0;
+    }
+
+    // Add job to queue
+    void enqueue(uint32_t id, uint8_t priority, uint64_t estimate) {
+        std::lock_guard<std::mutex> guard(lock);
+        PFS_SCHED_JOB job = { id, priority, estimate, clock_ms(), 0 };
+        queues[priority].push_back(job);
+        stats[priority].maxQueueDepth = std::max(stats[priority].maxQueueDepth, (uint32_t)queues[priority].size());
+        estimates[id] = job;
+        changed.notify_all();
+    }
+
+    // No more jobs will be added
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        changed.notify_all();
+    }
+
+    // Wait until a job is admitted, returns false if queue is empty and closed
+    bool acquire(uint32_t & id) {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            if (admit(PFS_CLASS_INTERACTIVE, id))
+                return true;
+            if (running[PFS_CLASS_BULK] < workers - reserved && admit(PFS_CLASS_BULK, id))
+                return true;
+            if (closed && queues[PFS_CLASS_INTERACTIVE].empty() && queues[PFS_CLASS_BULK].empty())
+                return false;
+            changed.wait(guard);
+        }
+    }
+
+    // Called by a running job at section boundary, admits a waiting job of higher class if there is one
+    // The admitted job must be run by the caller before continuing
+    bool preempt(uint8_t priority, uint32_t & id) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (priority == PFS_CLASS_INTERACTIVE || queues[PFS_CLASS_INTERACTIVE].empty())
+            return false;
+        if (!admit(PFS_CLASS_INTERACTIVE, id))
+            return false;
+        stats[priority].preemptions++;
+        return true;
+    }
+
+    // Finish admitted job and release its memory
+    void release(uint32_t id) {
+        std::lock_guard<std::mutex> guard(lock);
+        const PFS_SCHED_JOB & job = estimates[id];
+        inUse -= job.estimate;
+        running[job.priority]--;
+        estimates.erase(id);
+        changed.notify_all();
+    }
+
+    uint32_t queueDepth(uint8_t priority) {
+        std::lock_guard<std::mutex> guard(lock);
+        return (uint32_t)queues[priority].size();
+    }
+
+    PFS_SCHED_STATS statistics(uint8_t priority) {
+        std::lock_guard<std::mutex> guard(lock);
+        return stats[priority];
+    }
+
+    uint64_t peakAdmittedMemory() {
+        std::lock_guard<std::mutex> guard(lock);
+        return peakMemory;
+    }
+
+private:
+    typedef struct PFS_SCHED_JOB_ {
+        uint32_t id;
+        uint8_t  priority;
+        uint64_t estimate;
+        uint64_t enqueuedMs;
+        uint32_t bypassed;
+    } PFS_SCHED_JOB;
+
+    uint64_t budget; // 0 means unlimited
+    uint32_t workers;
+    uint32_t reserved; // Workers only interactive jobs can use
+    bool     closed;
+    uint64_t inUse;
+    uint64_t peakMemory;
+    uint32_t running[PFS_CLASS_COUNT];
+    std::deque<PFS_SCHED_JOB> queues[PFS_CLASS_COUNT];
+    std::map<uint32_t, PFS_SCHED_JOB> estimates;
+    std::mutex lock;
+    std::condition_variable changed;
+    PFS_SCHED_STATS stats[PFS_CLASS_COUNT];
+
+    bool fits(const PFS_SCHED_JOB & job) const {
+        return !budget || inUse == 0 || inUse + job.estimate <= budget;
+    }
+
+    // Admit a job of priority class if one fits the budget
+    bool admit(uint8_t priority, uint32_t & id) {
+        std::deque<PFS_SCHED_JOB> & queue = queues[priority];
+        size_t index = queue.size();
+        if (queue.empty())
+            return false;
+        if (fits(queue.front())) {
+            index = 0;
+        }
+        else if (queue.front().bypassed < PFS_SCHED_MAX_BYPASS) {
+            for (size_t i = 1; i < queue.size(); i++) {
+                if (fits(queue[i])) {
+                    queue.front().bypassed++;
+                    index = i;
+                    break;
+                }
+            }
+        }
+        if (index == queue.size())
+            return false;
+
+        PFS_SCHED_JOB job = queue[index];
+        queue.erase(queue.begin() + index);
+        inUse += job.estimate;
+        peakMemory = std::max(peakMemory, inUse);
+        running[priority]++;
+        uint64_t wait = clock_ms() - job.enqueuedMs;
+        stats[priority].jobs++;
+        stats[priority].totalWaitMs += wait;
+        stats[priority].maxWaitMs = std::max(stats[priority].maxWaitMs, wait);
+        id = job.id;
+        return true;
+    }
+};
+
+
+// Get hidden staging directory name for output directory, .<name>.staging in the same parent directory
+std::string pfs_staging_directory(const std::string & directory)
+{
+    size_t separator = directory.find_last_of(PATH_SEPARATORS);
+    size_t nameStart = (separator == std::string::npos) ? 0 : separator + 1;
+    return directory.substr(0, nameStart) + "." + directory.substr(nameStart) + ".staging";
+}
+
+// Durability strategies, all of them flush output files before output directory is published
+#define PFS_DURABLE_NONE  0 // Output files may be lost on power loss
+#define PFS_DURABLE_FILE  1 // Flush every output file right after writing it
+#define PFS_DURABLE_FS    2 // Flush the whole filesystem once with syncfs
+#define PFS_DURABLE_URING 3 // Flush all output files with one batch of io_uring fsync requests
+
+// Flush files of staging directory and the directory itself to disk with durability strategy
+bool pfs_sync_staging(const char* directory, uint8_t durable)
+{
+    uint64_t start = clock_us();
+    bool result;
+    switch (durable) {
+    case PFS_DURABLE_FILE:
+        // Files are already flushed, only directory entries remain
+        result = syncDirectoryEntry((std::string(directory) + "/.").c_str());
+        break;
+    case PFS_DURABLE_URING:
+        result = syncDirectoryUring(directory);
+        break;
+    default:
+        result = syncFilesystem(directory);
+        break;
+    }
+    durableSyncs++;
+    durableUs += clock_us() - start;
+    return result;
+}
+
+// Input file options
+typedef struct PFS_FILE_OPTIONS_ {
+    PFS_EXEC_OPTIONS exec;
+    bool dryRun;   // Print extraction plan instead of extracting
+    bool manifest; // Write manifest.json into output directory
+    bool replace;  // Replace existing output directory instead of failing, only set for output of an interrupted run
+    bool bloom;    // Write Bloom filter sidecar into output directory
+    uint8_t durable; // PFS_DURABLE_*
+    PFS_CATALOG* catalog; // Catalog of extracted sections, NULL for none
+    PFS_FILE_OPTIONS_() : dryRun(false), manifest(false), replace(false), bloom(false), durable(PFS_DURABLE_NONE), catalog(NULL) {}
+} PFS_FILE_OPTIONS;
+
+// Extract input file, see pfs_extract_file
+int pfs_extract_file_image(const char* input, const PFS_FILE_OPTIONS & fileOptions, uint64_t* manifestHash)
 {
+    PFS_ALLOC_IMAGE allocations;
+    PFS_EXEC_OPTIONS options = fileOptions.exec;
     FILE*  file;
+    PFS_BUFFER inputBuffer;
     uint8_t* buffer;
     size_t  filesize;
     size_t  read;
 
-    // Check arguments count
-    if (argc != 2) {
-        // Print usage and exit
-        printf("PFSExtractor v0.1.0 - extracts contents of Dell firmware update files in PFS format\n\n"
-            "Usage: PFSExtractor pfs_file.bin\n");
-        return 1;
-    }
-
     // Read input file
-    file = fopen(argv[1], "rb");
+    PFS_TRACE_SPAN loadSpan("load input", input);
+    uint64_t phaseStart = clock_us();
+    allocPhase = PFS_PHASE_LOAD;
+    file = fopen(input, "rb");
     if (!file) {
-        printf("Can't open input file\n");
+        pfs_printf("Can't open input file %s\n", input);
         return 2;
     }
 
@@ -348,39 +5774,875 @@ int main(int argc, char* argv[])
     fseek(file, 0, SEEK_SET);
 
     // Allocate buffer
-    buffer = (uint8_t*)malloc(filesize);
-    if (!buffer) {
-        printf("Can't allocate memory for input file\n");
+    if (!inputBuffer.allocate(filesize, options.hugePages)) {
+        pfs_printf("Can't allocate memory for input file %s\n", input);
+        fclose(file);
         return 3;
     }
+    buffer = inputBuffer.data();
 
     // Read the whole file into buffer
     read = fread((void*)buffer, 1, filesize, file);
     if (read != filesize) {
-        printf("Can't read input file\n");
+        pfs_printf("Can't read input file %s\n", input);
+        fclose(file);
         return 4;
     }
 
+#if !defined(WIN32) && defined(POSIX_FADV_DONTNEED)
+    // Input file is fully in memory now, keep it out of page cache when bypassing page cache for output too
+    if (options.backend == PFS_BACKEND_DIRECT)
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
     // Close input file
     fclose(file);
+    loadSpan.end();
+    pfs_metric_add(PFS_METRIC_BYTES_IN, filesize);
+    pfs_metric_observe(PFS_PHASE_LOAD, clock_us() - phaseStart);
+
+    // Build extraction plan, planning and execution share one pool
+    std::unique_ptr<PFS_POOL> pool(options.threads >= 2 ? new PFS_POOL(options.threads) : NULL);
+    PFS_PLAN plan;
+    plan.maxDepth = options.maxDepth;
+    plan.walkUefi = options.uefi;
+    plan.pool = pool.get();
+    phaseStart = clock_us();
+    allocPhase = PFS_PHASE_PLAN;
+    uint8_t result = pfs_plan(buffer, filesize, NULL, buffer, 0, plan);
+    pfs_metric_observe(PFS_PHASE_PLAN, clock_us() - phaseStart);
+    if (result) {
+        return result;
+    }
+    pfs_metric_add(PFS_METRIC_SECTIONS, plan.sections.size());
+    pfs_metric_add(PFS_METRIC_CHUNKS, plan.chunkCount);
+
+    // Show plan without extracting anything
+    if (fileOptions.dryRun) {
+        pfs_plan_print(plan);
+        pfs_printf("Estimated peak memory: %llu\n\n", (unsigned long long)pfs_estimate_memory(input, options.threads));
+        return 0;
+    }
+
+    // Create directory names, output files are written into a hidden staging directory next to output directory
+    std::string directory = std::string(input) + ".extracted";
+    std::string workDirectory = pfs_staging_directory(directory);
+    // Directory being replaced is kept until the new one is ready to be published
+    if (isExistOnFs(directory.c_str()) && !fileOptions.replace) {
+        pfs_printf("Can't create directory for output files of %s\n", input);
+        return 5;
+    }
 
-    // Create directory name
-    char directory[240] = { 0 };
-    strcat(directory, argv[1]);
-    strcat(directory, ".extracted");
+    // Remove leftovers of an interrupted extraction
+    if (isExistOnFs(workDirectory.c_str()))
+        removeDirectory(workDirectory.c_str());
 
     // Create directory for output files
-    if (!makeDirectory(directory)) {
-        printf("Can't create directory for output files\n");
+    if (!makeDirectory(workDirectory.c_str())) {
+        pfs_printf("Can't create directory for output files of %s\n", input);
         return 5;
     }
 
-    // Change into that directory
-    if (!changeDirectory(directory)) {
-        printf("Can't change into directory for output files\n");
-        return 6;
+    // Staging directory is removed on every failure from here on
+    auto fail = [&workDirectory](int code) {
+        removeDirectory(workDirectory.c_str());
+        return code;
+    };
+
+    // Execute extraction plan
+    options.directory = workDirectory.c_str();
+    options.syncFiles = (fileOptions.durable == PFS_DURABLE_FILE);
+    std::vector<uint64_t> hashes;
+    bool hash = fileOptions.manifest || fileOptions.bloom || manifestHash;
+    phaseStart = clock_us();
+    allocPhase = PFS_PHASE_EXECUTE;
+    uint32_t failed = pfs_execute(plan, buffer, options, pool.get(), hash ? &hashes : NULL);
+    pfs_metric_observe(PFS_PHASE_EXECUTE, clock_us() - phaseStart);
+    inputBuffer.release();
+    if (failed)
+        return fail(7);
+
+    // Write manifest
+    if (manifestHash)
+        *manifestHash = pfs_manifest_hash(plan, hashes);
+    if (fileOptions.manifest && pfs_manifest_write((workDirectory + "/manifest.json").c_str(), input, plan, hashes, allocations.data()))
+        return fail(7);
+
+    // Write Bloom filter sidecar
+    if (fileOptions.bloom && !pfs_bloom_write((workDirectory + "/" PFS_BLOOM_FILENAME).c_str(), plan, hashes)) {
+        pfs_printf("Can't write Bloom filter of %s\n", input);
+        return fail(7);
+    }
+
+    // Flush output files not flushed yet
+    phaseStart = clock_us();
+    allocPhase = PFS_PHASE_SYNC;
+    if (fileOptions.durable && !pfs_sync_staging(workDirectory.c_str(), fileOptions.durable)) {
+        pfs_printf("Can't flush output files of %s to disk\n", input);
+        return fail(7);
+    }
+
+    // Publish output directory, replacing the previous one
+    if (isExistOnFs(directory.c_str()))
+        removeDirectory(directory.c_str());
+    if (rename(workDirectory.c_str(), directory.c_str())) {
+        pfs_printf("Can't rename %s to %s\n", workDirectory.c_str(), directory.c_str());
+        return fail(5);
+    }
+    if (fileOptions.durable && !syncDirectoryEntry(directory.c_str())) {
+        pfs_printf("Can't flush output directory of %s to disk\n", input);
+        return 7;
+    }
+    if (fileOptions.durable)
+        pfs_metric_observe(PFS_PHASE_SYNC, clock_us() - phaseStart);
+
+    // Add sections to catalog
+    if (fileOptions.catalog && !fileOptions.catalog->add(input, plan)) {
+        pfs_printf("Can't add sections of %s to catalog\n", input);
+        return 7;
+    }
+
+    return 0;
+}
+
+// Read input file and extract it into <input>.extracted directory, returns exit code
+// Manifest hash is computed if manifestHash is not NULL
+int pfs_extract_file(const char* input, const PFS_FILE_OPTIONS & fileOptions, uint64_t* manifestHash)
+{
+    PFS_PROBE1(image__start, input);
+    PFS_TRACE_SPAN span("image", input);
+    int result = pfs_extract_file_image(input, fileOptions, manifestHash);
+    pfs_metric_add(result ? PFS_METRIC_IMAGES_FAILED : PFS_METRIC_IMAGES, 1);
+    PFS_PROBE2(image__end, input, result);
+    return result;
+}
+
+
+#ifndef WIN32
+// Metrics server answering every connection on a local socket with metrics in Prometheus text format
+// The answer is a minimal HTTP response, so it can be scraped with curl --unix-socket or a socket proxy
+class PFS_METRICS_SERVER {
+public:
+    PFS_METRICS_SERVER() : fd(-1), stopping(false) {}
+    ~PFS_METRICS_SERVER() { stop(); }
+
+    bool start(const char* path) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(address.sun_path))
+            return false;
+        strcpy(address.sun_path, path);
+        unlink(path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return false;
+        if (bind(fd, (struct sockaddr*)&address, sizeof(address)) || listen(fd, 16)) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        socketPath = path;
+        thread = std::thread(&PFS_METRICS_SERVER::serve, this);
+        return true;
+    }
+
+    void stop() {
+        if (fd < 0)
+            return;
+        stopping = true;
+        thread.join();
+        close(fd);
+        unlink(socketPath.c_str());
+        fd = -1;
+    }
+
+private:
+    int fd;
+    std::atomic<bool> stopping;
+    std::thread thread;
+    std::string socketPath;
+
+    void serve() {
+        while (!stopping) {
+            struct pollfd waiting = { fd, POLLIN, 0 };
+            if (poll(&waiting, 1, 200) <= 0)
+                continue;
+            int client = accept(fd, NULL, NULL);
+            if (client < 0)
+                continue;
+
+            // Request is not needed, read whatever has already arrived
+            char request[1024];
+            struct pollfd readable = { client, POLLIN, 0 };
+            if (poll(&readable, 1, 100) > 0 && read(client, request, sizeof(request)) < 0) {
+                close(client);
+                continue;
+            }
+
+            std::string body = pfs_metrics_text();
+            char header[128];
+            sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\n\r\n", (uint32_t)body.size());
+            struct iovec response[2] = { { header, strlen(header) }, { (void*)body.data(), body.size() } };
+            write_all_v(client, response, 2);
+            close(client);
+        }
+    }
+};
+#endif
+
+
+// Parse output backend name, returns false if the backend is unknown or not supported on this platform
+bool pfs_parse_backend(const char* name, uint8_t & backend)
+{
+    for (uint8_t i = 0; i < sizeof(pfsBackendNames) / sizeof(pfsBackendNames[0]); i++) {
+        if (strcmp(name, pfsBackendNames[i]))
+            continue;
+#ifdef WIN32
+        if (i != PFS_BACKEND_STDIO)
+            return false;
+#endif
+#ifndef O_DIRECT
+        if (i == PFS_BACKEND_DIRECT)
+            return false;
+#endif
+#ifndef PFS_HAVE_URING
+        if (i == PFS_BACKEND_URING)
+            return false;
+#endif
+        backend = i;
+        return true;
+    }
+    return false;
+}
+
+
+// Benchmark parameters, a synthetic subsection payload of PFS_BENCH_CHUNKS chunks of PFS_BENCH_CHUNK_SIZE bytes
+#define PFS_BENCH_CHUNKS     64
+#define PFS_BENCH_CHUNK_SIZE 0x100000
+#define PFS_BENCH_RUNS       3
+
+// Metadata parser benchmark parameters, a synthetic metadata region parsed PFS_BENCH_METADATA_PARSES times
+#define PFS_BENCH_METADATA_PARSES 200000
+
+// Get name of filesystem directory is on
+const char* pfs_bench_filesystem(const char* directory)
+{
+#ifdef __linux__
+    struct statfs info;
+    if (statfs(directory, &info) == 0) {
+        switch ((uint32_t)info.f_type) {
+        case 0x01021994: return "tmpfs";
+        case 0xEF53:     return "ext4";
+        case 0x58465342: return "xfs";
+        case 0x9123683E: return "btrfs";
+        case 0x6969:     return "nfs";
+        case 0x794C7630: return "overlayfs";
+        }
+    }
+#endif
+    return "unknown";
+}
+
+// Benchmark output backends writing a reassembled subsection payload into directory
+int pfs_bench(const char* directory, const PFS_EXEC_OPTIONS & baseOptions)
+{
+    // Checksum updates of --patch are checked against full checksums first
+    if (!pfs_crc32_self_check()) {
+        printf("pfs_bench: CRC-32 self-check failed\n");
+        return 10;
+    }
+    printf("CRC-32 self-check passed\n");
+
+    // Build input buffer with chunks stored in shuffled order
+    std::vector<uint8_t> input((size_t)PFS_BENCH_CHUNKS * (sizeof(PFS_CHUNK_PREFIX) + PFS_BENCH_CHUNK_SIZE));
+    std::vector<uint16_t> order(PFS_BENCH_CHUNKS);
+    uint32_t seed = 0x12345678;
+    for (uint16_t i = 0; i < PFS_BENCH_CHUNKS; i++)
+        order[i] = i;
+    for (uint16_t i = PFS_BENCH_CHUNKS - 1; i > 0; i--) {
+        seed = seed * 1103515245 + 12345;
+        std::swap(order[i], order[(seed >> 16) % (i + 1)]);
+    }
+    for (size_t i = 0; i < input.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        input[i] = (uint8_t)(seed >> 16);
+    }
+
+    PFS_PLAN_ENTRY entry;
+    entry.filename = "pfs_bench.bin";
+    entry.type = PFS_PLAN_GATHER;
+    entry.section = 0;
+    entry.offset = 0;
+    entry.headerSize = sizeof(PFS_SECTION_HEADER);
+    entry.base = NULL;
+    entry.payload = NULL;
+    for (uint32_t i = 0; i < PFS_BENCH_CHUNKS; i++) {
+        uint8_t* chunk = input.data() + (size_t)i * (sizeof(PFS_CHUNK_PREFIX) + PFS_BENCH_CHUNK_SIZE);
+        ((PFS_CHUNK_PREFIX*)chunk)->OrderNumber = order[i];
+        pfs_chunk_table_add(entry.chunks, input.data(), chunk, sizeof(PFS_CHUNK_PREFIX) + PFS_BENCH_CHUNK_SIZE);
+    }
+    entry.size = pfs_chunk_table_size(entry.chunks);
+
+    printf("Benchmark: %u MiB payload from %u chunks into %s (%s), %u threads, best of %u runs\n",
+        (uint32_t)(entry.size >> 20), PFS_BENCH_CHUNKS, directory, pfs_bench_filesystem(directory), baseOptions.threads, PFS_BENCH_RUNS);
+
+    PFS_POOL pool(baseOptions.threads);
+    std::string path = std::string(directory) + "/" + entry.filename;
+    for (uint8_t backend = 0; backend < sizeof(pfsBackendNames) / sizeof(pfsBackendNames[0]); backend++) {
+        uint8_t supported;
+        if (!pfs_parse_backend(pfsBackendNames[backend], supported))
+            continue;
+
+        PFS_EXEC_OPTIONS options = baseOptions;
+        options.directory = directory;
+        options.backend = backend;
+        uint64_t best = UINT64_MAX;
+        PFS_ALLOC_IMAGE allocations;
+        for (uint32_t run = 0; run < PFS_BENCH_RUNS; run++) {
+            uint64_t start = clock_us();
+            if (pfs_execute_entry(entry, input.data(), options, &pool, NULL))
+                return 10;
+            best = std::min(best, clock_us() - start);
+            remove(path.c_str());
+        }
+        printf("%-6s %8llu us %8.1f MiB/s",
+            pfsBackendNames[backend],
+            (unsigned long long)best,
+            best ? (double)entry.size / (1 << 20) / ((double)best / 1000000) : 0.0);
+
+        // Allocations per run, gather entries are counted in reassembly phase
+        if (allocations.data()) {
+            const PFS_ALLOC_PROFILE* profile = allocations.data();
+            printf(" %6llu allocs %10llu bytes %10llu peak",
+                (unsigned long long)(profile->count[PFS_PHASE_REASSEMBLE].load() / PFS_BENCH_RUNS),
+                (unsigned long long)(profile->bytes[PFS_PHASE_REASSEMBLE].load() / PFS_BENCH_RUNS),
+                (unsigned long long)profile->peak[PFS_PHASE_REASSEMBLE].load());
+        }
+        printf("\n");
+    }
+
+    // Metadata parser with and without SIMD NUL search, every field of the region is half full
+    std::string region;
+    for (uint32_t i = 0; i < PFS_METADATA_MAX_FIELDS; i++) {
+        std::string field(pfsMetadataWidths[i], '\0');
+        for (uint32_t c = 0; c < pfsMetadataWidths[i] / 2; c++)
+            field[c] = pfsMetadataNames[i][c % strlen(pfsMetadataNames[i])];
+        region += field;
+    }
+    size_t (*lengths[2])(const uint8_t*, size_t) = { pfs_metadata_length, pfs_metadata_length_scalar };
+    const char* lengthNames[2] = { "simd", "scalar" };
+    for (uint32_t s = 0; s < 2; s++) {
+        PFS_METADATA metadata;
+        uint64_t best = UINT64_MAX;
+        uint32_t fields = 0;
+        for (uint32_t run = 0; run < PFS_BENCH_RUNS; run++) {
+            uint64_t start = clock_us();
+            for (uint32_t i = 0; i < PFS_BENCH_METADATA_PARSES; i++)
+                fields += pfs_metadata_parse((const uint8_t*)region.data(), (uint32_t)region.size(), metadata, lengths[s]);
+            best = std::min(best, clock_us() - start);
+        }
+        printf("metadata %-6s %8llu us %8.1f MiB/s %6.1f ns per field\n",
+            lengthNames[s],
+            (unsigned long long)best,
+            best ? (double)region.size() * PFS_BENCH_METADATA_PARSES / (1 << 20) / ((double)best / 1000000) : 0.0,
+            fields ? (double)best * 1000 * PFS_BENCH_RUNS / fields : 0.0);
+    }
+    return 0;
+}
+
+
+// Parse size with optional K, M or G suffix
+bool parse_size(const char* str, uint64_t & size)
+{
+    char* end;
+    size = strtoull(str, &end, 10);
+    if (end == str)
+        return false;
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; // Fall through
+    case 'M': case 'm': size <<= 10; // Fall through
+    case 'K': case 'k': size <<= 10; end++; break;
+    }
+    return *end == 0;
+}
+
+
+// Main function
+// Check if the first argument is subcommand name, an input file of the same name is extracted instead
+bool pfs_is_subcommand(int argc, char* argv[], const char* name)
+{
+    return argc > 1 && !strcmp(argv[1], name) && !isExistOnFs(argv[1]);
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<const char*> inputs;
+    std::vector<uint8_t> priorities;
+    uint8_t priority = PFS_CLASS_BULK;
+    uint32_t reserved = 0;
+    bool fromStdin = false;
+    bool showStats = false;
+    uint32_t jobs = 1;
+    uint64_t memoryBudget = 0;
+    const char* journalPath = NULL;
+    const char* catalogPath = NULL;
+    const char* benchDirectory = NULL;
+    bool probe = false;
+    bool probeSections = false;
+    const char* repackManifest = NULL;
+    std::vector<PFS_PATCH> patches;
+    const char* outputPath = NULL;
+    const char* tracePath = NULL;
+    const char* metricsPath = NULL;
+    const char* metricsSocket = NULL;
+    PFS_FILE_OPTIONS fileOptions;
+    PFS_EXEC_OPTIONS & options = fileOptions.exec;
+
+    // Subcommands
+    if (pfs_is_subcommand(argc, argv, "stats"))
+        return pfs_stats_main(argc, argv);
+    if (pfs_is_subcommand(argc, argv, "bloom-query"))
+        return pfs_bloom_query_main(argc, argv);
+
+    // Parse arguments
+    bool usage = false;
+    for (int i = 1; i < argc && !usage; i++) {
+        if (!strcmp(argv[i], "--dry-run")) {
+            fileOptions.dryRun = true;
+        }
+        else if (!strcmp(argv[i], "--durable") || !strncmp(argv[i], "--durable=", 10)) {
+            const char* strategy = argv[i][9] ? argv[i] + 10 : "fs";
+            if (!strcmp(strategy, "file"))
+                fileOptions.durable = PFS_DURABLE_FILE;
+            else if (!strcmp(strategy, "fs"))
+                fileOptions.durable = PFS_DURABLE_FS;
+            else if (!strcmp(strategy, "uring"))
+                fileOptions.durable = PFS_DURABLE_URING;
+            else
+                usage = true;
+        }
+        else if (!strcmp(argv[i], "--probe") || !strcmp(argv[i], "--probe=sections")) {
+            probe = true;
+            probeSections = (argv[i][7] != '\0');
+        }
+        else if (!strcmp(argv[i], "--repack") && i + 1 < argc) {
+            repackManifest = argv[++i];
+        }
+#ifndef WIN32
+        else if (!strcmp(argv[i], "--patch") && i + 1 < argc) {
+            PFS_PATCH patch;
+            if (!pfs_parse_patch(argv[++i], patch))
+                usage = true;
+            patches.push_back(patch);
+        }
+#endif
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            outputPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--manifest")) {
+            fileOptions.manifest = true;
+        }
+        else if (!strcmp(argv[i], "--catalog") && i + 1 < argc) {
+            catalogPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--bloom")) {
+            fileOptions.bloom = true;
+        }
+        else if (!strcmp(argv[i], "--metrics-file") && i + 1 < argc) {
+            metricsPath = argv[++i];
+        }
+#ifndef WIN32
+        else if (!strcmp(argv[i], "--metrics-socket") && i + 1 < argc) {
+            metricsSocket = argv[++i];
+        }
+#endif
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            tracePath = argv[++i];
+            traceEnabled = true;
+        }
+        else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+            benchDirectory = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--journal") && i + 1 < argc) {
+            journalPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--stats")) {
+            showStats = true;
+        }
+        else if (!strcmp(argv[i], "--hugepages")) {
+            options.hugePages = true;
+        }
+        else if (!strcmp(argv[i], "--profile-alloc")) {
+            allocProfiling = true;
+        }
+        else if (!strcmp(argv[i], "--backend") && i + 1 < argc) {
+            if (!pfs_parse_backend(argv[++i], options.backend))
+                usage = true;
+        }
+#ifdef O_DIRECT
+        else if (!strcmp(argv[i], "--direct-io")) {
+            options.backend = PFS_BACKEND_DIRECT;
+        }
+#endif
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            options.threads = (uint32_t)atoi(argv[++i]);
+            if (options.threads == 0)
+                usage = true;
+        }
+        else if (!strcmp(argv[i], "--uefi")) {
+            options.uefi = true;
+        }
+        else if (!strcmp(argv[i], "--max-depth") && i + 1 < argc) {
+            options.maxDepth = (uint32_t)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+            jobs = (uint32_t)atoi(argv[++i]);
+            if (jobs == 0)
+                usage = true;
+        }
+        else if (!strcmp(argv[i], "--memory-budget") && i + 1 < argc) {
+            if (!parse_size(argv[++i], memoryBudget))
+                usage = true;
+        }
+        else if (!strcmp(argv[i], "--priority") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "interactive"))
+                priority = PFS_CLASS_INTERACTIVE;
+            else if (!strcmp(argv[i], "bulk"))
+                priority = PFS_CLASS_BULK;
+            else
+                usage = true;
+        }
+        else if (!strcmp(argv[i], "--reserve") && i + 1 < argc) {
+            reserved = (uint32_t)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--stdin")) {
+            fromStdin = true;
+        }
+        else if (argv[i][0] == '-') {
+            usage = true;
+        }
+        else {
+            inputs.push_back(argv[i]);
+            priorities.push_back(priority);
+        }
+    }
+
+    // Check arguments
+    if (usage || (inputs.empty() && !fromStdin && !benchDirectory && !repackManifest)) {
+        // Print usage and exit
+        printf("PFSExtractor v0.1.0 - extracts contents of Dell firmware update files in PFS format\n\n"
+            "Usage: PFSExtractor [options] pfs_file.bin [pfs_file.bin ...]\n"
+            "       PFSExtractor stats [options] directory [directory ...]\n"
+            "       PFSExtractor bloom-query [options] path [path ...]\n\n"
+            "Options:\n"
+            "  --dry-run              print extraction plan with estimated cost and exit\n"
+            "  --probe[=sections]     identify PFS images reading only header and footer, or section headers too,\n"
+            "                         print one line per input using --threads N threads and exit\n"
+            "  --backend NAME         output backend: stdio (default)"
+#ifndef WIN32
+            ", write, mmap"
+#endif
+#ifdef O_DIRECT
+            ", direct"
+#endif
+#ifdef PFS_HAVE_URING
+            ", uring"
+#endif
+            "\n"
+#ifdef O_DIRECT
+            "  --direct-io            write large output files with O_DIRECT, same as --backend direct\n"
+#endif
+            "  --threads N            number of threads writing output files of an image (default 1)\n"
+            "  --jobs N               number of images extracted at once (default 1)\n"
+            "  --max-depth N          extract PFS images nested in reassembled payloads up to N levels deep (default 4)\n"
+            "  --uefi                 index UEFI firmware volumes and FFS files of reassembled payloads in manifest\n"
+            "  --memory-budget SIZE   admit images only while their estimated memory fits SIZE (K, M, G suffixes)\n"
+            "  --priority CLASS       priority class of following images: interactive or bulk (default)\n"
+            "  --reserve N            number of --jobs reserved for interactive images (default 0)\n"
+            "  --stdin                also read images from standard input, one per line,\n"
+            "                         optionally prefixed with \"interactive \" or \"bulk \"\n"
+            "  --durable[=STRATEGY]   flush output files to disk before publishing output directory,\n"
+            "                         STRATEGY is file (fdatasync each file), fs (one syncfs, default)\n"
+            "                         or uring (one batch of io_uring fsyncs)\n"
+            "  --manifest             write manifest.json with sizes and hashes of output files\n"
+            "  --catalog FILE         append one JSON line with version and metadata fields per extracted section to FILE\n"
+            "  --bloom                write " PFS_BLOOM_FILENAME " Bloom filter of section and FFS file GUIDs and\n"
+            "                         output file hashes into output directory, searched with bloom-query\n"
+            "  --repack MANIFEST      build PFS image from files listed in MANIFEST and exit, files changed since\n"
+            "                         extraction replace their regions, a changed payload is split into chunks again\n"
+#ifndef WIN32
+            "  --patch SPEC           patch image, SPEC is section=N,region=data|sign|meta|mtsg,file=FILE,\n"
+            "                         may be repeated, unchanged blocks are shared with the original where possible\n"
+#endif
+            "  --output FILE          repacked or patched image name (default: input name with .repacked or .patched appended)\n"
+            "  --journal FILE         record progress in FILE, skip inputs completed by a previous run\n"
+            "  --hugepages            back input and reassembly buffers with huge pages where available\n"
+            "  --stats                print statistics when done\n"
+            "  --profile-alloc        count allocations per extraction phase for statistics, manifest and benchmark,\n"
+            "                         only input and reassembly buffers unless built with PFS_ALLOC_PROFILING\n"
+            "  --metrics-file FILE    keep Prometheus metrics in FILE for node_exporter textfile collector\n"
+#ifndef WIN32
+            "  --metrics-socket PATH  serve Prometheus metrics on local socket PATH while running\n"
+#endif
+            "  --trace FILE           write timeline of all threads to FILE in Chrome trace-event format\n"
+            "  --bench DIR            benchmark output backends writing into DIR and exit\n");
+        return 1;
+    }
+
+    // Build image from extracted files instead of extraction
+    if (repackManifest)
+        return pfs_repack(repackManifest, outputPath);
+
+    // Patch image instead of extraction
+    if (!patches.empty()) {
+        if (inputs.size() != 1) {
+            printf("Patch needs exactly one input image\n");
+            return 1;
+        }
+        return pfs_patch(inputs[0], patches, outputPath);
+    }
+
+    // Identify images instead of extraction
+    if (probe)
+        return pfs_probe(inputs, fromStdin, probeSections, options.threads);
+
+    // Run benchmark instead of extraction
+    if (benchDirectory)
+        return pfs_bench(benchDirectory, options);
+
+    // Open journal, output of inputs started but not completed by previous run is replaced
+    PFS_JOURNAL journal;
+    if (journalPath) {
+        if (!journal.open(journalPath)) {
+            printf("Can't open journal %s\n", journalPath);
+            return 9;
+        }
+    }
+
+    // Open catalog, sections of every extracted image are appended
+    PFS_CATALOG catalog;
+    if (catalogPath) {
+        if (!catalog.open(catalogPath)) {
+            printf("Can't open catalog %s\n", catalogPath);
+            return 7;
+        }
+        fileOptions.catalog = &catalog;
+    }
+
+    // Queue all inputs
+    PFS_SCHEDULER scheduler(memoryBudget, jobs, reserved);
+    std::atomic<uint32_t> skipped(0);
+    std::deque<std::string> paths;
+    std::deque<uint8_t> classes;
+    std::deque<int> results;
+    std::mutex jobsLock;
+
+    // Export metrics while jobs are running
+    metricsGauges = [&]() {
+        std::string text = "# HELP pfs_queue_depth Jobs waiting for admission\n# TYPE pfs_queue_depth gauge\n";
+        const char* classNames[PFS_CLASS_COUNT] = { "interactive", "bulk" };
+        char line[128];
+        for (uint8_t c = 0; c < PFS_CLASS_COUNT; c++) {
+            sprintf(line, "pfs_queue_depth{class=\"%s\"} %u\n", classNames[c], (uint32_t)scheduler.queueDepth(c));
+            text += line;
+        }
+        return text;
+    };
+#ifndef WIN32
+    PFS_METRICS_SERVER metricsServer;
+    if (metricsSocket && !metricsServer.start(metricsSocket))
+        printf("Can't serve metrics on %s\n", metricsSocket);
+#endif
+    bool metricsStopping = false;
+    std::mutex metricsWriterLock;
+    std::condition_variable metricsWriterWake;
+    std::thread metricsWriter;
+    if (metricsPath) {
+        metricsWriter = std::thread([&]() {
+            std::unique_lock<std::mutex> lock(metricsWriterLock);
+            while (!metricsWriterWake.wait_for(lock, std::chrono::seconds(PFS_METRICS_INTERVAL), [&]() { return metricsStopping; })) {
+                if (!pfs_metrics_write(metricsPath))
+                    printf("Can't write metrics to %s\n", metricsPath);
+            }
+        });
+    }
+
+    auto add = [&](const std::string & path, uint8_t priority) {
+        if (journalPath && journal.isCompleted(path)) {
+            skipped++;
+            pfs_metric_add(PFS_METRIC_JOURNAL_SKIPPED, 1);
+            return;
+        }
+        if (journalPath && journal.isPartial(path))
+            printf("Restarting interrupted extraction of %s\n", path.c_str());
+        uint32_t id;
+        {
+            std::lock_guard<std::mutex> guard(jobsLock);
+            id = (uint32_t)paths.size();
+            paths.push_back(path);
+            classes.push_back(priority);
+            results.push_back(0);
+        }
+        scheduler.enqueue(id, priority, pfs_estimate_memory(path.c_str(), options.threads));
+    };
+    for (size_t i = 0; i < inputs.size(); i++)
+        add(inputs[i], priorities[i]);
+
+    // Run admitted job, bulk jobs run waiting interactive jobs at section boundaries
+    std::function<void(uint32_t)> run = [&](uint32_t id) {
+        std::string path;
+        PFS_FILE_OPTIONS jobOptions = fileOptions;
+        uint8_t jobClass;
+        {
+            std::lock_guard<std::mutex> guard(jobsLock);
+            path = paths[id];
+            jobClass = classes[id];
+        }
+        if (jobClass != PFS_CLASS_INTERACTIVE) {
+            jobOptions.exec.checkpoint = [&, jobClass]() {
+                uint32_t other;
+                while (scheduler.preempt(jobClass, other))
+                    run(other);
+            };
+        }
+        PFS_JOB_OUTPUT output;
+        int result;
+        if (journalPath && !fileOptions.dryRun) {
+            uint64_t manifestHash = 0;
+            jobOptions.replace = journal.isReplaceable(path);
+            journal.started(path);
+            result = pfs_extract_file(path.c_str(), jobOptions, &manifestHash);
+            if (result)
+                journal.failed(path, result);
+            else
+                journal.completed(path, manifestHash);
+        }
+        else {
+            result = pfs_extract_file(path.c_str(), jobOptions, NULL);
+        }
+        {
+            std::lock_guard<std::mutex> guard(jobsLock);
+            results[id] = result;
+        }
+        scheduler.release(id);
+    };
+    auto worker = [&]() {
+        uint32_t id;
+        for (;;) {
+            PFS_TRACE_SPAN span("queue wait");
+            uint64_t waitStart = clock_us();
+            if (!scheduler.acquire(id))
+                break;
+            span.end();
+            pfs_metric_observe(PFS_PHASE_QUEUE, clock_us() - waitStart);
+            run(id);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < (fromStdin ? jobs : std::min(jobs, (uint32_t)inputs.size())); i++)
+        workers.push_back(std::thread(worker));
+
+    // Read more inputs from standard input while jobs are running
+    if (fromStdin) {
+        std::thread reader([&]() {
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                uint8_t lineClass = priority;
+                if (!line.compare(0, 12, "interactive ")) {
+                    lineClass = PFS_CLASS_INTERACTIVE;
+                    line.erase(0, 12);
+                }
+                else if (!line.compare(0, 5, "bulk ")) {
+                    lineClass = PFS_CLASS_BULK;
+                    line.erase(0, 5);
+                }
+                if (!line.empty())
+                    add(line, lineClass);
+            }
+            scheduler.close();
+        });
+        worker();
+        reader.join();
+    }
+    else {
+        scheduler.close();
+        worker();
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    // Write final metrics
+    if (metricsPath) {
+        {
+            std::lock_guard<std::mutex> guard(metricsWriterLock);
+            metricsStopping = true;
+        }
+        metricsWriterWake.notify_one();
+        metricsWriter.join();
+        if (!pfs_metrics_write(metricsPath))
+            printf("Can't write metrics to %s\n", metricsPath);
+    }
+#ifndef WIN32
+    metricsServer.stop();
+#endif
+    metricsGauges = nullptr;
+
+    // Write timeline
+    if (tracePath)
+        pfs_trace_write(tracePath);
+
+    // Show statistics
+    if (showStats) {
+        const char* classNames[PFS_CLASS_COUNT] = { "interactive", "bulk" };
+        for (uint8_t c = 0; c < PFS_CLASS_COUNT; c++) {
+            PFS_SCHED_STATS stats = scheduler.statistics(c);
+            printf("Scheduler %s: %d jobs, max queue depth %d, wait avg %llu ms, max %llu ms, preempted %d times\n",
+                classNames[c],
+                stats.jobs,
+                stats.maxQueueDepth,
+                (unsigned long long)(stats.jobs ? stats.totalWaitMs / stats.jobs : 0),
+                (unsigned long long)stats.maxWaitMs,
+                stats.preemptions);
+        }
+        printf("Scheduler: peak admitted memory %llu of budget %llu\n",
+            (unsigned long long)scheduler.peakAdmittedMemory(),
+            (unsigned long long)memoryBudget);
+#ifndef WIN32
+        struct rusage resources;
+        if (getrusage(RUSAGE_SELF, &resources) == 0) {
+            printf("Page faults: %ld minor, %ld major%s\n",
+                resources.ru_minflt,
+                resources.ru_majflt,
+                options.hugePages ? ", huge pages requested" : "");
+        }
+#endif
+        if (fileOptions.durable) {
+            const char* strategyNames[] = { "none", "file", "fs", "uring" };
+            printf("Durability %s: %llu syncs, %llu us\n",
+                strategyNames[fileOptions.durable],
+                (unsigned long long)durableSyncs.load(),
+                (unsigned long long)durableUs.load());
+        }
+        if (allocProfiling)
+            pfs_alloc_print("Allocations", allocTotal);
     }
 
-    // Call extract function
-    return pfs_extract(buffer, filesize, NULL);
+    // Single input keeps its exit code
+    if (paths.size() == 1 && !fromStdin && !skipped)
+        return results[0];
+
+    uint32_t failed = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i]) {
+            printf("Failed to extract %s\n", paths[i].c_str());
+            failed++;
+        }
+    }
+    if (skipped)
+        printf("Skipped %d files completed by a previous run\n", (int)skipped);
+    printf("Extracted %d of %d files\n", (int)(paths.size() - failed), (int)paths.size());
+    return failed ? 8 : 0;
 }
@@ -0,0 +1,405 @@
+// Unit checks of PFSExtractor helpers and generator of test images for the repack and patch round trip
+// pfsextractor.cpp is compiled into this file, so its helpers are checked without splitting the tool into a library
+#define main pfs_extractor_main
+#include "../pfsextractor.cpp"
+#undef main
+
+static int testFailures = 0;
+
+#define PFS_TEST_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            testFailures++; \
+        } \
+    } while (0)
+
+// Deterministic test data, the same generator pfs_crc32_self_check uses
+static uint64_t testRandom = PFS_HASH_INIT;
+
+static std::vector<uint8_t> test_random_bytes(size_t size)
+{
+    std::vector<uint8_t> bytes(size);
+    for (size_t i = 0; i < size; i++) {
+        testRandom = testRandom * 6364136223846793005ULL + 1442695040888963407ULL;
+        bytes[i] = (uint8_t)(testRandom >> 56);
+    }
+    return bytes;
+}
+
+static void test_append(std::vector<uint8_t> & out, const void* data, size_t size)
+{
+    out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+static void test_append(std::vector<uint8_t> & out, const std::vector<uint8_t> & data)
+{
+    out.insert(out.end(), data.begin(), data.end());
+}
+
+// Version 1 section with decimal version
+static std::vector<uint8_t> test_section(uint16_t version, const std::vector<uint8_t> & data, const std::vector<uint8_t> & sign,
+    const std::vector<uint8_t> & meta, const std::vector<uint8_t> & mtsg)
+{
+    PFS_SECTION_HEADER header;
+    memset(&header, 0, sizeof(header));
+    std::vector<uint8_t> guids = test_random_bytes(2 * sizeof(EFI_GUID));
+    memcpy(&header.Guid1, &guids[0], sizeof(EFI_GUID));
+    memcpy(&header.Guid2, &guids[sizeof(EFI_GUID)], sizeof(EFI_GUID));
+    header.HeaderVersion = 1;
+    memcpy(header.VersionType, "N   ", sizeof(header.VersionType));
+    header.Version[0] = version;
+    header.DataSize = (uint32_t)data.size();
+    header.DataSignatureSize = (uint32_t)sign.size();
+    header.MetadataSize = (uint32_t)meta.size();
+    header.MetadataSignatureSize = (uint32_t)mtsg.size();
+
+    std::vector<uint8_t> section;
+    test_append(section, &header, sizeof(header));
+    test_append(section, data);
+    test_append(section, sign);
+    test_append(section, meta);
+    test_append(section, mtsg);
+    return section;
+}
+
+// Version 1 image of sections in body
+static std::vector<uint8_t> test_image(const std::vector<uint8_t> & body)
+{
+    PFS_FILE_HEADER header;
+    header.Signature = PFS_HEADER_SIGNATURE;
+    header.HeaderVersion = 1;
+    header.DataSize = (uint32_t)body.size();
+    PFS_FILE_FOOTER footer;
+    footer.DataSize = (uint32_t)body.size();
+    footer.Checksum = ~pfs_crc32(body.data(), body.size());
+    footer.Signature = PFS_FOOTER_SIGNATURE;
+
+    std::vector<uint8_t> image;
+    test_append(image, &header, sizeof(header));
+    test_append(image, body);
+    test_append(image, &footer, sizeof(footer));
+    return image;
+}
+
+// Subsection of payload split into chunks, chunks are stored in reverse order
+static std::vector<uint8_t> test_subsection(const std::vector<uint8_t> & payload, uint16_t chunks, uint16_t version)
+{
+    size_t chunkSize = (payload.size() + chunks - 1) / chunks;
+    std::vector<uint8_t> body;
+    for (uint16_t c = chunks; c-- > 0; ) {
+        std::vector<uint8_t> data = test_random_bytes(sizeof(PFS_CHUNK_PREFIX));
+        memcpy(&data[offsetof(PFS_CHUNK_PREFIX, OrderNumber)], &c, sizeof(c));
+        size_t start = std::min(payload.size(), c * chunkSize);
+        data.insert(data.end(), payload.begin() + start, payload.begin() + std::min(payload.size(), start + chunkSize));
+        test_append(body, test_section(version, data, test_random_bytes(16), std::vector<uint8_t>(), std::vector<uint8_t>()));
+    }
+    return test_image(body);
+}
+
+// Metadata region with fields set to values, fields without values are empty
+static std::vector<uint8_t> test_metadata(const char* const* values, uint32_t count)
+{
+    std::vector<uint8_t> region;
+    for (uint32_t i = 0; i < count; i++) {
+        std::vector<uint8_t> field(pfsMetadataWidths[i], 0);
+        if (values[i])
+            memcpy(field.data(), values[i], std::min(strlen(values[i]), field.size()));
+        test_append(region, field);
+    }
+    return region;
+}
+
+static bool test_write(const std::string & filename, const std::vector<uint8_t> & data)
+{
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file)
+        return false;
+    bool result = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return (fclose(file) == 0) && result;
+}
+
+static bool test_read(const std::string & filename, std::vector<uint8_t> & data)
+{
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if (!file)
+        return false;
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// Write test image and replacement regions into directory
+// Section 0 has all regions, section 1 is a chunked subsection, section 2 is a subsection with a nested image as payload
+static int test_generate(const std::string & directory)
+{
+    const char* values[] = { "0815,0816", "Test_1.0.0.exe", "1.0.0", "2026-10-18", "Test", NULL, "Test Model", "1.0" };
+    std::vector<uint8_t> nested = test_image(test_section(4, test_random_bytes(3000), std::vector<uint8_t>(), std::vector<uint8_t>(), std::vector<uint8_t>()));
+
+    std::vector<uint8_t> body;
+    test_append(body, test_section(1, test_random_bytes(5000), test_random_bytes(256), test_metadata(values, PFS_METADATA_MAX_FIELDS), test_random_bytes(256)));
+    test_append(body, test_section(2, test_subsection(test_random_bytes(50000), 5, 2), test_random_bytes(256), std::vector<uint8_t>(), std::vector<uint8_t>()));
+    test_append(body, test_section(3, test_subsection(nested, 3, 3), std::vector<uint8_t>(), std::vector<uint8_t>(), std::vector<uint8_t>()));
+
+    // Replacements change region sizes, except sign.new that has the size of the signatures of sections 0 and 1
+    if (!test_write(directory + "/image.bin", test_image(body))
+        || !test_write(directory + "/payload.new", test_random_bytes(61234))
+        || !test_write(directory + "/region.new", test_random_bytes(777))
+        || !test_write(directory + "/sign.new", test_random_bytes(256))) {
+        printf("Can't write test files into %s\n", directory.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+// Check header, footer and checksum of image, repack and patch don't run pfs_plan on their output
+static int test_check(const std::string & filename)
+{
+    std::vector<uint8_t> image;
+    if (!test_read(filename, image) || image.size() < sizeof(PFS_FILE_HEADER) + sizeof(PFS_FILE_FOOTER)) {
+        printf("Can't read %s\n", filename.c_str());
+        return 1;
+    }
+    const PFS_FILE_HEADER* header = (const PFS_FILE_HEADER*)image.data();
+    const PFS_FILE_FOOTER* footer = (const PFS_FILE_FOOTER*)(image.data() + sizeof(PFS_FILE_HEADER) + header->DataSize);
+    if (header->Signature != PFS_HEADER_SIGNATURE || sizeof(PFS_FILE_HEADER) + (uint64_t)header->DataSize + sizeof(PFS_FILE_FOOTER) > image.size()
+        || footer->Signature != PFS_FOOTER_SIGNATURE || footer->DataSize != header->DataSize) {
+        printf("%s is not a valid PFS image\n", filename.c_str());
+        return 1;
+    }
+    uint32_t checksum = ~pfs_crc32(header + 1, header->DataSize);
+    if (footer->Checksum != checksum) {
+        printf("%s has checksum %X, data has %X\n", filename.c_str(), footer->Checksum, checksum);
+        return 1;
+    }
+    return 0;
+}
+
+static void test_chunk_table()
+{
+    // Three chunks stored in order 2, 0, 1 and offsets relative to base
+    std::vector<uint8_t> payload = test_random_bytes(3000);
+    std::vector<uint8_t> buffer;
+    std::vector<size_t> starts;
+    const uint16_t orders[] = { 2, 0, 1 };
+    for (size_t i = 0; i < 3; i++) {
+        std::vector<uint8_t> data = test_random_bytes(sizeof(PFS_CHUNK_PREFIX));
+        memcpy(&data[offsetof(PFS_CHUNK_PREFIX, OrderNumber)], &orders[i], sizeof(orders[i]));
+        data.insert(data.end(), payload.begin() + orders[i] * 1000, payload.begin() + orders[i] * 1000 + 1000);
+        starts.push_back(buffer.size() + 7);
+        buffer.resize(buffer.size() + 7);
+        test_append(buffer, data);
+    }
+
+    PFS_CHUNK_TABLE table;
+    for (size_t i = 0; i < 3; i++)
+        pfs_chunk_table_add(table, buffer.data(), buffer.data() + starts[i], 1000 + sizeof(PFS_CHUNK_PREFIX));
+    PFS_TEST_CHECK(table.offset[1] == starts[1] + sizeof(PFS_CHUNK_PREFIX));
+    PFS_TEST_CHECK(table.length[1] == 1000);
+    PFS_TEST_CHECK(pfs_chunk_table_validate(table) == 0);
+    std::vector<uint32_t> order = pfs_chunk_table_order(table);
+    PFS_TEST_CHECK(order.size() == 3 && order[0] == 1 && order[1] == 2 && order[2] == 0);
+    PFS_TEST_CHECK(pfs_chunk_table_size(table) == payload.size());
+    std::vector<uint8_t> reassembled((size_t)pfs_chunk_table_size(table));
+    pfs_chunk_table_reassemble(table, buffer.data(), reassembled.data());
+    PFS_TEST_CHECK(reassembled == payload);
+
+    // Damaged chunks are flagged, equal order numbers keep file order
+    PFS_CHUNK_TABLE damaged = table;
+    pfs_chunk_table_add(damaged, buffer.data(), buffer.data() + starts[0], sizeof(PFS_CHUNK_PREFIX) - 1);
+    pfs_chunk_table_add(damaged, buffer.data(), buffer.data() + starts[1], 1000 + sizeof(PFS_CHUNK_PREFIX));
+    damaged.orderNum.push_back(5);
+    damaged.offset.push_back(0);
+    damaged.length.push_back(0);
+    damaged.flags.push_back(0);
+    PFS_TEST_CHECK(damaged.flags[3] == PFS_CHUNK_FLAG_TRUNCATED && damaged.length[3] == 0);
+    PFS_TEST_CHECK(pfs_chunk_table_validate(damaged) == 3);
+    PFS_TEST_CHECK(damaged.flags[4] == PFS_CHUNK_FLAG_DUPLICATE);
+    PFS_TEST_CHECK(damaged.flags[5] == PFS_CHUNK_FLAG_GAP);
+    order = pfs_chunk_table_order(damaged);
+    PFS_TEST_CHECK(order[1] == 4 && order[2] == 2);
+}
+
+static void test_crc32_shift()
+{
+    PFS_TEST_CHECK(pfs_crc32_self_check());
+    PFS_TEST_CHECK(pfs_crc32("123456789", 9) == 0xCBF43926);
+    PFS_TEST_CHECK(pfs_crc32_shift(0x12345678, 0) == 0x12345678);
+
+    // Appending zeros moves the state, shifting in two steps equals shifting once
+    std::vector<uint8_t> data = test_random_bytes(1000);
+    std::vector<uint8_t> zeros(12345, 0);
+    uint32_t crc = pfs_crc32(data.data(), data.size());
+    PFS_TEST_CHECK(pfs_crc32(zeros.data(), zeros.size(), crc) == ~pfs_crc32_shift(~crc, zeros.size()));
+    PFS_TEST_CHECK(pfs_crc32_shift(pfs_crc32_shift(crc, 100), 12245) == pfs_crc32_shift(crc, 12345));
+
+    // Replacing a single byte changes CRC by the shifted CRC of the difference
+    std::vector<uint8_t> patched = data;
+    patched[10] ^= 0x5A;
+    uint8_t difference = 0x5A;
+    uint32_t delta = pfs_crc32_shift(~pfs_crc32(&difference, 1, ~0U), data.size() - 11);
+    PFS_TEST_CHECK(pfs_crc32(patched.data(), patched.size()) == (crc ^ delta));
+}
+
+static void test_version_sort()
+{
+    const uint16_t low[4] = { 1, 2, 0, 0 };
+    const uint16_t high[4] = { 1, 10, 0, 0 };
+    const uint16_t longer[4] = { 1, 2, 1, 0 };
+    PFS_TEST_CHECK(pfs_version_key((const uint8_t*)"NN  ", low) < pfs_version_key((const uint8_t*)"NN  ", high));
+    PFS_TEST_CHECK(pfs_version_key((const uint8_t*)"NN  ", low) < pfs_version_key((const uint8_t*)"NNN ", longer));
+    PFS_TEST_CHECK(pfs_version_key((const uint8_t*)"NN  ", longer) == pfs_version_key((const uint8_t*)"NN  ", low));
+    PFS_TEST_CHECK(pfs_version_key((const uint8_t*)"    ", high) == 0);
+
+    // Keys differing in every digit, groups above 16 bits and equal entries
+    std::vector<PFS_VERSION_ENTRY> entries;
+    uint64_t keys[] = { 0x0001000200030004ULL, 0x0001000200030005ULL, 0x0002000000000000ULL, 0x0001FFFF00000000ULL, 0x0001000200030004ULL };
+    uint32_t groups[] = { 0x10001, 7, 0x10001, 7, 0x10001 };
+    for (uint32_t i = 0; i < 5; i++) {
+        PFS_VERSION_ENTRY entry = { keys[i], groups[i], i };
+        entries.push_back(entry);
+    }
+    std::vector<PFS_VERSION_ENTRY> sorted = entries;
+    pfs_version_sort(sorted);
+    const uint32_t expected[] = { 1, 3, 0, 4, 2 };
+    for (uint32_t i = 0; i < 5; i++)
+        PFS_TEST_CHECK(sorted[i].item == expected[i]);
+
+    std::vector<PFS_VERSION_ENTRY> latest = pfs_version_latest(entries);
+    PFS_TEST_CHECK(latest.size() == 2 && latest[0].item == 3 && latest[1].item == 2);
+    entries[2].key = keys[0];
+    latest = pfs_version_latest(entries);
+    PFS_TEST_CHECK(latest.size() == 2 && latest[1].item == 4);
+}
+
+static void test_metadata_parse()
+{
+    size_t (*lengths[])(const uint8_t*, size_t) = { pfs_metadata_length, pfs_metadata_length_scalar };
+    for (size_t l = 0; l < 2; l++) {
+        // Values fill their fields exactly, empty fields are skipped, extra bytes are ignored
+        std::string fileVersion(pfsMetadataWidths[2], 'V');
+        const char* values[] = { "0815", "BIOS.exe", fileVersion.c_str(), NULL, "Brand", NULL, "Model", "1.0" };
+        std::vector<uint8_t> region = test_metadata(values, PFS_METADATA_MAX_FIELDS);
+        region.resize(region.size() + 40, 'x');
+        PFS_METADATA metadata;
+        PFS_TEST_CHECK(pfs_metadata_parse(region.data(), (uint32_t)region.size(), metadata, lengths[l]) == 6);
+        PFS_TEST_CHECK(metadata.ignoredSize == 40);
+        PFS_TEST_CHECK(metadata.fields[2].key == 2 && metadata.fields[2].valueLength == fileVersion.size());
+        PFS_TEST_CHECK(metadata.fields[3].key == 4 && metadata.fields[3].valueOffset == pfsMetadataWidths[0] + pfsMetadataWidths[1]
+            + pfsMetadataWidths[2] + pfsMetadataWidths[3]);
+        PFS_TEST_CHECK(!memcmp(region.data() + metadata.fields[3].valueOffset, "Brand", metadata.fields[3].valueLength));
+
+        // Region ending inside the second field cuts it short
+        PFS_TEST_CHECK(pfs_metadata_parse(region.data(), pfsMetadataWidths[0] + 3, metadata, lengths[l]) == 2);
+        PFS_TEST_CHECK(metadata.fields[1].valueLength == 3 && metadata.ignoredSize == 0);
+        PFS_TEST_CHECK(pfs_metadata_parse(region.data(), 0, metadata, lengths[l]) == 0);
+    }
+
+    // Both length functions agree at every position of the NUL
+    std::vector<uint8_t> field(100, 'a');
+    for (size_t i = 0; i <= field.size(); i++) {
+        if (i < field.size())
+            field[i] = 0;
+        PFS_TEST_CHECK(pfs_metadata_length(field.data(), field.size()) == i);
+        PFS_TEST_CHECK(pfs_metadata_length_scalar(field.data(), field.size()) == i);
+        if (i < field.size())
+            field[i] = 'a';
+    }
+}
+
+static void test_bloom()
+{
+    PFS_PLAN plan;
+    std::vector<uint64_t> hashes;
+    for (uint32_t i = 0; i < 500; i++) {
+        std::vector<uint8_t> guid = test_random_bytes(sizeof(EFI_GUID));
+        plan.guids.push_back(*(const EFI_GUID*)guid.data());
+        hashes.push_back(pfs_hash(&i, sizeof(i)));
+    }
+    PFS_BLOOM_HEADER header;
+    std::vector<uint8_t> blocks;
+    pfs_bloom_build(plan, hashes, header, blocks);
+    PFS_TEST_CHECK(header.Signature == PFS_BLOOM_SIGNATURE && header.Items == 1000);
+    PFS_TEST_CHECK(header.Blocks >= PFS_BLOOM_MIN_BLOCKS && !(header.Blocks & (header.Blocks - 1)));
+    PFS_TEST_CHECK((uint64_t)header.Blocks * PFS_BLOOM_BLOCK_SIZE * 8 >= (uint64_t)header.Items * PFS_BLOOM_BITS_PER_ITEM);
+    PFS_TEST_CHECK(blocks.size() == (size_t)header.Blocks * PFS_BLOOM_BLOCK_SIZE);
+
+    // Every added item is found, items of another kind or never added rarely are
+    PFS_BLOOM_PROBE probe;
+    for (size_t i = 0; i < plan.guids.size(); i++) {
+        pfs_bloom_probe(PFS_BLOOM_ITEM_GUID, &plan.guids[i], sizeof(EFI_GUID), header.Blocks, probe);
+        PFS_TEST_CHECK(pfs_bloom_test(&blocks[(size_t)probe.block * PFS_BLOOM_BLOCK_SIZE], probe.mask));
+        pfs_bloom_probe(PFS_BLOOM_ITEM_HASH, &hashes[i], sizeof(uint64_t), header.Blocks, probe);
+        PFS_TEST_CHECK(pfs_bloom_test(&blocks[(size_t)probe.block * PFS_BLOOM_BLOCK_SIZE], probe.mask));
+    }
+    uint32_t falsePositives = 0;
+    for (uint32_t i = 0; i < 10000; i++) {
+        std::vector<uint8_t> item = test_random_bytes(sizeof(EFI_GUID));
+        pfs_bloom_probe(PFS_BLOOM_ITEM_GUID, item.data(), item.size(), header.Blocks, probe);
+        falsePositives += pfs_bloom_test(&blocks[(size_t)probe.block * PFS_BLOOM_BLOCK_SIZE], probe.mask);
+    }
+    PFS_TEST_CHECK(falsePositives < 300);
+
+    // Test needs every bit of mask
+    uint8_t block[PFS_BLOOM_BLOCK_SIZE];
+    uint8_t mask[PFS_BLOOM_BLOCK_SIZE] = { 0 };
+    memset(block, 0xFF, sizeof(block));
+    mask[15] = 0x81;
+    PFS_TEST_CHECK(pfs_bloom_test(block, mask));
+    block[15] = 0x80;
+    PFS_TEST_CHECK(!pfs_bloom_test(block, mask));
+}
+
+static void test_json_parser()
+{
+    PFS_JSON value;
+    PFS_TEST_CHECK(PFS_JSON_PARSER(" { \"name\" : \"a\\\"b\\u00e9\\ud83d\\ude00\", \"list\": [1, -2.5e3, true, false, null, {}, []] } ").parse(value));
+    PFS_TEST_CHECK(value.type == PFS_JSON_OBJECT && value.names.size() == 2);
+    const PFS_JSON* name = value.get("name");
+    PFS_TEST_CHECK(name && name->type == PFS_JSON_STRING && name->string == "a\"b\xC3\xA9\xF0\x9F\x98\x80");
+    const PFS_JSON* list = value.get("list");
+    PFS_TEST_CHECK(list && list->type == PFS_JSON_ARRAY && list->items.size() == 7);
+    if (list && list->items.size() == 7) {
+        PFS_TEST_CHECK(list->items[0].type == PFS_JSON_NUMBER && list->items[0].number == 1);
+        PFS_TEST_CHECK(list->items[1].number == -2500);
+        PFS_TEST_CHECK(list->items[2].type == PFS_JSON_BOOL && list->items[2].boolean);
+        PFS_TEST_CHECK(list->items[3].type == PFS_JSON_BOOL && !list->items[3].boolean);
+        PFS_TEST_CHECK(list->items[4].type == PFS_JSON_NULL);
+        PFS_TEST_CHECK(list->items[5].type == PFS_JSON_OBJECT && list->items[6].type == PFS_JSON_ARRAY);
+    }
+    PFS_TEST_CHECK(!value.get("missing") && !list->get("name"));
+
+    // Syntax errors, unpaired surrogates and nesting deeper than PFS_JSON_MAX_DEPTH are refused
+    const char* invalid[] = { "", "{", "[1,]", "{\"a\" 1}", "\"a", "\"\\x\"", "\"\\ud83d\"", "01x", "+1", "[1] 2", "tru", "\"a\nb\"" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        PFS_JSON ignored;
+        PFS_TEST_CHECK(!PFS_JSON_PARSER(invalid[i]).parse(ignored));
+    }
+    PFS_JSON nested;
+    PFS_TEST_CHECK(PFS_JSON_PARSER(std::string(PFS_JSON_MAX_DEPTH, '[') + std::string(PFS_JSON_MAX_DEPTH, ']')).parse(nested));
+    PFS_TEST_CHECK(!PFS_JSON_PARSER(std::string(PFS_JSON_MAX_DEPTH + 2, '[') + std::string(PFS_JSON_MAX_DEPTH + 2, ']')).parse(nested));
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "--generate"))
+        return test_generate(argv[2]);
+    if (argc == 3 && !strcmp(argv[1], "--check"))
+        return test_check(argv[2]);
+    if (argc != 1) {
+        printf("Usage: pfs_tests [--generate DIRECTORY | --check IMAGE]\n");
+        return 1;
+    }
+
+    test_chunk_table();
+    test_crc32_shift();
+    test_version_sort();
+    test_metadata_parse();
+    test_bloom();
+    test_json_parser();
+    if (testFailures) {
+        printf("%d checks failed\n", testFailures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,71 @@
+# Round trip of --repack and --patch: extract a generated image, change regions and payloads,
+# rebuild the image, extract it again and compare the output files with the changes
+# Run with -DEXTRACTOR=<PFSExtractor> -DTESTS=<pfs_tests> -DWORK=<scratch directory> -P roundtrip.cmake
+
+# Run command and fail unless it returns expected
+FUNCTION(RUN expected)
+ EXECUTE_PROCESS(COMMAND ${ARGN} RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+ IF(NOT "${result}" STREQUAL "${expected}")
+  MESSAGE(FATAL_ERROR "${ARGN} returned ${result}, expected ${expected}:\n${output}")
+ ENDIF()
+ENDFUNCTION()
+
+FUNCTION(SAME first second)
+ EXECUTE_PROCESS(COMMAND ${CMAKE_COMMAND} -E compare_files ${first} ${second} RESULT_VARIABLE result)
+ IF(result)
+  MESSAGE(FATAL_ERROR "${first} differs from ${second}")
+ ENDIF()
+ENDFUNCTION()
+
+# Extract image into <image>.extracted with a fresh copy of it in directory
+FUNCTION(EXTRACT image directory)
+ FILE(REMOVE_RECURSE ${directory})
+ FILE(MAKE_DIRECTORY ${directory})
+ GET_FILENAME_COMPONENT(name ${image} NAME)
+ FILE(COPY ${image} DESTINATION ${directory})
+ RUN(0 ${TESTS} --check ${directory}/${name})
+ RUN(0 ${EXTRACTOR} --manifest ${directory}/${name})
+ENDFUNCTION()
+
+FILE(REMOVE_RECURSE ${WORK})
+FILE(MAKE_DIRECTORY ${WORK})
+RUN(0 ${TESTS} --generate ${WORK})
+EXTRACT(${WORK}/image.bin ${WORK}/source)
+SET(SOURCE ${WORK}/source/image.bin.extracted)
+SET(MANIFEST ${SOURCE}/manifest.json)
+
+# Unchanged files repack into the same image
+RUN(0 ${EXTRACTOR} --repack ${MANIFEST} --output ${WORK}/same.bin)
+SAME(${WORK}/image.bin ${WORK}/same.bin)
+
+# Files of nested images can't be repacked and fail the repack
+FILE(COPY ${SOURCE}/section_2_3.payload.section_0_4.data DESTINATION ${WORK}/saved)
+FILE(COPY ${WORK}/region.new DESTINATION ${WORK}/nested)
+FILE(RENAME ${WORK}/nested/region.new ${SOURCE}/section_2_3.payload.section_0_4.data)
+RUN(11 ${EXTRACTOR} --repack ${MANIFEST} --output ${WORK}/nested.bin)
+FILE(RENAME ${WORK}/saved/section_2_3.payload.section_0_4.data ${SOURCE}/section_2_3.payload.section_0_4.data)
+
+# Patch regions of the same size and of other sizes, other sections stay the same
+RUN(0 ${EXTRACTOR} --patch section=0,region=sign,file=${WORK}/sign.new --patch section=1,region=sign,file=${WORK}/sign.new
+ --patch section=0,region=meta,file=${WORK}/region.new --output ${WORK}/patched.bin ${WORK}/image.bin)
+EXTRACT(${WORK}/patched.bin ${WORK}/patched)
+SET(PATCHED ${WORK}/patched/patched.bin.extracted)
+SAME(${WORK}/sign.new ${PATCHED}/section_0_1.sign)
+SAME(${WORK}/sign.new ${PATCHED}/section_1_2.sign)
+SAME(${WORK}/region.new ${PATCHED}/section_0_1.meta)
+FOREACH(name section_0_1.data section_0_1.mtsg section_1_2.payload section_2_3.payload.section_0_4.data)
+ SAME(${SOURCE}/${name} ${PATCHED}/${name})
+ENDFOREACH()
+
+# Repack a new payload split into chunks again and a region of another size
+FILE(COPY ${WORK}/payload.new ${WORK}/region.new DESTINATION ${WORK}/changed)
+FILE(RENAME ${WORK}/changed/payload.new ${SOURCE}/section_1_2.payload)
+FILE(RENAME ${WORK}/changed/region.new ${SOURCE}/section_0_1.sign)
+RUN(0 ${EXTRACTOR} --repack ${MANIFEST} --output ${WORK}/repacked.bin)
+EXTRACT(${WORK}/repacked.bin ${WORK}/repacked)
+SET(REPACKED ${WORK}/repacked/repacked.bin.extracted)
+SAME(${WORK}/payload.new ${REPACKED}/section_1_2.payload)
+SAME(${WORK}/region.new ${REPACKED}/section_0_1.sign)
+FOREACH(name section_0_1.data section_0_1.meta section_0_1.mtsg section_1_2.sign section_2_3.payload section_2_3.payload.section_0_4.data)
+ SAME(${SOURCE}/${name} ${REPACKED}/${name})
+ENDFOREACH()